@@ -1,6 +1,33 @@
 
 #include "fs.h"
 
+// Maximum number of blocks cached at once, apart from the superblock
+#define BC_NBLOCKS	512
+
+// The blocks cached, apart from the superblock, in no particular
+// order; this includes blocks that are being read in (see bc_reserve)
+static uint32_t bc_blocks[BC_NBLOCKS];
+static uint32_t bc_nmapped;
+// Index in bc_blocks of the next block the CLOCK hand looks at
+static uint32_t bc_hand;
+
+// The dirty blocks, sorted by block number, each with the time it was
+// first written since it was last clean.  Clean blocks are mapped
+// read-only, so the first write to one faults and adds it here (see
+// bc_pgfault); a block's page is writable exactly while it is dirty.
+// Besides the cache proper, the superblock and up to one bitmap block
+// per BLKBITSIZE blocks of disk can be dirty.
+#define BC_NDIRTY	(BC_NBLOCKS + 1 + DISKSIZE / BLKSIZE / BLKBITSIZE)
+
+struct Dirty {
+	uint32_t d_blockno;
+	uint32_t d_since;	// sys_time_msec() when dirtied
+};
+
+static struct Dirty bc_dirty[BC_NDIRTY];
+static int bc_ndirty;
+static uint32_t bc_nhits, bc_nmisses, bc_nevictions, bc_nwritebacks;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -24,15 +51,127 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Return the index of the first dirty block numbered 'blockno' or more.
+static int
+bc_dirty_find(uint32_t blockno)
+{
+	int lo = 0, hi = bc_ndirty, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (bc_dirty[mid].d_blockno < blockno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Add block 'blockno' to the dirty set.
+static void
+bc_mark_dirty(uint32_t blockno)
+{
+	int i = bc_dirty_find(blockno);
+
+	if (i < bc_ndirty && bc_dirty[i].d_blockno == blockno)
+		return;
+	if (bc_ndirty == BC_NDIRTY)
+		panic("bc_mark_dirty: too many dirty blocks");
+	memmove(&bc_dirty[i + 1], &bc_dirty[i], (bc_ndirty - i) * sizeof(bc_dirty[0]));
+	bc_dirty[i].d_blockno = blockno;
+	bc_dirty[i].d_since = sys_time_msec();
+	bc_ndirty++;
+}
+
+// Mark block 'blockno' clean, because its contents have just been read
+// from or queued to be written to disk: map its page read-only, which
+// also clears PTE_D, and take it out of the dirty set.
+void
+bc_clean(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	int i, r;
+
+	if ((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U)) < 0)
+		panic("in bc_clean, sys_page_map: %e", r);
+	i = bc_dirty_find(blockno);
+	if (i < bc_ndirty && bc_dirty[i].d_blockno == blockno) {
+		bc_ndirty--;
+		memmove(&bc_dirty[i], &bc_dirty[i + 1], (bc_ndirty - i) * sizeof(bc_dirty[0]));
+	}
+}
+
+// Allocate a page for block 'blockno' and read the contents of the
+// block from the disk into that page, by way of the I/O queue.
+static void
+bc_read(uint32_t blockno)
+{
+	int r;
+
+	bc_nmisses++;
+	if ((r = bio_read(blockno, 1)) < 0)
+		panic("bc_read: error reading the disk %e", r);
+
+	// Check that the block we read was allocated. (exercise for
+	// the reader: why do we do this *after* reading the block
+	// in?)
+    // Answer: is this because we dont manipulate bitmap in ide_read, so ide_read doesn't actually make the block not free?
+	if (bitmap && block_is_free(blockno))
+		panic("reading free block %08x\n", blockno);
+}
+
+// Where bc_pgfault sends a thread that touched a block not in memory,
+// with the block number and then the faulting eip pushed on its stack.
+// Read the block in with bc_load and go back to the faulting
+// instruction with every register and flag as it was.
+void bc_retry(void);
+asm(".text\n"
+    "bc_retry:\n"
+    "	pushfl\n"
+    "	pushal\n"
+    "	pushl 36(%esp)\n"	// the block number
+    "	call bc_load\n"
+    "	addl $4, %esp\n"
+    "	popal\n"
+    "	popfl\n"
+    "	leal 4(%esp), %esp\n"	// leaves the flags alone
+    "	ret\n");
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
+//
+// Request handlers run in threads (see serve.c), and a thread must not
+// give up the CPU here, on the exception stack that they all share.
+// So the read is not done here: the thread goes on at bc_retry, which
+// reads the block on the thread's own stack, letting other threads run
+// while the disk is busy, and then retries the access.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	uint32_t *esp;
 	int r;
 
+	// A write to a copy-on-write page: a block that we shared with a
+	// client (see bc_share_block), or, outside the block cache, a page
+	// still shared with the timer env we forked at startup.  Switch to
+	// a private copy.
+	if ((utf->utf_err & FEC_WR) && va_is_mapped(addr)
+	    && (uvpt[PGNUM(addr)] & PTE_COW)) {
+		addr = ROUNDDOWN(addr, PGSIZE);
+		if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("bc_pgfault: error allocating page %e", r);
+		memmove(PFTEMP, addr, PGSIZE);
+		if ((r = sys_page_map(0, PFTEMP, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		if ((r = sys_page_unmap(0, PFTEMP)) < 0)
+			panic("in bc_pgfault, sys_page_unmap: %e", r);
+		if (addr >= (void*)DISKMAP && addr < (void*)(DISKMAP + DISKSIZE))
+			bc_mark_dirty(blockno);
+		return;
+	}
+
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("page fault in FS: eip %08x, va %08x, err %04x",
@@ -42,35 +181,201 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
+	// The first write to a clean block
+	if ((utf->utf_err & FEC_WR) && va_is_mapped(addr)) {
+		addr = ROUNDDOWN(addr, PGSIZE);
+		if ((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		bc_mark_dirty(blockno);
+		return;
+	}
+
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
 	// Hint: first round addr to page boundary. fs/ide.c has code to read
 	// the disk.
 	//
 	// LAB 5: you code here:
-    addr = ROUNDDOWN(addr, PGSIZE);
-    if((r = sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W)) < 0)
-        panic("bc_pgfault: error allocating page %e", r);
-    if ((r = ide_read(blockno * BLKSECTS, addr, BLKSECTS)) < 0)
-        panic("bc_pgfault: error reading the disk %e", r);
+	esp = (uint32_t *) utf->utf_esp - 2;
+	esp[0] = blockno;
+	esp[1] = utf->utf_eip;
+	utf->utf_esp = (uintptr_t) esp;
+	utf->utf_eip = (uintptr_t) bc_retry;
+}
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %e", r);
+// Return the address of block 'blockno' in the block cache, reading it
+// in if necessary, and letting other threads run while the disk is
+// busy.  A fault on diskaddr(blockno) comes here too (see bc_pgfault);
+// calling it directly saves the trip through the fault handler.
+void*
+bc_load(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
 
-	// Check that the block we read was allocated. (exercise for
-	// the reader: why do we do this *after* reading the block
-	// in?)
-    // Answer: is this because we dont manipulate bitmap in ide_read, so ide_read doesn't actually make the block not free?
-	if (bitmap && block_is_free(blockno))
-		panic("reading free block %08x\n", blockno);
+	// A block being read in is mapped once its data is there
+	if (!va_is_mapped(addr))
+		bc_read(blockno);
+	else
+		bc_nhits++;
+	return addr;
+}
+
+// The superblock and the bitmap blocks stay cached for good
+static bool
+bc_pinned(uint32_t blockno)
+{
+	return blockno < 2 || !super
+		|| blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Add block 'blockno' to bc_blocks; there must be room.
+static void
+bc_add(uint32_t blockno)
+{
+	if (bc_nmapped >= BC_NBLOCKS)
+		panic("bc_add: block cache full");
+	bc_blocks[bc_nmapped++] = blockno;
+}
+
+// Take the entry at index i out of bc_blocks.
+static void
+bc_remove(uint32_t i)
+{
+	bc_blocks[i] = bc_blocks[--bc_nmapped];
+}
+
+// Make room for one more block, using the CLOCK algorithm.  A block
+// accessed since the hand last passed (PTE_A) gets another turn; a
+// dirty one is queued for write-back and can go once the write is
+// done.  Blocks with transfers outstanding are left alone.  The hand
+// goes round bc_blocks rather than the disk, so a sweep costs at most
+// BC_NBLOCKS steps however large the disk is.
+static void
+bc_evict(void)
+{
+	uint32_t i, j, blockno;
+	void *addr;
+	pte_t pte;
+	int r;
+
+	// Queueing a write can let other threads run and change
+	// bc_blocks, so check the hand each time round
+	for (i = 0; i < 2 * bc_nmapped; i++) {
+		if (bc_hand >= bc_nmapped)
+			bc_hand = 0;
+		j = bc_hand++;
+		blockno = bc_blocks[j];
+		// Blocks in the journal's running transaction must not be
+		// written home yet
+		if (bc_pinned(blockno) || journal_holds(blockno))
+			continue;
+		addr = diskaddr(blockno);
+		if (!va_is_mapped(addr) || bio_pending(blockno))
+			continue;
+		pte = uvpt[PGNUM(addr)];
+		if (pte & PTE_D) {
+			// Queueing the write clears PTE_A as well
+			flush_block_nowait(addr);
+			bc_nwritebacks++;
+		} else if (pte & PTE_A) {
+			if ((r = sys_page_map(0, addr, 0, addr, pte & PTE_SYSCALL)) < 0)
+				panic("in bc_evict, sys_page_map: %e", r);
+		} else {
+			if ((r = sys_page_unmap(0, addr)) < 0)
+				panic("in bc_evict, sys_page_unmap: %e", r);
+			// The last entry moves here, so look at it next
+			bc_remove(j);
+			bc_hand = j;
+			bc_nevictions++;
+			return;
+		}
+	}
+	// Every candidate is waiting to be written back
+	bio_drain();
+}
+
+// Make room in the cache for block 'blockno', which is about to be
+// read in, evicting another block if the cache is full.  The block's
+// page is only mapped once the data is in it (see bc_fill), so that
+// nothing sees it before then.
+void
+bc_reserve(uint32_t blockno)
+{
+	if (blockno < 2)
+		return;
+	while (bc_nmapped >= BC_NBLOCKS)
+		bc_evict();
+	bc_add(blockno);
+}
+
+// Finish a read of block 'blockno' that bc_reserve made room for: map
+// 'pg', which holds the data, as the block's page, read-only since it
+// is clean, and unmap it at 'pg'.  If 'pg' is NULL because the read
+// failed, or the block has been given a page meanwhile, just give the
+// room back.
+void
+bc_fill(uint32_t blockno, void *pg)
+{
+	void *addr = diskaddr(blockno);
+	uint32_t i;
+	int r;
+
+	if (pg && !va_is_mapped(addr)) {
+		if ((r = sys_page_map(0, pg, 0, addr, PTE_P|PTE_U)) < 0)
+			panic("in bc_fill, sys_page_map: %e", r);
+	} else if (blockno >= 2) {
+		for (i = 0; i < bc_nmapped && bc_blocks[i] != blockno; i++)
+			;
+		if (i == bc_nmapped)
+			panic("bc_fill: block %08x has no room", blockno);
+		bc_remove(i);
+	}
+	if (pg && (r = sys_page_unmap(0, pg)) < 0)
+		panic("in bc_fill, sys_page_unmap: %e", r);
+}
+
+// Map a fresh page for block 'blockno', first evicting another block if
+// the cache is full.  Returns the page's address.
+void*
+bc_alloc(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	int r;
+
+	// Let a read-ahead of the block's old contents finish first, so
+	// that it cannot replace the new page
+	if (bio_reading(blockno) && (r = bio_read(blockno, 1)) < 0)
+		panic("bc_alloc: error reading the disk %e", r);
+	if (blockno >= 2) {
+		while (!va_is_mapped(addr) && bc_nmapped >= BC_NBLOCKS)
+			bc_evict();
+		if (!va_is_mapped(addr))
+			bc_add(blockno);
+	}
+	if ((r = sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("bc_alloc: error allocating page %e", r);
+	return addr;
+}
+
+// Return the address of block 'blockno' in the block cache, filled
+// with zeros rather than read from disk.  For newly allocated blocks.
+void*
+bc_zero(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+
+	bc_alloc(blockno);
+	// Mark the block dirty so that it reaches the disk
+	memset(addr, 0, BLKSIZE);
+	bc_mark_dirty(blockno);
+	return addr;
 }
 
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
-// nothing.
+// nothing.  Nor does it write blocks in the journal's running
+// transaction, which reach the disk when it commits.
 // Hint: Use va_is_mapped, va_is_dirty, and ide_write.
 // Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
 // Hint: Don't forget to round addr down.
@@ -84,16 +389,103 @@ flush_block(void *addr)
 		panic("flush_block of bad va %08x", addr);
     void * addr_round = ROUNDDOWN(addr, PGSIZE);
 	// LAB 5: Your code here.
-    if (va_is_mapped(addr_round) && va_is_dirty(addr_round))
+    if (va_is_mapped(addr_round) && va_is_dirty(addr_round)
+        && !journal_holds(blockno))
     {
-        if ((r = ide_write(blockno * BLKSECTS, addr_round, BLKSECTS)) < 0)
+        if ((r = bio_write(blockno, 1)) < 0)
             panic("flush_block: ide_write error %e", r);
-        
-        if ((r = sys_page_map(0, addr_round, 0, addr_round, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-            panic("in bc_pgfault, sys_page_map: %e", r);
     }
 }
 
+// Like flush_block, but only queue the write.  Use bio_drain to wait
+// for it; writes queued together are merged where the blocks are
+// adjacent on disk.
+void
+flush_block_nowait(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+
+	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+		panic("flush_block_nowait of bad va %08x", addr);
+	addr = ROUNDDOWN(addr, PGSIZE);
+	if (va_is_mapped(addr) && va_is_dirty(addr) && !journal_holds(blockno))
+		bio_write(blockno, 0);
+}
+
+// Write back the dirty blocks that have been dirty for at least 'age'
+// milliseconds, in block order, and wait for the writes.  This takes
+// time in proportion to the number of dirty blocks, not the size of
+// the disk.
+void
+bc_sync(uint32_t age)
+{
+	uint32_t now = sys_time_msec(), next = 0;
+	int i;
+
+	// Queueing a write can let other threads run and change the set,
+	// so look each block up afresh
+	while ((i = bc_dirty_find(next)) < bc_ndirty) {
+		next = bc_dirty[i].d_blockno + 1;
+		if (now - bc_dirty[i].d_since >= age)
+			flush_block_nowait(diskaddr(bc_dirty[i].d_blockno));
+	}
+	bio_drain();
+}
+
+// Prepare the cached block containing VA to be mapped into a client
+// without copying.  The block is read in if necessary and flushed if
+// dirty, because remapping the page clears PTE_D.  Our own mapping is
+// then made read-only copy-on-write, so the client never observes
+// later writes to the block: bc_pgfault gives us a private copy first.
+// Returns 0 on success, < 0 on error.
+int
+bc_share_block(void *addr)
+{
+	int r;
+
+	addr = ROUNDDOWN(addr, PGSIZE);
+	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+		panic("bc_share_block of bad va %08x", addr);
+
+	bc_load(((uint32_t) addr - DISKMAP) / BLKSIZE);
+	flush_block(addr);
+	if (uvpt[PGNUM(addr)] & PTE_COW)
+		return 0;
+	return sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_COW);
+}
+
+// Write back and unmap every cached block except the superblock and
+// the bitmap, so that later accesses read the disk again.
+void
+bc_drop(void)
+{
+	uint32_t i;
+
+	journal_commit();
+	bc_sync(0);
+	for (i = 0; i < bc_nmapped; ) {
+		if (bc_pinned(bc_blocks[i])) {
+			i++;
+			continue;
+		}
+		sys_page_unmap(0, diskaddr(bc_blocks[i]));
+		bc_remove(i);
+	}
+}
+
+// Fill in the block cache's statistics.
+void
+bc_stats(struct Fsstats *st)
+{
+	st->st_capacity = BC_NBLOCKS;
+	st->st_cached = bc_nmapped;
+	st->st_hits = bc_nhits;
+	st->st_misses = bc_nmisses;
+	st->st_evictions = bc_nevictions;
+	st->st_writebacks = bc_nwritebacks;
+	bio_stats(&st->st_diskcmds, &st->st_diskblocks);
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -0,0 +1,284 @@
+/*
+ * Block I/O queue.
+ *
+ * All disk transfers for the block cache go through here.  Requests
+ * are for single blocks; the queue merges requests for adjacent
+ * blocks in the same direction into one multi-sector command and
+ * issues them in elevator order (C-LOOK), with a deadline so that no
+ * request is passed over indefinitely.  Callers may submit without
+ * waiting and collect the result later, or not at all.
+ *
+ * There is no separate I/O thread: whoever waits for a request
+ * drives the queue, issuing the next batch whenever the disk is free.
+ */
+
+#include "fs.h"
+
+// Number of requests that can be outstanding at once
+#define NBIO		128
+// Largest merged transfer: ide_read and ide_write move <= 256 sectors
+#define BIO_MAXBLOCKS	(256 * SECTSIZE / BLKSIZE)
+// Number of batches that may be issued ahead of a request before it
+// goes first regardless of the elevator
+#define BIO_MAXSKIPS	8
+// Reads are transferred into pages here, below the request slots (see
+// serv.c), and the pages handed to the block cache once the data is in
+#define BIO_STAGEVA	0x0f000000
+
+enum {
+	BIO_FREE = 0,
+	BIO_QUEUED,		// waiting to be issued
+	BIO_ISSUED,		// part of the transfer in progress
+	BIO_DONE,		// complete, result not yet collected
+};
+
+struct Bio {
+	int b_state;
+	uint32_t b_blockno;
+	bool b_write;
+	int b_result;		// once BIO_DONE: 0 or < 0 on error
+	int b_waiters;		// callers that will collect the result
+	int b_skips;		// batches issued ahead of this request
+};
+
+static struct Bio bios[NBIO];
+static int bio_nqueued;
+// Number of disk commands issued and blocks they moved
+static uint32_t bio_ncmds, bio_nblocks;
+// Set while a batch is being transferred
+static bool bio_running;
+// Last block transferred; the elevator moves up from here
+static uint32_t bio_head;
+
+static struct Bio *
+bio_lookup(uint32_t blockno, bool write, int state)
+{
+	int i;
+
+	for (i = 0; i < NBIO; i++)
+		if (bios[i].b_state == state && bios[i].b_blockno == blockno
+		    && bios[i].b_write == write)
+			return &bios[i];
+	return NULL;
+}
+
+// Choose the request to start the next batch with.
+static struct Bio *
+bio_pick(void)
+{
+	struct Bio *b, *late = NULL, *up = NULL, *low = NULL;
+
+	for (b = bios; b < bios + NBIO; b++) {
+		if (b->b_state != BIO_QUEUED)
+			continue;
+		if (b->b_skips > BIO_MAXSKIPS
+		    && (!late || b->b_skips > late->b_skips))
+			late = b;
+		if (b->b_blockno >= bio_head
+		    && (!up || b->b_blockno < up->b_blockno))
+			up = b;
+		if (!low || b->b_blockno < low->b_blockno)
+			low = b;
+	}
+	if (late)
+		return late;
+	return up ? up : low;
+}
+
+// Issue the next batch: the chosen request and every queued request
+// for adjacent blocks in the same direction, as one disk command.
+static void
+bio_issue(void)
+{
+	struct Bio *run[BIO_MAXBLOCKS], *b;
+	uint32_t lo, hi, i;
+	bool write;
+	char *stage;
+	int n, r;
+
+	b = bio_pick();
+	write = b->b_write;
+	lo = hi = b->b_blockno;
+	run[0] = b;
+	n = 1;
+	while (n < BIO_MAXBLOCKS && (b = bio_lookup(hi + 1, write, BIO_QUEUED))) {
+		run[n++] = b;
+		hi++;
+	}
+	while (n < BIO_MAXBLOCKS && lo > 1
+	       && (b = bio_lookup(lo - 1, write, BIO_QUEUED))) {
+		run[n++] = b;
+		lo--;
+	}
+
+	for (i = 0; i < n; i++)
+		run[i]->b_state = BIO_ISSUED;
+	bio_nqueued -= n;
+	for (b = bios; b < bios + NBIO; b++)
+		if (b->b_state == BIO_QUEUED)
+			b->b_skips++;
+	bio_running = 1;
+	bio_ncmds++;
+	bio_nblocks += n;
+
+	if (write)
+		r = ide_write(lo * BLKSECTS, diskaddr(lo), n * BLKSECTS);
+	else {
+		stage = (char*) BIO_STAGEVA;
+		for (i = 0; i < n; i++)
+			if ((r = sys_page_alloc(0, stage + i * BLKSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0)
+				panic("bio: error allocating page %e", r);
+		r = ide_read(lo * BLKSECTS, stage, n * BLKSECTS);
+		for (i = 0; i < n; i++) {
+			if (r < 0)
+				sys_page_unmap(0, stage + i * BLKSIZE);
+			bc_fill(lo + i, r < 0 ? NULL : stage + i * BLKSIZE);
+		}
+	}
+
+	bio_head = hi;
+	bio_running = 0;
+	for (i = 0; i < n; i++) {
+		b = run[i];
+		if (b->b_waiters) {
+			b->b_result = r;
+			b->b_state = BIO_DONE;
+		} else if (r < 0)
+			panic("bio: error %s block %08x: %e",
+			      write ? "writing" : "reading", b->b_blockno, r);
+		else
+			b->b_state = BIO_FREE;
+	}
+}
+
+// Get closer to completing the outstanding requests: issue a batch if
+// the disk is free, otherwise let the thread using it run.
+static void
+bio_progress(void)
+{
+	if (!bio_running && bio_nqueued) {
+		bio_issue();
+		return;
+	}
+	if (!ide_idle)
+		panic("bio: disk busy and cannot wait");
+	ide_idle();
+}
+
+static struct Bio *
+bio_submit(uint32_t blockno, bool write, bool wait)
+{
+	struct Bio *b;
+	bool reserved = 0;
+
+	if (write)
+		// Mark the block clean now: changes made from here on
+		// dirty it again rather than being lost
+		bc_clean(blockno);
+
+	// Making room and waiting for a free request let other threads
+	// run, so look for a request to join again after each
+	while (1) {
+		// Join a request for the same block that is still to come
+		if ((b = bio_lookup(blockno, write, BIO_QUEUED))
+		    || (!write && (b = bio_lookup(blockno, write, BIO_ISSUED)))) {
+			if (reserved)
+				bc_fill(blockno, NULL);
+			break;
+		}
+		// A new read makes room in the cache for its block now,
+		// while we are still free to wait
+		if (!write && !reserved) {
+			bc_reserve(blockno);
+			reserved = 1;
+			continue;
+		}
+		for (b = bios; b < bios + NBIO; b++)
+			if (b->b_state == BIO_FREE)
+				break;
+		if (b == bios + NBIO) {
+			bio_progress();
+			continue;
+		}
+		b->b_state = BIO_QUEUED;
+		b->b_blockno = blockno;
+		b->b_write = write;
+		b->b_waiters = 0;
+		b->b_skips = 0;
+		bio_nqueued++;
+		break;
+	}
+	if (wait)
+		b->b_waiters++;
+	return b;
+}
+
+static int
+bio_wait(struct Bio *b)
+{
+	int r;
+
+	while (b->b_state != BIO_DONE)
+		bio_progress();
+	r = b->b_result;
+	if (--b->b_waiters == 0)
+		b->b_state = BIO_FREE;
+	return r;
+}
+
+// Read block 'blockno' into a new page, mapped at diskaddr(blockno)
+// once the data is in it (see bc_reserve and bc_fill).
+// If 'wait' is set, wait for the read and return its result;
+// otherwise just queue it and return 0.
+int
+bio_read(uint32_t blockno, bool wait)
+{
+	struct Bio *b = bio_submit(blockno, 0, wait);
+
+	return wait ? bio_wait(b) : 0;
+}
+
+// Write the page at diskaddr(blockno) to block 'blockno' and mark it
+// clean (see bc_clean).  If 'wait' is set, wait for the write and return its
+// result; otherwise just queue it and return 0.  The page must stay
+// mapped until the write completes.
+int
+bio_write(uint32_t blockno, bool wait)
+{
+	struct Bio *b = bio_submit(blockno, 1, wait);
+
+	return wait ? bio_wait(b) : 0;
+}
+
+// Is a read of block 'blockno' queued or in progress?
+bool
+bio_reading(uint32_t blockno)
+{
+	return bio_lookup(blockno, 0, BIO_QUEUED)
+		|| bio_lookup(blockno, 0, BIO_ISSUED);
+}
+
+// Is any transfer of block 'blockno' queued or in progress?
+bool
+bio_pending(uint32_t blockno)
+{
+	return bio_reading(blockno) || bio_lookup(blockno, 1, BIO_QUEUED)
+		|| bio_lookup(blockno, 1, BIO_ISSUED);
+}
+
+// Report the number of disk commands issued and blocks transferred.
+void
+bio_stats(uint32_t *ncmds, uint32_t *nblocks)
+{
+	*ncmds = bio_ncmds;
+	*nblocks = bio_nblocks;
+}
+
+// Wait until every request submitted so far has completed.
+void
+bio_drain(void)
+{
+	while (bio_nqueued || bio_running)
+		bio_progress();
+}
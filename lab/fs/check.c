@@ -0,0 +1,186 @@
+/*
+ * File system consistency check.
+ *
+ * Walks every file from the root and checks that each block it uses
+ * is in range, marked in use in the bitmap and used only once, that
+ * no block pointer lies beyond the end of its file, and that each
+ * block marked in use is used by something.  Problems are reported on
+ * the console; nothing is repaired.
+ */
+
+#include "fs.h"
+
+// Report at most this many problems in detail
+#define CHECK_MAXREPORT	20
+
+// Blocks found in use so far
+static uint32_t check_used[DISKSIZE / BLKSIZE / 32];
+static int check_nproblems;
+
+static void
+problem(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (check_nproblems++ >= CHECK_MAXREPORT)
+		return;
+	cprintf("fs_check: ");
+	va_start(ap, fmt);
+	vcprintf(fmt, ap);
+	va_end(ap);
+	cprintf("\n");
+}
+
+// Note that block 'blockno' is used by file 'f' as 'what'.  Returns
+// true if the block can be examined further.
+static bool
+claim(struct File *f, uint32_t blockno, const char *what)
+{
+	if (blockno == 0)
+		return 0;
+	if (blockno >= super->s_nblocks) {
+		problem("%s: %s %08x out of range", f->f_name, what, blockno);
+		return 0;
+	}
+	if (check_used[blockno / 32] & (1 << (blockno % 32))) {
+		problem("%s: %s %08x used twice", f->f_name, what, blockno);
+		return 0;
+	}
+	check_used[blockno / 32] |= 1 << (blockno % 32);
+	if (block_is_free(blockno))
+		problem("%s: %s %08x marked free", f->f_name, what, blockno);
+	return 1;
+}
+
+// Check block pointer 'blockno' for block 'filebno' of 'f', which has
+// 'nblocks' blocks.
+static void
+check_data(struct File *f, uint32_t filebno, uint32_t nblocks, uint32_t blockno)
+{
+	if (blockno && filebno >= nblocks)
+		problem("%s: block %d beyond the end of the file",
+			f->f_name, filebno);
+	claim(f, blockno, "block");
+}
+
+// Check the pointers in indirect block 'blockno', which describes
+// blocks 'first' and up of 'f'.
+static void
+check_indirect(struct File *f, uint32_t first, uint32_t nblocks, uint32_t blockno)
+{
+	uint32_t i;
+
+	if (!claim(f, blockno, "indirect block"))
+		return;
+	for (i = 0; i < NINDIRECT; i++)
+		check_data(f, first + i, nblocks,
+			   ((uint32_t*) bc_load(blockno))[i]);
+}
+
+static void check_file(struct File *f);
+
+// Check the entries of directory 'dir' and its name index.
+static void
+check_dir(struct File *dir)
+{
+	struct Dirindex *di;
+	uint32_t bno, j, nlive = 0, i;
+	struct File *f;
+	char *blk;
+
+	if (dir->f_size % BLKSIZE) {
+		problem("%s: directory size %d is not a whole number of blocks",
+			dir->f_name, dir->f_size);
+		return;
+	}
+	for (bno = 0; bno < dir->f_size / BLKSIZE; bno++) {
+		if (!file_block_allocated(dir, bno)) {
+			problem("%s: directory block %d missing",
+				dir->f_name, bno);
+			continue;
+		}
+		if (file_get_block(dir, bno, &blk) < 0)
+			continue;
+		for (j = 0; j < BLKFILES; j++) {
+			// Checking a subdirectory can evict this block
+			f = (struct File*) bc_load(((uint32_t) blk - DISKMAP) / BLKSIZE) + j;
+			if (f->f_name[0] == '\0')
+				continue;
+			nlive++;
+			check_file(f);
+		}
+	}
+
+	if (!(super->s_features & FS_FEATURE_DIRINDEX) || !dir->f_dirindex)
+		return;
+	if (!claim(dir, dir->f_dirindex, "index root"))
+		return;
+	di = bc_load(dir->f_dirindex);
+	if (di->di_nblocks == 0 || di->di_nblocks > DIRINDEX_MAXBLOCKS
+	    || (di->di_nblocks & (di->di_nblocks - 1))) {
+		problem("%s: bad index size %d", dir->f_name, di->di_nblocks);
+		return;
+	}
+	for (i = 0; i < di->di_nblocks; i++)
+		claim(dir, ((struct Dirindex*) bc_load(dir->f_dirindex))->di_blocks[i],
+		      "index block");
+	di = bc_load(dir->f_dirindex);
+	if (di->di_nlive != nlive)
+		problem("%s: index has %d entries, directory has %d",
+			dir->f_name, di->di_nlive, nlive);
+}
+
+// Check file 'f' and, for a directory, everything below it.
+static void
+check_file(struct File *f)
+{
+	uint32_t nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE, i, dind;
+
+	if (f->f_size < 0 || f->f_size > MAXFILESIZE_DINDIRECT) {
+		problem("%s: bad size %d", f->f_name, f->f_size);
+		return;
+	}
+	for (i = 0; i < NDIRECT; i++)
+		check_data(f, i, nblocks, f->f_direct[i]);
+	check_indirect(f, NDIRECT, nblocks, f->f_indirect);
+	if ((super->s_features & FS_FEATURE_DINDIRECT)
+	    && claim(f, f->f_dindirect, "double-indirect block")) {
+		dind = f->f_dindirect;
+		for (i = 0; i < NINDIRECT; i++)
+			check_indirect(f, NDIRECT + NINDIRECT + i * NINDIRECT,
+				       nblocks, ((uint32_t*) bc_load(dind))[i]);
+	}
+	if (f->f_type == FTYPE_DIR)
+		check_dir(f);
+}
+
+// Check the file system, after committing any pending changes to it.
+// Returns the number of problems found.
+int
+fs_check(void)
+{
+	uint32_t b;
+	int nleaked = 0;
+
+	fs_sync();
+	memset(check_used, 0, sizeof(check_used));
+	check_nproblems = 0;
+
+	// The boot block, the superblock, the bitmap and the journal
+	for (b = 0; b < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE; b++)
+		check_used[b / 32] |= 1 << (b % 32);
+	if (super->s_features & FS_FEATURE_JOURNAL)
+		for (b = super->s_journal; b < super->s_journal + super->s_njournal; b++)
+			check_used[b / 32] |= 1 << (b % 32);
+
+	check_file(&super->s_root);
+
+	for (b = 0; b < super->s_nblocks; b++)
+		if (!block_is_free(b) && !(check_used[b / 32] & (1 << (b % 32))))
+			nleaked++;
+	if (nleaked)
+		problem("%d blocks marked in use but not used", nleaked);
+
+	cprintf("fs_check: %d problems\n", check_nproblems);
+	return check_nproblems;
+}
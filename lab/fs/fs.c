@@ -17,6 +17,10 @@ check_super(void)
 	if (super->s_nblocks > DISKSIZE/BLKSIZE)
 		panic("file system is too large");
 
+	if (super->s_features & ~FS_FEATURES)
+		panic("file system has unknown features %08x",
+		      super->s_features & ~FS_FEATURES);
+
 	cprintf("superblock is good\n");
 }
 
@@ -36,6 +40,27 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
+// The allocator keeps a count of the free blocks in each group of
+// ALLOC_GROUP blocks, so that searches skip full stretches of the disk
+// without looking at their bitmap words, and a next-fit hint: searches
+// start where the last allocation ended, which keeps successive
+// allocations contiguous and stops every allocation from rescanning the
+// full blocks at the start of the disk.
+#define ALLOC_GROUP	1024		// blocks per group, a multiple of 32
+#define NALLOC_GROUPS	(DISKSIZE / BLKSIZE / ALLOC_GROUP)
+// Largest run alloc_blocks hands out at once
+#define ALLOC_MAXRUN	256
+
+static uint32_t group_free[NALLOC_GROUPS];
+static uint32_t nfree_blocks;
+static uint32_t alloc_hint;
+
+// With a journal, blocks freed in the running transaction are only
+// marked here until it commits, so that they cannot be reused while
+// the committed metadata on disk may still point to them.
+static uint32_t freeing[DISKSIZE / BLKSIZE / 32];
+static bool freeing_any;
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -43,7 +68,97 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	if (block_is_free(blockno) || (freeing[blockno/32] & (1<<(blockno%32))))
+		panic("attempt to free free block %08x", blockno);
+	if (super->s_features & FS_FEATURE_JOURNAL) {
+		freeing[blockno/32] |= 1<<(blockno%32);
+		freeing_any = 1;
+		return;
+	}
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	group_free[blockno / ALLOC_GROUP]++;
+	nfree_blocks++;
+}
+
+// Mark the blocks freed in the running transaction free in the bitmap.
+// Called by journal_commit.
+void
+alloc_release(void)
+{
+	uint32_t i, b;
+
+	if (!freeing_any)
+		return;
+	for (i = 0; i * 32 < super->s_nblocks; i++) {
+		if (!freeing[i])
+			continue;
+		for (b = i * 32; b < i * 32 + 32; b++)
+			if (freeing[i] & (1 << (b % 32))) {
+				group_free[b / ALLOC_GROUP]++;
+				nfree_blocks++;
+			}
+		bitmap[i] |= freeing[i];
+		freeing[i] = 0;
+		journal_write(&bitmap[i]);
+	}
+	freeing_any = 0;
+}
+
+// Search the bitmap for up to 'want' free blocks that are contiguous on
+// disk and allocate them, flushing the changed bitmap blocks.  Looks
+// for a run of 'want' blocks from the next-fit hint onwards, wrapping
+// around once, and settles for the first free run it passed if there
+// is none that long.
+//
+// Sets *pstart to the first block allocated and returns the number
+// allocated (at least 1), or -E_NO_DISK if we are out of blocks.
+int
+alloc_blocks(uint32_t want, uint32_t *pstart)
+{
+	uint32_t nblocks = super->s_nblocks;
+	uint32_t b, n, step = 0, scanned, word, i;
+	uint32_t first = 0, nfirst = 0;
+
+	if (nfree_blocks == 0)
+		return -E_NO_DISK;
+	want = MAX(MIN(want, ALLOC_MAXRUN), 1);
+
+	b = alloc_hint < nblocks ? alloc_hint : 0;
+	for (scanned = 0; scanned < nblocks; scanned += step) {
+		if (b == nblocks)
+			b = 0;
+		// Skip full groups, then full words
+		if (group_free[b / ALLOC_GROUP] == 0)
+			step = ALLOC_GROUP - b % ALLOC_GROUP;
+		else if ((word = bitmap[b / 32] >> (b % 32)) == 0)
+			step = 32 - b % 32;
+		else if ((step = __builtin_ctz(word)) == 0) {
+			// Block b is free; see how far the run goes
+			for (n = 1; n < want && block_is_free(b + n); n++)
+				;
+			if (!nfirst || n == want) {
+				first = b;
+				nfirst = n;
+			}
+			if (n == want)
+				break;
+			step = n;
+		}
+		step = MIN(step, nblocks - b);
+		b += step;
+	}
+	assert(nfirst > 0);
+
+	for (i = first; i < first + nfirst; i++) {
+		bitmap[i / 32] &= ~(1 << (i % 32));
+		group_free[i / ALLOC_GROUP]--;
+	}
+	nfree_blocks -= nfirst;
+	for (i = first / BLKBITSIZE; i <= (first + nfirst - 1) / BLKBITSIZE; i++)
+		journal_write(diskaddr(2 + i));
+	alloc_hint = first + nfirst;
+	*pstart = first;
+	return nfirst;
 }
 
 // Search the bitmap for a free block and allocate it.  When you
@@ -52,28 +167,38 @@ free_block(uint32_t blockno)
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
+	uint32_t blockno;
+	int r;
 
-	// LAB 5: Your code here.
-    int i;
-    for (i = 0; i < super->s_nblocks; i++)
-    {
-        if (block_is_free(i))
-        {
-            bitmap[i/32] &= ~(1<<(i%32));
-            int bitmap_blk = i/BLKBITSIZE + 2;
-            flush_block(diskaddr(bitmap_blk));
-            return i;
-        }
-    }
-	return -E_NO_DISK;
+	if ((r = alloc_blocks(1, &blockno)) < 0)
+		return r;
+	return blockno;
+}
+
+// Return the number of free blocks.
+uint32_t
+free_block_count(void)
+{
+	return nfree_blocks;
+}
+
+// Count the free blocks in each allocation group.
+static void
+alloc_init(void)
+{
+	uint32_t b;
+
+	memset(group_free, 0, sizeof(group_free));
+	nfree_blocks = 0;
+	for (b = 0; b < super->s_nblocks; b++)
+		if (block_is_free(b)) {
+			group_free[b / ALLOC_GROUP]++;
+			nfree_blocks++;
+		}
+	alloc_hint = 0;
 }
 
 // Validate the file system bitmap.
@@ -113,23 +238,54 @@ fs_init(void)
                ide_set_disk(1);
        else
                ide_set_disk(0);
+	if (ide_dma_init() == 0)
+		cprintf("FS: using bus-master DMA\n");
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+	journal_init();
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
+	alloc_init();
 	
 }
 
+// Find slot 'i' of the indirect block whose number is in *pindirect,
+// allocating the indirect block if necessary and 'alloc' is set.
+// Errors are as for file_block_walk.
+static int
+indirect_slot(uint32_t *pindirect, uint32_t i, uint32_t **pslot, bool alloc)
+{
+    int r;
+    if (*pindirect != 0)
+    {
+        *pslot = &((uint32_t *) bc_load(*pindirect))[i];
+    }
+    else if (alloc)
+    {
+        if ((r = alloc_block()) < 0)
+            return r; // -E_NO_DISK
+        *pindirect = r;
+        journal_write(pindirect);
+        *pslot = &((uint32_t *) bc_zero(r))[i];
+        journal_write(*pslot);
+    }
+    else
+        return -E_NOT_FOUND;
+    return 0;
+}
+
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
 // The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// an entry in the indirect block, or, on file systems with
+// FS_FEATURE_DINDIRECT, an entry in one of the indirect blocks that
+// the double-indirect block points to.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -137,7 +293,8 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT,
+//		or NDIRECT + NINDIRECT + NDINDIRECT with double-indirect blocks).
 //
 // Analogy: This is like pgdir_walk for files.
 // Hint: Don't forget to clear any block you allocate.
@@ -146,30 +303,121 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 {
        // LAB 5: Your code here.
     int r;
-    if (filebno >= NDIRECT + NINDIRECT)
-        return -E_INVAL;
-    if (filebno <= NDIRECT)
+    uint32_t *pindirect;
+    if (filebno < NDIRECT)
     {
         *ppdiskbno = &(f->f_direct[filebno]);
+        return 0;
     }
-    else
-    {
-        if (f->f_indirect != 0)
-        {
-            *ppdiskbno = &((uint32_t *) diskaddr(f->f_indirect))[filebno - NDIRECT];
-        }
-        else if (alloc)
-        {
-            if((r = f->f_indirect = alloc_block()) < 0)
-                return r; // -E_NO_DISK
-            memset(diskaddr(f->f_indirect), 0, BLKSIZE);
-            *ppdiskbno = &((uint32_t *) diskaddr(f->f_indirect))[filebno - NDIRECT];
-        }
-        else
-            return -E_NOT_FOUND;
-    }
-    return 0;
+    filebno -= NDIRECT;
+    if (filebno < NINDIRECT)
+        return indirect_slot(&f->f_indirect, filebno, ppdiskbno, alloc);
+    filebno -= NINDIRECT;
+    if (!(super->s_features & FS_FEATURE_DINDIRECT) || filebno >= NDINDIRECT)
+        return -E_INVAL;
+    if ((r = indirect_slot(&f->f_dindirect, filebno / NINDIRECT, &pindirect, alloc)) < 0)
+        return r;
+    return indirect_slot(pindirect, filebno % NINDIRECT, ppdiskbno, alloc);
+}
+
+// Find the run of blocks of file 'f' that starts at block 'filebno'
+// and is contiguous on disk, without allocating anything.  Sets
+// *pdiskbno to the first block's disk block number and returns the
+// length of the run, at most 'max'.  Returns 0 if block 'filebno' is
+// not allocated.  Only one block pointer array (the struct File or an
+// indirect block) is consulted, so this costs one lookup however long
+// the run is.
+static uint32_t
+file_block_run(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t max)
+{
+	uint32_t *slot, n;
+
+	if (file_block_walk(f, filebno, &slot, 0) < 0 || *slot == 0)
+		return 0;
+	// Stop at the end of the array that 'slot' points into
+	if (filebno < NDIRECT)
+		max = MIN(max, NDIRECT - filebno);
+	else if (filebno < NDIRECT + NINDIRECT)
+		max = MIN(max, NDIRECT + NINDIRECT - filebno);
+	else
+		max = MIN(max, NINDIRECT - (filebno - NDIRECT - NINDIRECT) % NINDIRECT);
+	for (n = 1; n < max && slot[n] == slot[0] + n; n++)
+		;
+	*pdiskbno = slot[0];
+	return n;
+}
+
+// Read-ahead.  We remember the last block read from each of the most
+// recently read files.  While a file is read in order we keep up to
+// ra_window blocks past the current one queued or cached, topping the
+// window up in batches of at least half its size so that the queue
+// reads them as a few multi-sector commands.  The window doubles on
+// each refill while the pattern holds and collapses on a seek.
+#define NREADAHEAD	FSNWORKERS
+#define RA_MINWINDOW	4
+#define RA_MAXWINDOW	64
+
+struct Readahead {
+	struct File *ra_file;
+	uint32_t ra_last;	// last block read
+	uint32_t ra_ahead;	// blocks before this are queued or cached
+	uint32_t ra_window;	// 0 until the file is read sequentially
+};
+
+static struct Readahead readahead[NREADAHEAD];
+static int readahead_next;
 
+// Note that blocks filebno through filebno + n - 1 of 'f' are being
+// read, and read ahead if that continues a sequential pattern.  Only
+// the read paths call this: a write would have its target blocks
+// read in just to be overwritten.
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t n)
+{
+	struct Readahead *ra;
+	uint32_t diskbno, end, run, i;
+
+	for (ra = readahead; ra < readahead + NREADAHEAD; ra++)
+		if (ra->ra_file == f)
+			break;
+	if (ra == readahead + NREADAHEAD) {
+		ra = &readahead[readahead_next++ % NREADAHEAD];
+		ra->ra_file = f;
+		ra->ra_last = filebno + n - 1;
+		ra->ra_window = 0;
+		return;
+	}
+
+	if (filebno + n - 1 == ra->ra_last)
+		return;
+	if (filebno != ra->ra_last + 1 && filebno != ra->ra_last) {
+		ra->ra_last = filebno + n - 1;
+		ra->ra_window = 0;
+		return;
+	}
+	filebno = ra->ra_last = filebno + n - 1;
+	if (ra->ra_window == 0) {
+		ra->ra_window = RA_MINWINDOW;
+		ra->ra_ahead = filebno + 1;
+	} else if (ra->ra_ahead > filebno + ra->ra_window / 2)
+		return;
+	else
+		ra->ra_window = MIN(ra->ra_window * 2, RA_MAXWINDOW);
+
+	ra->ra_ahead = MAX(ra->ra_ahead, filebno + 1);
+	end = MIN(filebno + 1 + ra->ra_window,
+		  (f->f_size + BLKSIZE - 1) / BLKSIZE);
+	while (ra->ra_ahead < end) {
+		if ((run = file_block_run(f, ra->ra_ahead, &diskbno,
+					  end - ra->ra_ahead)) == 0) {
+			ra->ra_ahead++;
+			continue;
+		}
+		for (i = 0; i < run; i++)
+			if (!va_is_mapped(diskaddr(diskbno + i)))
+				bio_read(diskbno + i, 0);
+		ra->ra_ahead += run;
+	}
 }
 
 // Set *blk to the address in memory where the filebno'th
@@ -193,11 +441,219 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
         if ((r = alloc_block()) < 0) 
             return r;
         *ppdiskbno = r;
+        journal_write(ppdiskbno);
+        bc_zero(r);
     }
-    *blk = (char *) diskaddr(*ppdiskbno);
+    *blk = (char *) bc_load(*ppdiskbno);
     return 0;
 }
 
+// --------------------------------------------------------------
+// Directory index
+// --------------------------------------------------------------
+
+// Directories this many blocks long or longer get an index (see
+// struct Dirindex) on file systems that support it; shorter ones, and
+// all directories on older file systems, are searched linearly.
+#define DIRINDEX_MINBLOCKS	2
+
+static uint32_t
+name_hash(const char *name)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (uint8_t) *name++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+static bool
+dir_indexed(struct File *dir)
+{
+	return (super->s_features & FS_FEATURE_DIRINDEX) && dir->f_dirindex;
+}
+
+// Set *file to the nth struct File in dir.
+static int
+dir_get_entry(struct File *dir, uint32_t n, struct File **file)
+{
+	char *blk;
+	int r;
+
+	if ((r = file_get_block(dir, n / BLKFILES, &blk)) < 0)
+		return r;
+	*file = (struct File*) blk + n % BLKFILES;
+	return 0;
+}
+
+// Return the address of slot i of the index rooted at block 'root'.
+static uint32_t *
+dirindex_slot(uint32_t root, uint32_t i)
+{
+	struct Dirindex *di = bc_load(root);
+
+	return &((uint32_t*) bc_load(di->di_blocks[i / NDIRINDEX]))[i % NDIRINDEX];
+}
+
+// Look 'name' up in dir's index.  Sets *file to its entry, and *pslot
+// to its slot number if pslot is not null.
+static int
+dirindex_lookup(struct File *dir, const char *name, struct File **file,
+		uint32_t *pslot)
+{
+	uint32_t root = dir->f_dirindex, h = name_hash(name), mask, i, n, v;
+	struct File *f;
+	int r;
+
+	mask = ((struct Dirindex*) bc_load(root))->di_nblocks * NDIRINDEX - 1;
+	for (i = h & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+		v = *dirindex_slot(root, i);
+		if (v == 0)
+			break;
+		if (v == DIRINDEX_DELETED || DIRINDEX_TAG(v) != DIRINDEX_TAG(h))
+			continue;
+		if ((r = dir_get_entry(dir, (v & DIRINDEX_ENTRY) - 1, &f)) < 0)
+			return r;
+		if (strcmp(f->f_name, name) == 0) {
+			*file = f;
+			if (pslot)
+				*pslot = i;
+			return 0;
+		}
+	}
+	return -E_NOT_FOUND;
+}
+
+// Add entry number 'entry', named 'name', to the index rooted at
+// 'root', which must have a free slot.
+static void
+dirindex_put(uint32_t root, uint32_t entry, const char *name)
+{
+	uint32_t h = name_hash(name), mask, i, *slot;
+	struct Dirindex *di;
+
+	mask = ((struct Dirindex*) bc_load(root))->di_nblocks * NDIRINDEX - 1;
+	for (i = h & mask; ; i = (i + 1) & mask) {
+		slot = dirindex_slot(root, i);
+		if (*slot == 0 || *slot == DIRINDEX_DELETED)
+			break;
+	}
+	di = bc_load(root);
+	if (*slot == 0)
+		di->di_nused++;
+	di->di_nlive++;
+	journal_write(di);
+	*slot = DIRINDEX_TAG(h) | (entry + 1);
+	journal_write(slot);
+}
+
+// Free the index rooted at block 'root'.
+static void
+dirindex_free(uint32_t root)
+{
+	struct Dirindex *di = bc_load(root);
+	uint32_t i;
+
+	for (i = 0; i < DIRINDEX_MAXBLOCKS; i++)
+		if (di->di_blocks[i])
+			free_block(di->di_blocks[i]);
+	free_block(root);
+}
+
+// Build a new index for dir from its entries, sized so that it is at
+// most half full even if every entry is used, and replace the old
+// index, if any.  This also clears out deleted slots.
+static int
+dirindex_build(struct File *dir)
+{
+	uint32_t nentries = dir->f_size / sizeof(struct File);
+	uint32_t nblocks, root, old, n;
+	struct Dirindex *di;
+	struct File *f;
+	int r;
+
+	for (nblocks = 1; nblocks * NDIRINDEX < 2 * nentries; nblocks *= 2)
+		;
+	if (nblocks > DIRINDEX_MAXBLOCKS)
+		return -E_NO_DISK;
+
+	if ((r = alloc_block()) < 0)
+		return r;
+	root = r;
+	di = bc_zero(root);
+	di->di_nblocks = nblocks;
+	journal_write(di);
+	for (n = 0; n < nblocks; n++) {
+		if ((r = alloc_block()) < 0)
+			goto fail;
+		((struct Dirindex*) bc_load(root))->di_blocks[n] = r;
+		journal_write(diskaddr(root));
+		journal_write(bc_zero(r));
+	}
+	for (n = 0; n < nentries; n++) {
+		if ((r = dir_get_entry(dir, n, &f)) < 0)
+			goto fail;
+		if (f->f_name[0] != '\0')
+			dirindex_put(root, n, f->f_name);
+	}
+
+	old = dir_indexed(dir) ? dir->f_dirindex : 0;
+	dir->f_dirindex = root;
+	journal_write(dir);
+	if (old)
+		dirindex_free(old);
+	return 0;
+
+fail:
+	dirindex_free(root);
+	return r;
+}
+
+// Add entry number 'entry' of dir, which has just been given the name
+// 'name', to dir's index, building or rebuilding the index as needed.
+static int
+dirindex_insert(struct File *dir, uint32_t entry, const char *name)
+{
+	struct Dirindex *di;
+
+	if (!(super->s_features & FS_FEATURE_DIRINDEX))
+		return 0;
+	if (!dir->f_dirindex)
+		return dir->f_size < DIRINDEX_MINBLOCKS * BLKSIZE ? 0 : dirindex_build(dir);
+	di = bc_load(dir->f_dirindex);
+	if (2 * (di->di_nused + 1) > di->di_nblocks * NDIRINDEX)
+		return dirindex_build(dir);
+	dirindex_put(dir->f_dirindex, entry, name);
+	return 0;
+}
+
+// Remove 'name' from dir's index.
+static int
+dirindex_remove(struct File *dir, const char *name)
+{
+	struct Dirindex *di;
+	struct File *f;
+	uint32_t slot, *p, entry;
+	int r;
+
+	if (!dir_indexed(dir))
+		return 0;
+	if ((r = dirindex_lookup(dir, name, &f, &slot)) < 0)
+		return r;
+	p = dirindex_slot(dir->f_dirindex, slot);
+	entry = (*p & DIRINDEX_ENTRY) - 1;
+	*p = DIRINDEX_DELETED;
+	journal_write(p);
+	di = bc_load(dir->f_dirindex);
+	di->di_nlive--;
+	di->di_freehint = MIN(di->di_freehint, entry);
+	journal_write(di);
+	return 0;
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -210,6 +666,9 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	char *blk;
 	struct File *f;
 
+	if (dir_indexed(dir))
+		return dirindex_lookup(dir, name, file, NULL);
+
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
@@ -228,33 +687,50 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, and *pentry to
+// its entry number.  The caller is responsible for filling in the File
+// fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *pentry)
 {
 	int r;
-	uint32_t nblock, i, j;
+	uint32_t nblock, i, j, first;
 	char *blk;
 	struct File *f;
+	struct Dirindex *di = NULL;
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+	// An indexed directory remembers where its free entries start
+	first = 0;
+	if (dir_indexed(dir)) {
+		di = bc_load(dir->f_dirindex);
+		first = di->di_freehint;
+	}
+	for (i = first / BLKFILES; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
-		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0') {
-				*file = &f[j];
-				return 0;
-			}
+		for (j = (i == first / BLKFILES ? first % BLKFILES : 0); j < BLKFILES; j++)
+			if (f[j].f_name[0] == '\0')
+				goto found;
 	}
+	if (nblock * BLKFILES >= DIRINDEX_ENTRY - 1)
+		return -E_NO_DISK;
 	dir->f_size += BLKSIZE;
+	journal_write(dir);
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
 	f = (struct File*) blk;
-	*file = &f[0];
+	j = 0;
+found:
+	*file = &f[j];
+	*pentry = i * BLKFILES + j;
+	if (di) {
+		di = bc_load(dir->f_dirindex);
+		di->di_freehint = *pentry + 1;
+		journal_write(di);
+	}
 	return 0;
 }
 
@@ -267,6 +743,120 @@ skip_slash(const char *p)
 	return p;
 }
 
+// --------------------------------------------------------------
+// Path lookup cache
+// --------------------------------------------------------------
+
+// walk_path remembers recent results in two direct-mapped tables.  The
+// path table maps whole path strings to what walk_path found for them,
+// including that there is no such file; the name table does the same
+// for a directory and one name in it.  They hold struct File pointers
+// into the block cache, which stay valid because entries never move
+// and only file_remove clears them.  Creating or removing a file drops
+// the name entry for that name and every path entry, since many paths
+// can spell the same file.
+#define NPATHCACHE		128
+#define NNAMECACHE		256
+// Longer paths are not cached
+#define PATHCACHE_MAXLEN	128
+
+struct Pathent {
+	uint32_t pe_gen;		// valid if it equals pathcache_gen
+	char pe_path[PATHCACHE_MAXLEN];
+	int pe_r;			// walk_path's results
+	struct File *pe_dir;
+	struct File *pe_file;
+};
+
+struct Nameent {
+	struct File *ne_dir;		// null if unused
+	char ne_name[MAXNAMELEN];
+	struct File *ne_file;		// null if there is no such file
+};
+
+static struct Pathent pathcache[NPATHCACHE];
+static struct Nameent namecache[NNAMECACHE];
+static uint32_t pathcache_gen = 1;
+
+// Make sure the block holding struct File 'f' is cached, so that
+// touching 'f' does not have to go through a fault (see bc_pgfault).
+static void
+file_touch(struct File *f)
+{
+	if (f && (uintptr_t) f >= DISKMAP)
+		bc_load(((uintptr_t) f - DISKMAP) / BLKSIZE);
+}
+
+static struct Nameent *
+namecache_slot(struct File *dir, const char *name)
+{
+	return &namecache[(name_hash(name) ^ ((uintptr_t) dir >> 8)) % NNAMECACHE];
+}
+
+// Like dir_lookup, but consult and fill in the name table.
+static int
+dir_lookup_cached(struct File *dir, const char *name, struct File **file)
+{
+	struct Nameent *ne = namecache_slot(dir, name);
+	int r;
+
+	if (ne->ne_dir == dir && strcmp(ne->ne_name, name) == 0) {
+		if (!ne->ne_file)
+			return -E_NOT_FOUND;
+		file_touch(ne->ne_file);
+		*file = ne->ne_file;
+		return 0;
+	}
+	r = dir_lookup(dir, name, file);
+	if (r == 0 || r == -E_NOT_FOUND) {
+		ne->ne_dir = dir;
+		strcpy(ne->ne_name, name);
+		ne->ne_file = r == 0 ? *file : NULL;
+	}
+	return r;
+}
+
+// Forget what the caches know about 'name' in 'dir', and all paths.
+static void
+pathcache_invalidate(struct File *dir, const char *name)
+{
+	struct Nameent *ne = namecache_slot(dir, name);
+
+	if (ne->ne_dir == dir && strcmp(ne->ne_name, name) == 0)
+		ne->ne_dir = NULL;
+	pathcache_gen++;
+}
+
+// Forget everything the caches know about 'f', which is going away.
+static void
+pathcache_forget(struct File *dir, struct File *f)
+{
+	int i;
+
+	pathcache_invalidate(dir, f->f_name);
+	// Names looked up in f, if it is a directory
+	for (i = 0; i < NNAMECACHE; i++)
+		if (namecache[i].ne_dir == f)
+			namecache[i].ne_dir = NULL;
+}
+
+// Copy the final element of 'path' into 'elem', as walk_path would.
+static void
+path_last_elem(const char *path, char *elem)
+{
+	const char *end = path + strlen(path), *p;
+
+	while (end > path && end[-1] == '/')
+		end--;
+	for (p = end; p > path && p[-1] != '/'; p--)
+		;
+	memmove(elem, p, end - p);
+	elem[end - p] = '\0';
+}
+
+static int walk_path_uncached(const char *path, struct File **pdir,
+			      struct File **pf, char *lastelem);
+
 // Evaluate a path name, starting at the root.
 // On success, set *pf to the file we found
 // and set *pdir to the directory the file is in.
@@ -275,6 +865,42 @@ skip_slash(const char *p)
 // element into lastelem.
 static int
 walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem)
+{
+	struct Pathent *pe;
+	struct File *dir;
+	int r;
+
+	if (strlen(path) >= PATHCACHE_MAXLEN)
+		return walk_path_uncached(path, pdir, pf, lastelem);
+
+	pe = &pathcache[name_hash(path) % NPATHCACHE];
+	if (pe->pe_gen == pathcache_gen && strcmp(pe->pe_path, path) == 0) {
+		file_touch(pe->pe_dir);
+		file_touch(pe->pe_file);
+		if (pdir)
+			*pdir = pe->pe_dir;
+		*pf = pe->pe_file;
+		if (pe->pe_r < 0 && pe->pe_dir && lastelem)
+			path_last_elem(path, lastelem);
+		return pe->pe_r;
+	}
+
+	r = walk_path_uncached(path, &dir, pf, lastelem);
+	if (pdir)
+		*pdir = dir;
+	if (r == 0 || r == -E_NOT_FOUND) {
+		pe->pe_gen = pathcache_gen;
+		strcpy(pe->pe_path, path);
+		pe->pe_r = r;
+		pe->pe_dir = dir;
+		pe->pe_file = *pf;
+	}
+	return r;
+}
+
+// walk_path without the cache.
+static int
+walk_path_uncached(const char *path, struct File **pdir, struct File **pf, char *lastelem)
 {
 	const char *p;
 	char name[MAXNAMELEN];
@@ -305,7 +931,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dir_lookup_cached(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -333,6 +959,7 @@ int
 file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
+	uint32_t entry;
 	int r;
 	struct File *dir, *f;
 
@@ -340,12 +967,41 @@ file_create(const char *path, struct File **pf)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, &f, &entry)) < 0)
 		return r;
 
 	strcpy(f->f_name, name);
+	journal_write(f);
+	if ((r = dirindex_insert(dir, entry, f->f_name)) < 0) {
+		f->f_name[0] = '\0';
+		return r;
+	}
+	pathcache_invalidate(dir, name);
 	*pf = f;
-	file_flush(dir);
+	return 0;
+}
+
+// Remove a file, and free its blocks.
+int
+file_remove(const char *path)
+{
+	int r;
+	struct File *dir, *f;
+
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
+		return r;
+	if (!dir)
+		return -E_BAD_PATH;
+	if ((r = dirindex_remove(dir, f->f_name)) < 0)
+		return r;
+	pathcache_forget(dir, f);
+
+	if ((r = file_set_size(f, 0)) < 0)
+		return r;
+	if (dir_indexed(f))
+		dirindex_free(f->f_dirindex);
+	memset(f, 0, sizeof(*f));
+	journal_write(f);
 	return 0;
 }
 
@@ -365,7 +1021,7 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 {
 	int r, bn;
 	off_t pos;
-	char *blk;
+	uint32_t filebno, diskbno, run, i;
 
 	if (offset >= f->f_size)
 		return 0;
@@ -373,17 +1029,80 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	count = MIN(count, f->f_size - offset);
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
-			return r;
-		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
-		memmove(buf, blk + pos % BLKSIZE, bn);
-		pos += bn;
-		buf += bn;
+		// Look up the blocks a run at a time
+		filebno = pos / BLKSIZE;
+		run = file_block_run(f, filebno, &diskbno,
+				     (offset + count - 1) / BLKSIZE - filebno + 1);
+		if (run) {
+			file_readahead(f, filebno, run);
+			// Queue the whole run so it is read in one command
+			for (i = 0; i < run; i++)
+				if (!va_is_mapped(diskaddr(diskbno + i)))
+					bio_read(diskbno + i, 0);
+		}
+		for (i = 0; i < MAX(run, 1); i++) {
+			bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+			// A block never written reads as zeros; reads leave the
+			// file system unchanged, so do not allocate it
+			if (run)
+				memmove(buf, (char*) bc_load(diskbno + i) + pos % BLKSIZE, bn);
+			else
+				memset(buf, 0, bn);
+			pos += bn;
+			buf += bn;
+		}
 	}
 
 	return count;
 }
 
+// Is block 'filebno' of 'f' allocated?
+bool
+file_block_allocated(struct File *f, uint32_t filebno)
+{
+	uint32_t *slot;
+
+	return file_block_walk(f, filebno, &slot, 0) == 0 && *slot != 0;
+}
+
+// Allocate zeroed disk blocks for any of blocks filebno through
+// filebno + n - 1 of 'f' that have none, laying each stretch of
+// missing blocks out in as few contiguous runs as the allocator can
+// find.  Returns 0 on success, < 0 on error.
+static int
+file_alloc_range(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t *slot, start, want, got, i;
+	int r;
+
+	while (n > 0) {
+		if (file_block_allocated(f, filebno)) {
+			filebno++;
+			n--;
+			continue;
+		}
+		for (want = 1; want < n; want++)
+			if (file_block_allocated(f, filebno + want))
+				break;
+		if ((r = alloc_blocks(want, &start)) < 0)
+			return r;
+		got = r;
+		for (i = 0; i < got; i++) {
+			if ((r = file_block_walk(f, filebno + i, &slot, 1)) < 0) {
+				// Give back the blocks not in the file yet
+				for (; i < got; i++)
+					free_block(start + i);
+				return r;
+			}
+			*slot = start + i;
+			journal_write(slot);
+			bc_zero(start + i);
+		}
+		filebno += got;
+		n -= got;
+	}
+	return 0;
+}
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -401,6 +1120,13 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 		if ((r = file_set_size(f, offset + count)) < 0)
 			return r;
 
+	// Allocate the blocks of a large write up front, so that they
+	// come out contiguous rather than interleaved with other files'
+	if (count > BLKSIZE
+	    && (r = file_alloc_range(f, offset / BLKSIZE,
+				     (offset + count - 1) / BLKSIZE - offset / BLKSIZE + 1)) < 0)
+		return r;
+
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
@@ -426,6 +1152,7 @@ file_free_block(struct File *f, uint32_t filebno)
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
+		journal_write(ptr);
 	}
 	return 0;
 }
@@ -454,6 +1181,28 @@ file_truncate_blocks(struct File *f, off_t newsize)
 	if (new_nblocks <= NDIRECT && f->f_indirect) {
 		free_block(f->f_indirect);
 		f->f_indirect = 0;
+		journal_write(f);
+	}
+
+	// Free the indirect blocks under the double-indirect block that
+	// are no longer needed, and the double-indirect block itself
+	if ((super->s_features & FS_FEATURE_DINDIRECT) && f->f_dindirect) {
+		uint32_t *dind = bc_load(f->f_dindirect), first, i;
+
+		first = 0;
+		if (new_nblocks > NDIRECT + NINDIRECT)
+			first = ROUNDUP(new_nblocks - NDIRECT - NINDIRECT, NINDIRECT) / NINDIRECT;
+		for (i = first; i < NINDIRECT; i++)
+			if (dind[i]) {
+				free_block(dind[i]);
+				dind[i] = 0;
+				journal_write(dind);
+			}
+		if (first == 0) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+			journal_write(f);
+		}
 	}
 }
 
@@ -464,14 +1213,16 @@ file_set_size(struct File *f, off_t newsize)
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
-	flush_block(f);
+	journal_write(f);
 	return 0;
 }
 
-// Flush the contents and metadata of file f out to disk.
+// Flush the contents of file f out to disk.
 // Loop over all the blocks in file.
 // Translate the file block number into a disk block number
 // and then check whether that disk block is dirty.  If so, write it out.
+// The metadata goes out with the journal's next commit, or has already
+// if there is no journal; fs_sync forces it.
 void
 file_flush(struct File *f)
 {
@@ -482,11 +1233,9 @@ file_flush(struct File *f)
 		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
 		    pdiskbno == NULL || *pdiskbno == 0)
 			continue;
-		flush_block(diskaddr(*pdiskbno));
+		flush_block_nowait(diskaddr(*pdiskbno));
 	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	bio_drain();
 }
 
 
@@ -494,8 +1243,7 @@ file_flush(struct File *f)
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync(0);
+	journal_commit();
 }
 
@@ -1,5 +1,6 @@
 #include <inc/fs.h>
 #include <inc/lib.h>
+#include <arch/thread.h>
 
 #define SECTSIZE	512			// bytes per disk sector
 #define BLKSECTS	(BLKSIZE / SECTSIZE)	// sectors per block
@@ -11,26 +12,60 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Number of requests the server works on at once, each in its own thread */
+#define FSNWORKERS	8
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
 /* ide.c */
+extern void (*ide_idle)(void);
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
+int	ide_dma_init(void);
+bool	ide_dma_inflight(void);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
 
+/* bio.c */
+int	bio_read(uint32_t blockno, bool wait);
+int	bio_write(uint32_t blockno, bool wait);
+bool	bio_reading(uint32_t blockno);
+bool	bio_pending(uint32_t blockno);
+void	bio_stats(uint32_t *ncmds, uint32_t *nblocks);
+void	bio_drain(void);
+
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	flush_block_nowait(void *addr);
+void	bc_reserve(uint32_t blockno);
+void	bc_fill(uint32_t blockno, void *pg);
+void*	bc_alloc(uint32_t blockno);
+void*	bc_load(uint32_t blockno);
+void*	bc_zero(uint32_t blockno);
+void	bc_clean(uint32_t blockno);
+void	bc_sync(uint32_t age);
+void	bc_drop(void);
+int	bc_share_block(void *addr);
+void	bc_stats(struct Fsstats *st);
 void	bc_init(void);
 
+/* journal.c */
+bool	journal_holds(uint32_t blockno);
+void	journal_write(void *addr);
+void	journal_commit(void);
+void	journal_end(void);
+void	journal_stats(uint32_t *ncommits, uint32_t *nlogged);
+void	journal_init(void);
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+void	file_readahead(struct File *f, uint32_t filebno, uint32_t n);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
@@ -39,10 +74,20 @@ int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
+bool	file_block_allocated(struct File *f, uint32_t filebno);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_blocks(uint32_t want, uint32_t *pstart);
+uint32_t free_block_count(void);
+void	alloc_release(void);
+
+/* check.c */
+int	fs_check(void);
+
+/* timer.c */
+void	fs_timer(envid_t fs_envid, uint32_t initial_to);
 
 /* test.c */
 void	fs_test(void);
@@ -1,7 +1,15 @@
 /*
  * JOS file system format
+ *
+ * Lays the image out in two passes.  The first walks the inputs,
+ * building the directories and block pointers in a memory map of the
+ * image and giving each file a contiguous run of blocks.  The second
+ * copies the file contents into their runs, on several threads if
+ * asked to.  Blocks of zeros are never written, so the image is a
+ * sparse file that only takes up the space its contents need.
  */
 
+#define _GNU_SOURCE
 // We don't actually want to define off_t!
 #define off_t xxx_off_t
 #define bool xxx_bool
@@ -14,8 +22,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #undef off_t
 #undef bool
@@ -32,20 +43,36 @@ typedef int bool;
 #include <inc/fs.h>
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
-#define MAX_DIR_ENTS 128
+#define MAX_THREADS 64
+// The file server maps at most 3GB of disk (DISKSIZE in fs/fs.h)
+#define MAX_NBLOCKS (0xC0000000 / BLKSIZE)
 
 struct Dir
 {
 	struct File *f;
 	struct File *ents;
-	int n;
+	int n, max;
+};
+
+// A file whose contents still have to be copied into the image
+struct Job
+{
+	char *path;
+	uint32_t start;		// first block of its run
+	off_t size;
 };
 
 uint32_t nblocks;
 char *diskmap, *diskpos;
+int diskfd;
 struct Super *super;
 uint32_t *bitmap;
 
+struct Job *jobs;
+int njobs, maxjobs, nextjob;
+pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+uint64_t nwritten;		// data blocks written, the rest being zeros
+
 void
 panic(const char *fmt, ...)
 {
@@ -91,7 +118,7 @@ alloc(uint32_t bytes)
 void
 opendisk(const char *name)
 {
-	int r, diskfd, nbitblocks;
+	int r, nbitblocks;
 
 	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
 		panic("open %s: %s", name, strerror(errno));
@@ -104,19 +131,28 @@ opendisk(const char *name)
 			    MAP_SHARED, diskfd, 0)) == MAP_FAILED)
 		panic("mmap %s: %s", name, strerror(errno));
 
-	close(diskfd);
-
 	diskpos = diskmap;
 	alloc(BLKSIZE);
 	super = alloc(BLKSIZE);
 	super->s_magic = FS_MAGIC;
 	super->s_nblocks = nblocks;
+	super->s_features = FS_FEATURE_DINDIRECT | FS_FEATURE_DIRINDEX;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
 
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// Give disks with room to spare a metadata journal
+	if (nblocks >= 8 * JOURNAL_NBLOCKS) {
+		struct Jheader *jh = alloc(JOURNAL_NBLOCKS * BLKSIZE);
+
+		jh->jh_magic = JOURNAL_MAGIC;
+		super->s_journal = blockof(jh);
+		super->s_njournal = JOURNAL_NBLOCKS;
+		super->s_features |= FS_FEATURE_JOURNAL;
+	}
 }
 
 void
@@ -127,8 +163,12 @@ finishdisk(void)
 	for (i = 0; i < blockof(diskpos); ++i)
 		bitmap[i/32] &= ~(1<<(i%32));
 
-	if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
-		panic("msync: %s", strerror(errno));
+	// The metadata pages reach the file when they are unmapped, like
+	// the data that was written to it directly; there is no need to
+	// wait for the disk
+	if ((r = munmap(diskmap, nblocks * BLKSIZE)) < 0)
+		panic("munmap: %s", strerror(errno));
+	close(diskfd);
 }
 
 void
@@ -142,25 +182,45 @@ finishfile(struct File *f, uint32_t start, uint32_t len)
 	if (i == NDIRECT) {
 		uint32_t *ind = alloc(BLKSIZE);
 		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
+		for (; i < len / BLKSIZE && i < NDIRECT + NINDIRECT; ++i)
 			ind[i - NDIRECT] = start + i;
 	}
+	if (i == NDIRECT + NINDIRECT) {
+		uint32_t *dind = alloc(BLKSIZE), *ind = NULL;
+		f->f_dindirect = blockof(dind);
+		for (; i < len / BLKSIZE; ++i) {
+			uint32_t j = i - NDIRECT - NINDIRECT;
+			if (j % NINDIRECT == 0) {
+				ind = alloc(BLKSIZE);
+				dind[j / NINDIRECT] = blockof(ind);
+			}
+			ind[j % NINDIRECT] = start + i;
+		}
+	}
 }
 
 void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
-	dout->n = 0;
+	dout->ents = NULL;
+	dout->n = dout->max = 0;
 }
 
 struct File *
 diradd(struct Dir *d, uint32_t type, const char *name)
 {
-	struct File *out = &d->ents[d->n++];
-	if (d->n > MAX_DIR_ENTS)
-		panic("too many directory entries");
+	struct File *out;
+
+	if (strlen(name) >= MAXNAMELEN)
+		panic("%s: name too long", name);
+	if (d->n == d->max) {
+		d->max = d->max ? 2 * d->max : BLKFILES;
+		if (!(d->ents = realloc(d->ents, d->max * sizeof *d->ents)))
+			panic("out of memory");
+	}
+	out = &d->ents[d->n++];
+	memset(out, 0, sizeof *out);
 	strcpy(out->f_name, name);
 	out->f_type = type;
 	return out;
@@ -177,68 +237,225 @@ finishdir(struct Dir *d)
 	d->ents = NULL;
 }
 
+// Add host file 'path' to 'dir' as 'name', allocating its blocks now
+// and queueing its contents to be copied in later.
 void
-writefile(struct Dir *dir, const char *name)
+writefile(struct Dir *dir, const char *path, const char *name,
+	  struct stat *st)
 {
-	int r, fd;
 	struct File *f;
-	struct stat st;
-	const char *last;
+	struct Job *j;
 	char *start;
 
-	if ((fd = open(name, O_RDONLY)) < 0)
-		panic("open %s: %s", name, strerror(errno));
-	if ((r = fstat(fd, &st)) < 0)
-		panic("stat %s: %s", name, strerror(errno));
-	if (!S_ISREG(st.st_mode))
-		panic("%s is not a regular file", name);
-	if (st.st_size >= MAXFILESIZE)
-		panic("%s too large", name);
-
-	last = strrchr(name, '/');
-	if (last)
-		last++;
+	if (st->st_size >= MAXFILESIZE_DINDIRECT)
+		panic("%s too large", path);
+
+	f = diradd(dir, FTYPE_REG, name);
+	start = alloc(st->st_size);
+	finishfile(f, blockof(start), st->st_size);
+
+	if (njobs == maxjobs) {
+		maxjobs = maxjobs ? 2 * maxjobs : 256;
+		if (!(jobs = realloc(jobs, maxjobs * sizeof *jobs)))
+			panic("out of memory");
+	}
+	j = &jobs[njobs++];
+	if (!(j->path = strdup(path)))
+		panic("out of memory");
+	j->start = blockof(start);
+	j->size = st->st_size;
+}
+
+void writetree(struct Dir *dir, const char *path, const char *name);
+
+// Add host file or directory 'path' to 'dir' as 'name'.
+void
+writepath(struct Dir *dir, const char *path, const char *name)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		panic("stat %s: %s", path, strerror(errno));
+	if (S_ISDIR(st.st_mode))
+		writetree(dir, path, name);
+	else if (S_ISREG(st.st_mode))
+		writefile(dir, path, name, &st);
 	else
-		last = name;
+		panic("%s is not a regular file or directory", path);
+}
+
+// Add host directory 'path', and everything below it, to 'dir' as
+// directory 'name'.
+void
+writetree(struct Dir *dir, const char *path, const char *name)
+{
+	struct Dir sub;
+	struct dirent *de;
+	char *child;
+	DIR *d;
+
+	if (!(d = opendir(path)))
+		panic("opendir %s: %s", path, strerror(errno));
+	startdir(diradd(dir, FTYPE_DIR, name), &sub);
+	while ((de = readdir(d))) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (asprintf(&child, "%s/%s", path, de->d_name) < 0)
+			panic("out of memory");
+		writepath(&sub, child, de->d_name);
+		free(child);
+	}
+	closedir(d);
+	finishdir(&sub);
+}
 
-	f = diradd(dir, FTYPE_REG, last);
-	start = alloc(st.st_size);
-	readn(fd, start, st.st_size);
-	finishfile(f, blockof(start), st.st_size);
+// Copy one queued file into its run of blocks, skipping blocks that are
+// all zeros.  Returns the number of blocks written.
+uint64_t
+copyfile(struct Job *j, char *buf, size_t bufsize)
+{
+	uint64_t nwrote = 0;
+	off_t pos;
+	ssize_t n;
+	size_t i, k;
+	int fd;
+
+	if ((fd = open(j->path, O_RDONLY)) < 0)
+		panic("open %s: %s", j->path, strerror(errno));
+	for (pos = 0; pos < j->size; pos += n) {
+		n = j->size - pos < bufsize ? j->size - pos : bufsize;
+		readn(fd, buf, n);
+		for (i = 0; i < n; i += BLKSIZE) {
+			size_t len = n - i < BLKSIZE ? n - i : BLKSIZE;
+
+			for (k = 0; k < len && buf[i + k] == 0; k++)
+				;
+			if (k == len)
+				continue;
+			if (pwrite(diskfd, buf + i, len,
+				   (off_t) j->start * BLKSIZE + pos + i) != len)
+				panic("write image: %s", strerror(errno));
+			nwrote++;
+		}
+	}
 	close(fd);
+	return nwrote;
+}
+
+// Thread body: copy queued files until there are none left.
+void *
+copier(void *arg)
+{
+	size_t bufsize = 64 * BLKSIZE;
+	uint64_t nwrote = 0;
+	char *buf;
+	int i;
+
+	if (!(buf = malloc(bufsize)))
+		panic("out of memory");
+	while (1) {
+		pthread_mutex_lock(&joblock);
+		i = nextjob++;
+		pthread_mutex_unlock(&joblock);
+		if (i >= njobs)
+			break;
+		nwrote += copyfile(&jobs[i], buf, bufsize);
+	}
+	free(buf);
+	pthread_mutex_lock(&joblock);
+	nwritten += nwrote;
+	pthread_mutex_unlock(&joblock);
+	return NULL;
+}
+
+// Copy all queued files into the image using 'nthreads' threads.
+void
+copyfiles(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	int i, r;
+
+	if (nthreads <= 1) {
+		copier(NULL);
+		return;
+	}
+	for (i = 0; i < nthreads; i++)
+		if ((r = pthread_create(&threads[i], NULL, copier, NULL)) != 0)
+			panic("pthread_create: %s", strerror(r));
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat [-v] [-j nthreads] fs.img NBLOCKS files-or-directories...\n");
 	exit(2);
 }
 
+double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
 int
 main(int argc, char **argv)
 {
-	int i;
+	int i, c, nthreads = 1, verbose = 0;
+	const char *last;
 	char *s;
 	struct Dir root;
+	double t0, t1, t2;
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
-	if (argc < 3)
+	while ((c = getopt(argc, argv, "vj:")) != -1) {
+		switch (c) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, &s, 0);
+			if (*s || s == optarg || nthreads < 1 || nthreads > MAX_THREADS)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2)
 		usage();
 
-	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	nblocks = strtol(argv[1], &s, 0);
+	if (*s || s == argv[1] || nblocks < 2 || nblocks > MAX_NBLOCKS)
 		usage();
 
-	opendisk(argv[1]);
+	t0 = now();
+	opendisk(argv[0]);
 
+	// Each input goes in the root under its last path element
 	startdir(&super->s_root, &root);
-	for (i = 3; i < argc; i++)
-		writefile(&root, argv[i]);
+	for (i = 2; i < argc; i++) {
+		last = strrchr(argv[i], '/');
+		writepath(&root, argv[i], last ? last + 1 : argv[i]);
+	}
 	finishdir(&root);
+	t1 = now();
 
+	copyfiles(nthreads);
 	finishdisk();
+	t2 = now();
+
+	if (verbose)
+		fprintf(stderr, "fsformat: %d files, %u of %u blocks used, "
+			"%llu data blocks written; layout %.3fs, copy %.3fs "
+			"(%d threads)\n", njobs, blockof(diskpos), nblocks,
+			(unsigned long long) nwritten, t1 - t0, t2 - t1, nthreads);
 	return 0;
 }
-
@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.  Transfers use bus-master DMA with
+ * interrupt-driven completion if the kernel found a PIIX controller,
+ * and PIO otherwise.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -14,13 +16,50 @@
 
 static int diskno = 1;
 
+// If set, called repeatedly while we wait for the disk, so that the
+// caller can get other work done meanwhile.  Another ide_read or
+// ide_write may start from ide_idle; it waits for the disk in turn.
+void (*ide_idle)(void);
+
+// Set while a command is in progress
+static volatile bool ide_busy;
+
+// Bus-master DMA registers, relative to the base the kernel reports
+#define BM_CMD		0	// command
+#define BM_STATUS	2	// status
+#define BM_PRDT		4	// physical address of the PRD table
+
+#define BM_CMD_START	0x01	// start the transfer
+#define BM_CMD_READ	0x08	// transfer from the disk to memory
+#define BM_STATUS_ERR	0x02	// transfer failed (write 1 to clear)
+#define BM_STATUS_INTR	0x04	// drive raised its interrupt (ditto)
+
+// Physical region descriptor: one physically contiguous piece of a
+// DMA transfer.  The table describing a transfer must not cross a
+// 64 KB boundary, nor may any piece.
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_count;	// bytes
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// last entry in the table
+
+// Bus-master register base, or 0 if we use PIO
+static uint16_t bmbase;
+// A transfer of up to 256 sectors touches at most this many pages
+static struct Prd prdt[256 * SECTSIZE / PGSIZE + 1] __attribute__((aligned(PGSIZE)));
+static uint32_t prdt_pa;
+// Set while a DMA transfer waits for its interrupt
+static volatile bool ide_dma_waiting;
+
 static int
 ide_wait_ready(bool check_error)
 {
 	int r;
 
 	while (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
-		/* do nothing */;
+		if (ide_idle)
+			ide_idle();
 
 	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
 		return -1;
@@ -59,30 +98,135 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
-
+// Switch to bus-master DMA if the kernel found a controller that can
+// do it, and have the disk's interrupt delivered to us.
+// Returns 0 on success, < 0 if we stay with PIO.
 int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+ide_dma_init(void)
 {
-	int r;
+	int base, r;
 
-	assert(nsecs <= 256);
+	if ((base = sys_ide_dma_base()) < 0)
+		return base;
+	if ((r = sys_page_paddr(prdt)) < 0)
+		return r;
+	prdt_pa = r;
+	if ((r = sys_irq_register(IRQ_IDE)) < 0)
+		return r;
+	// Make sure the drive raises interrupts (clear nIEN)
+	outb(0x3F6, 0);
+	bmbase = base;
+	return 0;
+}
 
-	ide_wait_ready(0);
+// Is a DMA transfer waiting for the disk's interrupt?  If so, nothing
+// happens with the disk until the interrupt arrives.
+bool
+ide_dma_inflight(void)
+{
+	return ide_dma_waiting;
+}
 
+// Claim the disk for one command, waiting for any command that another
+// caller started to finish first.
+static void
+ide_lock(void)
+{
+	while (ide_busy) {
+		if (!ide_idle)
+			panic("ide: disk busy and cannot wait");
+		ide_idle();
+	}
+	ide_busy = 1;
+}
+
+static void
+ide_command(uint32_t secno, size_t nsecs, uint8_t cmd)
+{
 	outb(0x1F2, nsecs);
 	outb(0x1F3, secno & 0xFF);
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F7, cmd);
+}
+
+// Transfer 'nsecs' sectors starting at 'secno' between the disk and
+// the pages at 'va' by bus-master DMA.  The pages must stay mapped,
+// and must not be shared copy-on-write when reading, until we return.
+// The CPU is free for other threads and environments meanwhile.
+static int
+ide_dma(uint32_t secno, void *va, size_t nsecs, bool write)
+{
+	uint8_t cmd = write ? 0 : BM_CMD_READ;
+	size_t len, n;
+	int i, r, st;
+
+	// Describe the buffer one page at a time
+	len = nsecs * SECTSIZE;
+	for (i = 0; len > 0; i++, va += n, len -= n) {
+		n = MIN(len, PGSIZE - PGOFF(va));
+		if ((r = sys_page_paddr(va)) < 0)
+			return r;
+		prdt[i].prd_addr = r;
+		prdt[i].prd_count = n;
+		prdt[i].prd_flags = 0;
+	}
+	prdt[i - 1].prd_flags = PRD_EOT;
+
+	ide_wait_ready(0);
+	outl(bmbase + BM_PRDT, prdt_pa);
+	outb(bmbase + BM_CMD, cmd);
+	outb(bmbase + BM_STATUS, inb(bmbase + BM_STATUS) | BM_STATUS_ERR | BM_STATUS_INTR);
+	sys_irq_ack(IRQ_IDE);
+	ide_command(secno, nsecs, write ? 0xCA : 0xC8);	// WRITE/READ DMA
+	outb(bmbase + BM_CMD, cmd | BM_CMD_START);
+
+	ide_dma_waiting = 1;
+	while (!(thisenv->env_irq_pending & (1 << IRQ_IDE))) {
+		if (ide_idle)
+			ide_idle();
+		else
+			sys_irq_wait();
+	}
+	ide_dma_waiting = 0;
+	sys_irq_ack(IRQ_IDE);
+
+	st = inb(bmbase + BM_STATUS);
+	outb(bmbase + BM_CMD, 0);
+	// Reading the status register acknowledges the drive's interrupt
+	r = inb(0x1F7);
+	outb(bmbase + BM_STATUS, st | BM_STATUS_ERR | BM_STATUS_INTR);
+	if ((st & BM_STATUS_ERR) || (r & (IDE_DF|IDE_ERR)))
+		return -1;
+	return 0;
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256);
+
+	ide_lock();
+	if (bmbase) {
+		r = ide_dma(secno, dst, nsecs, 0);
+		goto out;
+	}
+	ide_wait_ready(0);
+	ide_command(secno, nsecs, 0x20);	// CMD 0x20 means read sector
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
-			return r;
+			goto out;
 		insl(0x1F0, dst, SECTSIZE/4);
 	}
+	r = 0;
 
-	return 0;
+out:
+	ide_busy = 0;
+	return r;
 }
 
 int
@@ -92,21 +236,23 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	ide_lock();
+	if (bmbase) {
+		r = ide_dma(secno, (void*) src, nsecs, 1);
+		goto out;
+	}
 	ide_wait_ready(0);
-
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	ide_command(secno, nsecs, 0x30);	// CMD 0x30 means write sector
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
-			return r;
+			goto out;
 		outsl(0x1F0, src, SECTSIZE/4);
 	}
+	r = 0;
 
-	return 0;
+out:
+	ide_busy = 0;
+	return r;
 }
 
@@ -0,0 +1,216 @@
+/*
+ * Metadata journal.
+ *
+ * Changes to metadata blocks -- the superblock, the bitmap, directory
+ * blocks, indirect blocks and directory indexes -- are collected into
+ * a running transaction instead of being written in place.  Blocks in
+ * the transaction stay in the cache and are never written home on
+ * their own.  Committing writes copies of all of them to the journal
+ * in one sequential transfer followed by a header that lists them,
+ * and only then writes them home.  A crash at any point leaves either
+ * the old metadata or a complete transaction to replay at fs_init.
+ *
+ * Many requests share one transaction: it commits when it is half
+ * full, on sync, and from the writeback timer.  Closing a file only
+ * writes its data, so a close does not cost a commit.  Commits only
+ * happen between requests that change the file system, so that a
+ * transaction never holds half of one (unless a single request changes
+ * more blocks than the journal holds).
+ *
+ * File data is not journaled.  Data written shortly before a crash may
+ * be lost or, in a block allocated just before the crash, show the
+ * block's old contents, but the structure of the file system is
+ * always consistent.
+ */
+
+#include "fs.h"
+
+// Committed transactions and the blocks they logged
+static uint32_t jn_ncommits, jn_nlogged;
+// Largest transaction the journal can hold; 0 if there is no journal
+static uint32_t jn_max;
+static uint32_t jn_seq;
+// The running transaction
+static uint32_t jn_blocks[JOURNAL_MAXBLOCKS];
+static uint32_t jn_n;
+// Set while the commit releases freed blocks, and while it writes
+static bool jn_releasing, jn_committing;
+
+static uint32_t
+journal_sum(struct Jheader *jh)
+{
+	uint32_t sum = 2166136261u, i, j, *w;
+
+	sum = (sum ^ jh->jh_seq) * 16777619;
+	sum = (sum ^ jh->jh_nblocks) * 16777619;
+	for (i = 0; i < jh->jh_nblocks; i++) {
+		sum = (sum ^ jh->jh_blocknos[i]) * 16777619;
+		w = diskaddr(super->s_journal + 1 + i);
+		for (j = 0; j < BLKSIZE / 4; j++)
+			sum = (sum ^ w[j]) * 16777619;
+	}
+	return sum;
+}
+
+// Is block 'blockno' part of the running transaction?
+bool
+journal_holds(uint32_t blockno)
+{
+	uint32_t i;
+
+	for (i = 0; i < jn_n; i++)
+		if (jn_blocks[i] == blockno)
+			return 1;
+	return 0;
+}
+
+// Note that the metadata block containing 'addr' has changed, so that
+// the change reaches the disk with the running transaction.  Call this
+// as soon as the block has been changed, before anything that could
+// make room in the block cache.  Without a journal, the block is
+// written back at once.
+void
+journal_write(void *addr)
+{
+	uint32_t blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE;
+
+	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+		panic("journal_write of bad va %08x", addr);
+	if (!jn_max) {
+		flush_block(addr);
+		return;
+	}
+	if (journal_holds(blockno))
+		return;
+	if (jn_committing)
+		panic("journal_write of block %08x during commit", blockno);
+	// Leave room for the bitmap blocks that the commit's deferred
+	// frees may add
+	if (!jn_releasing && jn_n + 2 + super->s_nblocks / BLKBITSIZE >= jn_max)
+		journal_commit();
+	jn_blocks[jn_n++] = blockno;
+}
+
+// Commit the running transaction and write its blocks home.  Must not
+// run alongside a request that changes the file system.
+void
+journal_commit(void)
+{
+	struct Jheader *jh;
+	uint32_t i;
+	int r;
+
+	if (!jn_max || jn_committing)
+		return;
+	// Blocks freed in this transaction become free with it
+	jn_releasing = 1;
+	alloc_release();
+	jn_releasing = 0;
+	if (jn_n == 0)
+		return;
+	jn_committing = 1;
+
+	// Copy the blocks to the journal.  Each write is queued as soon
+	// as its copy is made, which keeps the copy cached until it is on
+	// disk; the header goes last and the writes merge into one.
+	for (i = 0; i < jn_n; i++) {
+		memmove(bc_alloc(super->s_journal + 1 + i),
+			diskaddr(jn_blocks[i]), BLKSIZE);
+		bio_write(super->s_journal + 1 + i, 0);
+	}
+	jh = bc_alloc(super->s_journal);
+	memset(jh, 0, BLKSIZE);
+	jh->jh_magic = JOURNAL_MAGIC;
+	jh->jh_seq = ++jn_seq;
+	jh->jh_nblocks = jn_n;
+	memmove(jh->jh_blocknos, jn_blocks, jn_n * sizeof(jn_blocks[0]));
+	jh->jh_sum = journal_sum(jh);
+	if ((r = bio_write(super->s_journal, 1)) < 0)
+		panic("journal_commit: error writing the journal: %e", r);
+	bio_drain();
+
+	// The transaction is committed; put the blocks in place
+	for (i = 0; i < jn_n; i++)
+		bio_write(jn_blocks[i], 0);
+	bio_drain();
+
+	// Then retire the header, before any block it lists can be
+	// reused for something that must not be overwritten by a replay
+	jh = bc_alloc(super->s_journal);
+	memset(jh, 0, BLKSIZE);
+	jh->jh_magic = JOURNAL_MAGIC;
+	jh->jh_seq = jn_seq;
+	if ((r = bio_write(super->s_journal, 1)) < 0)
+		panic("journal_commit: error writing the journal: %e", r);
+
+	jn_ncommits++;
+	jn_nlogged += jn_n;
+	jn_n = 0;
+	jn_committing = 0;
+}
+
+// Called after each request that may change the file system: commit
+// once the transaction is half full.
+void
+journal_end(void)
+{
+	if (jn_max && jn_n >= jn_max / 2)
+		journal_commit();
+}
+
+// Report the number of transactions committed and blocks logged.
+void
+journal_stats(uint32_t *ncommits, uint32_t *nlogged)
+{
+	*ncommits = jn_ncommits;
+	*nlogged = jn_nlogged;
+}
+
+// Find the journal, and replay the last transaction if it was
+// committed but may not have reached its home blocks.
+void
+journal_init(void)
+{
+	struct Jheader *jh;
+	uint32_t i, blockno;
+	int r;
+
+	if (!(super->s_features & FS_FEATURE_JOURNAL))
+		return;
+	if (super->s_journal < 2 || super->s_njournal < 2
+	    || super->s_journal + super->s_njournal > super->s_nblocks)
+		panic("journal is out of range");
+	jn_max = MIN(super->s_njournal - 1, JOURNAL_MAXBLOCKS);
+
+	jh = bc_load(super->s_journal);
+	if (jh->jh_magic != JOURNAL_MAGIC)
+		return;
+	jn_seq = jh->jh_seq;
+	if (jh->jh_nblocks == 0)
+		return;
+	for (i = 0; i < jh->jh_nblocks && i < jn_max; i++)
+		bc_load(super->s_journal + 1 + i);
+	if (jh->jh_nblocks > jn_max || journal_sum(jh) != jh->jh_sum) {
+		// The crash came before the commit finished
+		cprintf("journal: discarding incomplete transaction %d\n",
+			jh->jh_seq);
+		return;
+	}
+
+	for (i = 0; i < jh->jh_nblocks; i++) {
+		blockno = jh->jh_blocknos[i];
+		if (blockno < 1 || blockno >= super->s_nblocks)
+			panic("journal: bad block %08x in transaction %d",
+			      blockno, jh->jh_seq);
+		memmove(bc_alloc(blockno), diskaddr(super->s_journal + 1 + i),
+			BLKSIZE);
+		bio_write(blockno, 0);
+	}
+	bio_drain();
+	cprintf("journal: replayed transaction %d (%d blocks)\n",
+		jh->jh_seq, jh->jh_nblocks);
+
+	jh->jh_nblocks = 0;
+	if ((r = bio_write(super->s_journal, 1)) < 0)
+		panic("journal_init: error writing the journal: %e", r);
+}
@@ -45,8 +45,42 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Every WRITEBACK_INTERVAL ms the timer env has us write back the
+// blocks that have been dirty for WRITEBACK_AGE ms or more.
+#define WRITEBACK_INTERVAL	1000
+#define WRITEBACK_AGE		3000
+
+static envid_t timer_envid;
+
+// The server works on up to FSNWORKERS requests at once, each in its
+// own worker thread and request slot.  A worker that has to wait for
+// the disk lets the others run (see bc_load), so requests that hit in
+// the block cache do not queue up behind misses.
+struct Fsslot {
+	envid_t s_whom;		// client
+	uint32_t s_req;		// request type
+	union Fsipc *s_ipc;	// request page; vectored write data follows
+	size_t s_npages;	// number of pages received with the request
+	void *s_vecva;		// where to assemble a vectored read reply
+	bool s_busy;		// request pending or in progress
+	// While the worker waits: whether it can go on, or NULL if it
+	// can (see worker_park)
+	bool (*s_ready)(void);
+};
+
+// Slot i receives requests at FSSLOTVA + i*FSSLOTSIZE and assembles
+// vectored read replies in the second half of that range.
+#define FSSLOTVA	0x0f800000
+#define FSSLOTSIZE	(4 * FSVEC_MAXPAGES * PGSIZE)
+
+struct Fsslot slots[FSNWORKERS];
+int nbusy;
+// The slot of the worker that is running
+static struct Fsslot *curslot;
+
+// Requests that change the file system run alone; others share.
+static int fs_readers;
+static bool fs_writer;
 
 void
 serve_init(void)
@@ -58,6 +92,10 @@ serve_init(void)
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
+	for (i = 0; i < FSNWORKERS; i++) {
+		slots[i].s_ipc = (union Fsipc*) (FSSLOTVA + i * FSSLOTSIZE);
+		slots[i].s_vecva = (char*) slots[i].s_ipc + FSSLOTSIZE / 2;
+	}
 }
 
 // Allocate an open file.
@@ -92,6 +130,10 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	o = &opentab[fileid % MAXOPEN];
 	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
 		return -E_INVAL;
+	// The struct File lives in a directory block, which may have been
+	// dropped from the cache since the file was opened
+	if ((uintptr_t) o->o_file >= DISKMAP)
+		bc_load(((uintptr_t) o->o_file - DISKMAP) / BLKSIZE);
 	*po = o;
 	return 0;
 }
@@ -133,6 +175,8 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 				cprintf("file_create failed: %e", r);
 			return r;
 		}
+		f->f_type = (req->req_omode & O_MKDIR) ? FTYPE_DIR : FTYPE_REG;
+		journal_write(f);
 	} else {
 try_open:
 		if ((r = file_open(path, &f)) < 0) {
@@ -224,6 +268,115 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	return r;
 }
 
+// Like serve_read, but avoid copying the data when possible: if the
+// seek position is block-aligned and at least a whole block of the file
+// remains, share the block-cache page holding it with the caller,
+// read-only and copy-on-write, by setting *pg_store and *perm_store.
+// Otherwise fall back to returning the bytes in ipc->readRet.
+// Returns the number of bytes read, or < 0 on error.
+int
+serve_read_map(envid_t envid, union Fsipc *ipc,
+	       void **pg_store, int *perm_store)
+{
+	struct Fsreq_read *req = &ipc->read;
+	struct OpenFile *o;
+	off_t offset;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	offset = o->o_fd->fd_offset;
+	// Blocks never written have no page to share, and reads must
+	// not allocate them
+	if (offset % BLKSIZE != 0 || req->req_n < BLKSIZE
+	    || o->o_file->f_size - offset < BLKSIZE
+	    || !file_block_allocated(o->o_file, offset / BLKSIZE))
+		return serve_read(envid, ipc);
+
+	file_readahead(o->o_file, offset / BLKSIZE, 1);
+	if ((r = file_get_block(o->o_file, offset / BLKSIZE, &blk)) < 0)
+		return r;
+	if ((r = bc_share_block(blk)) < 0)
+		return r;
+	o->o_fd->fd_offset += BLKSIZE;
+
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U|PTE_COW;
+	return BLKSIZE;
+}
+
+static void
+unmap_pages(void *va, size_t npages)
+{
+	size_t i;
+
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, va + i * PGSIZE);
+}
+
+// Read at most ipc->vec.req_n bytes from the current seek position in
+// ipc->vec.req_fileid and return them in a single reply of up to
+// FSVEC_MAXPAGES pages, mapped at vecva, setting *pg_store,
+// *npages_store and *perm_store.  Like serve_read_map, the reply pages are the
+// block-cache pages themselves, shared read-only and copy-on-write;
+// the data starts at byte ipc->vec.req_pgoff of the first page.
+// Updates the seek position.  Returns the number of bytes read, or
+// < 0 on error.
+int
+serve_readv(envid_t envid, union Fsipc *ipc, void *vecva,
+	    void **pg_store, size_t *npages_store, int *perm_store)
+{
+	struct Fsreq_vec *req = &ipc->vec;
+	struct OpenFile *o;
+	off_t offset, end;
+	uint32_t bno;
+	size_t i;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_readv %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	offset = o->o_fd->fd_offset;
+	req->req_pgoff = offset % BLKSIZE;
+	if (offset >= o->o_file->f_size)
+		return 0;
+	end = MIN(o->o_file->f_size, offset + req->req_n);
+	end = MIN(end, offset - offset % BLKSIZE + FSVEC_MAXPAGES * BLKSIZE);
+	file_readahead(o->o_file, offset / BLKSIZE,
+		       (end - 1) / BLKSIZE - offset / BLKSIZE + 1);
+
+	for (i = 0, bno = offset / BLKSIZE; bno * BLKSIZE < end; i++, bno++) {
+		// A block never written reads as a page of zeros
+		if (!file_block_allocated(o->o_file, bno)) {
+			if ((r = sys_page_alloc(0, vecva + i * PGSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0) {
+				unmap_pages(vecva, i);
+				return r;
+			}
+			continue;
+		}
+		if ((r = file_get_block(o->o_file, bno, &blk)) < 0
+		    || (r = bc_share_block(blk)) < 0
+		    || (r = sys_page_map(0, blk, 0, vecva + i * PGSIZE,
+					 PTE_P|PTE_U|PTE_COW)) < 0) {
+			unmap_pages(vecva, i);
+			return r;
+		}
+	}
+	o->o_fd->fd_offset = end;
+
+	*pg_store = vecva;
+	*npages_store = i;
+	*perm_store = PTE_P|PTE_U|PTE_COW;
+	return end - offset;
+}
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -247,6 +400,33 @@ serve_write(envid_t envid, struct Fsreq_write *req)
     return r;
 }
 
+// Write ipc->vec.req_n bytes to ipc->vec.req_fileid at the current
+// seek position, and update the seek position accordingly.  The bytes
+// start at offset ipc->vec.req_pgoff of the data pages that were sent
+// along with the request page, 'npages' pages in all.  Extend the file
+// if necessary.  Returns the number of bytes written, or < 0 on error.
+int
+serve_writev(envid_t envid, union Fsipc *ipc, size_t npages)
+{
+	struct Fsreq_vec *req = &ipc->vec;
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_writev %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_pgoff >= PGSIZE || req->req_n > FSVEC_MAXPAGES * PGSIZE
+	    || req->req_pgoff + req->req_n > (npages - 1) * PGSIZE)
+		return -E_INVAL;
+
+	if ((r = file_write(o->o_file, (char*) ipc + PGSIZE + req->req_pgoff,
+			    req->req_n, o->o_fd->fd_offset)) >= 0)
+		o->o_fd->fd_offset += r;
+	return r;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -269,7 +449,7 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	return 0;
 }
 
-// Flush all data and metadata of req->req_fileid to disk.
+// Flush the data of req->req_fileid to disk.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
 {
@@ -285,6 +465,20 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 	return 0;
 }
 
+// Remove the file req->req_path.
+int
+serve_remove(envid_t envid, struct Fsreq_remove *req)
+{
+	char path[MAXPATHLEN];
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	// Copy in the path, making sure it's null-terminated
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+	return file_remove(path);
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -293,58 +487,270 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+int
+serve_drop_cache(envid_t envid, union Fsipc *req)
+{
+	bc_drop();
+	return 0;
+}
+
+// Return the block cache and free space statistics in ipc->statsRet.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	bc_stats(&ipc->statsRet);
+	ipc->statsRet.st_nblocks = super->s_nblocks;
+	ipc->statsRet.st_freeblocks = free_block_count();
+	journal_stats(&ipc->statsRet.st_commits, &ipc->statsRet.st_journaled);
+	return 0;
+}
+
+// Write back old dirty blocks and commit the journal's running
+// transaction for the timer env.  Returns the time until the timer
+// should ask again.
+int
+serve_writeback(envid_t envid, union Fsipc *ipc)
+{
+	bc_sync(WRITEBACK_AGE);
+	journal_commit();
+	return WRITEBACK_INTERVAL;
+}
+
+int
+serve_check(envid_t envid, union Fsipc *ipc)
+{
+	return fs_check();
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open, reads by mapping and vectored requests are handled
+	// specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
+	/* [FSREQ_READ_MAP] =	serve_read_map, */
+	/* [FSREQ_READV] =	serve_readv, */
+	/* [FSREQ_WRITEV] =	serve_writev, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_REMOVE] =	(fshandler)serve_remove,
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_DROP_CACHE] =	serve_drop_cache,
+	[FSREQ_STATS] =		serve_stats,
+	[FSREQ_WRITEBACK] =	serve_writeback,
+	[FSREQ_CHECK] =		serve_check
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
-void
-serve(void)
+// Does request type 'req' leave the file system unchanged, so that it
+// can run alongside other such requests?  Write-back and checking are
+// not shared because they commit the journal.
+static bool
+req_is_shared(uint32_t req)
 {
-	uint32_t req, whom;
+	return req == FSREQ_READ || req == FSREQ_READ_MAP
+		|| req == FSREQ_READV || req == FSREQ_STAT
+		|| req == FSREQ_STATS;
+}
+
+// Give up the CPU to the other threads while this worker waits, until
+// 'ready' (if not NULL) says it can go on.
+static void
+worker_park(bool (*ready)(void))
+{
+	struct Fsslot *s = curslot;
+
+	s->s_ready = ready;
+	thread_yield();
+	s->s_ready = NULL;
+	curslot = s;
+}
+
+static bool
+no_writer(void)
+{
+	return !fs_writer;
+}
+
+static bool
+no_readers(void)
+{
+	return !fs_readers;
+}
+
+static bool
+dma_done(void)
+{
+	return !ide_dma_inflight();
+}
+
+// ide_idle: a worker waiting for the disk.  A DMA transfer interrupts
+// when it is done; otherwise the disk must be polled.
+static void
+worker_wait_disk(void)
+{
+	worker_park(ide_dma_inflight() ? dma_done : NULL);
+}
+
+// Can some busy worker get something done now?
+static bool
+workers_runnable(void)
+{
+	int i;
+
+	for (i = 0; i < FSNWORKERS; i++)
+		if (slots[i].s_busy && (!slots[i].s_ready || slots[i].s_ready()))
+			return 1;
+	return 0;
+}
+
+// Wait until request type 'req' may run.  Workers only give up the CPU
+// while waiting for the disk, but a request that changes the file
+// system could otherwise be interleaved with one that walks the same
+// structures.
+static void
+fs_lock(uint32_t req)
+{
+	if (req_is_shared(req)) {
+		while (fs_writer)
+			worker_park(no_writer);
+		fs_readers++;
+	} else {
+		while (fs_writer)
+			worker_park(no_writer);
+		// Keep new readers out while the current ones finish
+		fs_writer = 1;
+		while (fs_readers)
+			worker_park(no_readers);
+	}
+}
+
+static void
+fs_unlock(uint32_t req)
+{
+	if (req_is_shared(req))
+		fs_readers--;
+	else
+		fs_writer = 0;
+}
+
+// Serve the request in slot s and reply to the client.
+static void
+serve_slot(struct Fsslot *s)
+{
+	uint32_t req = s->s_req, whom = s->s_whom;
+	union Fsipc *ipc = s->s_ipc;
 	int perm, r;
+	size_t npages;
 	void *pg;
 
+	fs_lock(req);
+	pg = NULL;
+	perm = 0;
+	npages = 1;
+	if (req == FSREQ_OPEN) {
+		r = serve_open(whom, (struct Fsreq_open*)ipc, &pg, &perm);
+	} else if (req == FSREQ_READ_MAP) {
+		r = serve_read_map(whom, ipc, &pg, &perm);
+	} else if (req == FSREQ_READV) {
+		r = serve_readv(whom, ipc, s->s_vecva, &pg, &npages, &perm);
+	} else if (req == FSREQ_WRITEV) {
+		r = serve_writev(whom, ipc, s->s_npages);
+	} else if (req < NHANDLERS && handlers[req]) {
+		r = handlers[req](whom, ipc);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", req, whom);
+		r = -E_INVAL;
+	}
+	if (!req_is_shared(req))
+		journal_end();
+	fs_unlock(req);
+	ipc_send_pages(whom, r, pg, npages, perm);
+	unmap_pages(ipc, s->s_npages);
+	if (pg == s->s_vecva)
+		unmap_pages(pg, npages);
+}
+
+static void
+worker(uint32_t arg)
+{
+	struct Fsslot *s = (struct Fsslot*) arg;
+
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		while (!s->s_busy)
+			thread_yield();
+		curslot = s;
+		serve_slot(s);
+		s->s_busy = 0;
+		nbusy--;
+	}
+}
+
+// Receive requests into free slots and hand them to the workers.  The
+// receive is armed rather than blocking while any worker is busy, so
+// that the workers keep running until a new request arrives.
+static void
+serve(uint32_t arg)
+{
+	struct Fsslot *s;
+	int i, r;
+
+	while (1) {
+		for (s = NULL, i = 0; i < FSNWORKERS; i++)
+			if (!slots[i].s_busy)
+				s = &slots[i];
+		if (!s) {
+			// Every worker is busy; if all of them wait for
+			// the disk, sleep until it interrupts
+			if (!workers_runnable())
+				sys_irq_wait();
+			thread_yield();
+			continue;
+		}
+
+		if ((r = sys_ipc_recv_arm(s->s_ipc, 1 + FSVEC_MAXPAGES)) < 0)
+			panic("sys_ipc_recv_arm: %e", r);
+		while (thisenv->env_ipc_recving) {
+			// Sleep until a request or a disk interrupt arrives if
+			// the workers cannot get anything done before then
+			if (!workers_runnable())
+				sys_ipc_recv_wait();
+			thread_yield();
+			// Let clients run too, so they can send requests
+			if (thisenv->env_ipc_recving && workers_runnable())
+				sys_yield();
+		}
+
+		s->s_whom = thisenv->env_ipc_from;
+		s->s_req = thisenv->env_ipc_value;
+		s->s_npages = thisenv->env_ipc_npages;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
+				s->s_req, s->s_whom, uvpt[PGNUM(s->s_ipc)], s->s_ipc);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// All requests must contain an argument page, except the
+		// timer's
+		if (!(thisenv->env_ipc_perm & PTE_P)
+		    && !(s->s_whom == timer_envid && s->s_req == FSREQ_WRITEBACK)) {
 			cprintf("Invalid request from %08x: no argument page\n",
-				whom);
+				s->s_whom);
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		s->s_busy = 1;
+		nbusy++;
 	}
 }
 
 void
 umain(int argc, char **argv)
 {
+	envid_t fs_envid;
+	int i, r;
+
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
 	cprintf("FS is running\n");
@@ -353,8 +759,28 @@ umain(int argc, char **argv)
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
 
+	// Fork off the timer env while there is little to copy.  Our pages
+	// become copy-on-write; once bc_init takes over page faults,
+	// bc_pgfault copies them.
+	fs_envid = sys_getenvid();
+	if ((timer_envid = fork()) < 0)
+		panic("error forking");
+	else if (timer_envid == 0) {
+		fs_timer(fs_envid, WRITEBACK_INTERVAL);
+		return;
+	}
+
 	serve_init();
 	fs_init();
-	serve();
+
+	thread_init();
+	for (i = 0; i < FSNWORKERS; i++)
+		if ((r = thread_create(0, "fs worker", worker, (uint32_t) &slots[i])) < 0)
+			panic("thread_create: %e", r);
+	if ((r = thread_create(0, "fs serve", serve, 0)) < 0)
+		panic("thread_create: %e", r);
+	ide_idle = worker_wait_disk;
+	thread_yield();
+	panic("fs threads exited");
 }
 
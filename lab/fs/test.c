@@ -5,6 +5,90 @@
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
+// Large-file test: big enough to need the double-indirect block
+#define LARGESIZE	(6 * 1024 * 1024)
+#define LARGECHUNK	(16 * PGSIZE)
+
+static int
+count_free_blocks(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < super->s_nblocks; i++)
+		n += block_is_free(i);
+	return n;
+}
+
+static void
+fill(char *buf, off_t pos)
+{
+	int i;
+
+	for (i = 0; i < LARGECHUNK; i += sizeof(uint32_t))
+		*(uint32_t*) (buf + i) = pos + i;
+}
+
+// Write, read back and remove a file larger than the indirect block
+// can describe, timing the transfers.
+static void
+fs_test_large(void)
+{
+	struct File *f;
+	char *buf = (char*) (2 * PGSIZE), *want = buf + LARGECHUNK;
+	unsigned start, ms;
+	off_t pos;
+	int i, r, nfree;
+
+	if (!(super->s_features & FS_FEATURE_DINDIRECT)
+	    || (nfree = count_free_blocks()) < LARGESIZE / BLKSIZE + 8) {
+		cprintf("large file test skipped\n");
+		return;
+	}
+	for (i = 0; i < 2 * LARGECHUNK; i += PGSIZE)
+		if ((r = sys_page_alloc(0, buf + i, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+
+	if ((r = file_create("/large", &f)) < 0)
+		panic("file_create /large: %e", r);
+	start = sys_time_msec();
+	for (pos = 0; pos < LARGESIZE; pos += LARGECHUNK) {
+		fill(buf, pos);
+		if ((r = file_write(f, buf, LARGECHUNK, pos)) != LARGECHUNK)
+			panic("file_write /large: %e", r);
+	}
+	file_flush(f);
+	ms = sys_time_msec() - start;
+	assert(f->f_dindirect != 0);
+	cprintf("large file write: %d KB in %u ms\n", LARGESIZE / 1024, ms);
+
+	bc_drop();
+	start = sys_time_msec();
+	for (pos = 0; pos < LARGESIZE; pos += LARGECHUNK) {
+		if ((r = file_read(f, buf, LARGECHUNK, pos)) != LARGECHUNK)
+			panic("file_read /large: %e", r);
+		fill(want, pos);
+		if (memcmp(buf, want, LARGECHUNK) != 0)
+			panic("file_read /large: wrong data near %d", pos);
+	}
+	ms = sys_time_msec() - start;
+	cprintf("large file cold read: %d KB in %u ms\n", LARGESIZE / 1024, ms);
+
+	if ((r = file_set_size(f, MAXFILESIZE + BLKSIZE)) < 0)
+		panic("file_set_size /large: %e", r);
+	assert(f->f_dindirect != 0);
+	if ((r = file_set_size(f, MAXFILESIZE)) < 0)
+		panic("file_set_size /large 2: %e", r);
+	assert(f->f_dindirect == 0);
+	if ((r = file_remove("/large")) < 0)
+		panic("file_remove /large: %e", r);
+	// Freed blocks only become free when the journal commits
+	fs_sync();
+	assert(count_free_blocks() == nfree);
+	for (i = 0; i < 2 * LARGECHUNK; i += PGSIZE)
+		sys_page_unmap(0, buf + i);
+	cprintf("large file is good\n");
+}
+
 void
 fs_test(void)
 {
@@ -62,6 +146,9 @@ fs_test(void)
 	assert((uvpt[PGNUM(blk)] & PTE_D));
 	file_flush(f);
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
+	fs_sync();
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file rewrite is good\n");
+
+	fs_test_large();
 }
@@ -0,0 +1,36 @@
+#include "fs.h"
+
+// The file server's timer env.  Every so often it asks the server to
+// write back old dirty blocks; the server replies with the number of
+// milliseconds until the next time.
+void
+fs_timer(envid_t fs_envid, uint32_t initial_to)
+{
+	int r;
+	uint32_t stop = sys_time_msec() + initial_to;
+
+	binaryname = "fs_timer";
+
+	while (1) {
+		while((r = sys_time_msec()) < stop && r >= 0) {
+			sys_yield();
+		}
+		if (r < 0)
+			panic("sys_time_msec: %e", r);
+
+		ipc_send(fs_envid, FSREQ_WRITEBACK, 0, 0);
+
+		while (1) {
+			uint32_t to, whom;
+			to = ipc_recv((int32_t *) &whom, 0, 0);
+
+			if (whom != fs_envid) {
+				cprintf("FS TIMER: got IPC message from env %x not FS\n", whom);
+				continue;
+			}
+
+			stop = sys_time_msec() + to;
+			break;
+		}
+	}
+}
@@ -53,6 +53,7 @@ struct Env {
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	uint32_t env_syscalls;		// Number of system calls it has made
 	int env_cpunum;			// The CPU that the env is running on
 
 	// Address space
@@ -67,6 +68,12 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	size_t env_ipc_npages;		// Max pages to receive at dstva,
+					// then number of pages received
+
+	// Hardware interrupts routed to this env (see sys_irq_register)
+	uint32_t env_irq_pending;	// Bit i set when IRQ i has fired
+	bool env_irq_waiting;		// Blocked until an IRQ fires
 };
 
 #endif // !JOS_INC_ENV_H
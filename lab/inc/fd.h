@@ -22,16 +22,71 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	int (*dev_seek)(struct Fd *fd, off_t offset);
+	// The POLL* conditions that hold for fd now; NULL if it is
+	// always ready, like a file
+	int (*dev_poll)(struct Fd *fd);
+	// Devices that tell us when readiness may have changed, so that
+	// epoll_wait need not poll every descriptor.  dev_watch asks for
+	// that for fd and returns the key (< DEV_MAXKEYS) it will be
+	// reported under; dev_changed collects the keys reported since
+	// its last call as bits in 'keys'; dev_block waits until there
+	// are some.
+	int (*dev_watch)(struct Fd *fd);
+	void (*dev_changed)(uint32_t *keys);
+	void (*dev_block)(void);
 };
 
+#define DEV_MAXKEYS	1024
+
+// Readiness of a file descriptor (see poll and epoll_wait)
+#define POLLIN		0x01	// read will not block
+#define POLLOUT		0x04	// write will not block
+#define POLLERR		0x08	// the connection has failed
+#define POLLHUP		0x10	// the other end has gone away
+
+struct pollfd {
+	int fd;
+	short events;		// POLL* conditions of interest
+	short revents;		// those that hold, and POLLERR and POLLHUP
+};
+
+// epoll_ctl operations
+#define EPOLL_CTL_ADD	1
+#define EPOLL_CTL_DEL	2
+#define EPOLL_CTL_MOD	3
+
+struct epoll_event {
+	uint32_t events;	// POLL* conditions
+	uint32_t data;		// the caller's, returned with the events
+};
+
+// Largest client-side buffer a file descriptor can have (see setbuf)
+#define FDBUFMAX	(16*PGSIZE)
+
 struct FdFile {
 	int id;
+	// Client-side buffer bookkeeping, shared along with the Fd.
+	// The buffer holds bytes [buf_off, buf_off + buf_len) of the file;
+	// buf_dirty means they have not been written to the server yet.
+	size_t buf_size;	// 0 if unbuffered
+	off_t buf_off;
+	size_t buf_len;
+	bool buf_dirty;
 };
 
 struct FdSock {
 	int sockid;
 };
 
+struct FdCons {
+	int ahead;		// character read ahead by poll, or 0
+};
+
+struct FdEpoll {
+	struct Epoll *ep;
+};
+
 struct Fd {
 	int fd_dev_id;
 	off_t fd_offset;
@@ -41,6 +96,10 @@ struct Fd {
 		struct FdFile fd_file;
 		// Network sockets
 		struct FdSock fd_sock;
+		// The console
+		struct FdCons fd_cons;
+		// epoll instances
+		struct FdEpoll fd_epoll;
 	};
 };
 
@@ -58,6 +117,7 @@ struct MMap {
 };
 
 char*	fd2data(struct Fd *fd);
+char*	fd2buf(struct Fd *fd);
 int	fd2num(struct Fd *fd);
 int	fd_alloc(struct Fd **fd_store);
 int	fd_close(struct Fd *fd, bool must_exist);
@@ -68,5 +128,6 @@ extern struct Dev devfile;
 extern struct Dev devsock;
 extern struct Dev devcons;
 extern struct Dev devpipe;
+extern struct Dev devepoll;
 
 #endif	// not JOS_INC_FD_H
@@ -23,8 +23,13 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of blocks reached through the double-indirect block
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
 #define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// With FS_FEATURE_DINDIRECT, off_t rather than the block pointers
+// limits the size of a file
+#define MAXFILESIZE_DINDIRECT	0x7FFFF000
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
@@ -35,10 +40,16 @@ struct File {
 	// A block is allocated iff its value is != 0.
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
+	// Double-indirect block: an indirect block of indirect blocks.
+	// Only valid with FS_FEATURE_DINDIRECT.
+	uint32_t f_dindirect;
+	// For directories, the root of the name index (struct Dirindex),
+	// or 0 if there is none.  Only valid with FS_FEATURE_DIRINDEX.
+	uint32_t f_dirindex;
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 12];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -53,10 +64,62 @@ struct File {
 
 #define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
 
+// Feature flags in s_features.  Older file systems leave the field
+// zero, and may leave garbage in the parts of struct File that the
+// features use.
+#define FS_FEATURE_DINDIRECT	0x1	// f_dindirect is valid
+#define FS_FEATURE_DIRINDEX	0x2	// f_dirindex is valid
+#define FS_FEATURE_JOURNAL	0x4	// s_journal and s_njournal are valid
+#define FS_FEATURES		(FS_FEATURE_DINDIRECT | FS_FEATURE_DIRINDEX \
+				 | FS_FEATURE_JOURNAL)
+
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_features;		// FS_FEATURE_*
+	uint32_t s_journal;		// First block of the journal
+	uint32_t s_njournal;		// Blocks in the journal
+};
+
+// Metadata journal.  A transaction is a set of metadata blocks that
+// must reach their homes together.  It is committed by writing copies
+// of the blocks to journal blocks 1 and up and then a header, in
+// journal block 0, that lists where they belong.  After a crash, a
+// header whose checksum matches is replayed by copying the blocks
+// home again; a header with jh_nblocks == 0 means there is nothing
+// to replay.
+#define JOURNAL_MAGIC		0x4A524E4C	// 'JRNL'
+#define JOURNAL_NBLOCKS		256		// journal size fsformat uses
+#define JOURNAL_MAXBLOCKS	(BLKSIZE / 4 - 4)
+
+struct Jheader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC
+	uint32_t jh_seq;		// transaction number
+	uint32_t jh_nblocks;		// blocks in the transaction
+	uint32_t jh_sum;		// checksum of the header and the copies
+	uint32_t jh_blocknos[JOURNAL_MAXBLOCKS];	// their home blocks
+};
+
+// Directory name index.  An open-addressed hash table of the
+// directory's entries, keyed by name, held in di_nblocks table blocks
+// of NDIRINDEX slots each.  A slot is empty (0), a deleted entry
+// (DIRINDEX_DELETED), or DIRINDEX_TAG(hash) | (entry number + 1),
+// where entry number n is the nth struct File in the directory.  The
+// directory itself keeps its usual layout, so readers that scan it
+// need not know about the index.
+#define NDIRINDEX		(BLKSIZE / 4)
+#define DIRINDEX_DELETED	0xFFFFFFFF
+#define DIRINDEX_ENTRY		0x000FFFFF
+#define DIRINDEX_TAG(hash)	((hash) & ~DIRINDEX_ENTRY)
+#define DIRINDEX_MAXBLOCKS	(BLKSIZE / 4 - 4)
+
+struct Dirindex {
+	uint32_t di_nblocks;		// table blocks; a power of 2
+	uint32_t di_nlive;		// slots holding entries
+	uint32_t di_nused;		// slots holding entries or deletions
+	uint32_t di_freehint;		// no free entries before this one
+	uint32_t di_blocks[DIRINDEX_MAXBLOCKS];
 };
 
 // Definitions for requests from clients to file system
@@ -70,9 +133,45 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Read map takes a Fsreq_read and returns the block-cache page
+	// holding the data, or a Fsret_read if it cannot share the page
+	FSREQ_READ_MAP,
+	// Vectored read and write carry their data in up to
+	// FSVEC_MAXPAGES pages; see Fsreq_vec
+	FSREQ_READV,
+	FSREQ_WRITEV,
+	// Write back and forget all cached blocks (for benchmarks)
+	FSREQ_DROP_CACHE,
+	// Stats returns a struct Fsstats on the request page
+	FSREQ_STATS,
+	// From the server's own timer env, without a request page: write
+	// back old dirty blocks.  Returns the time until the next one.
+	FSREQ_WRITEBACK,
+	// Check the file system's consistency.  Returns the number of
+	// problems found.
+	FSREQ_CHECK
 };
 
+// Block cache and disk statistics, as returned by FSREQ_STATS
+struct Fsstats {
+	uint32_t st_capacity;		// blocks the cache can hold
+	uint32_t st_cached;		// blocks it holds now
+	uint32_t st_hits;		// lookups that found the block cached
+	uint32_t st_misses;		// lookups that had to wait for the disk
+	uint32_t st_evictions;		// blocks dropped to make room
+	uint32_t st_writebacks;		// dirty blocks written to make room
+	uint32_t st_diskcmds;		// disk commands issued
+	uint32_t st_diskblocks;		// blocks they transferred
+	uint32_t st_nblocks;		// blocks in the file system
+	uint32_t st_freeblocks;		// blocks free for allocation
+	uint32_t st_commits;		// journal transactions committed
+	uint32_t st_journaled;		// blocks they logged
+};
+
+// Maximum number of data pages in a vectored request
+#define FSVEC_MAXPAGES	16
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -108,6 +207,16 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	// A vectored write sends its data pages right after the request
+	// page; a vectored read gets them back as the reply.  Either way
+	// the data starts at byte req_pgoff of the first data page.  The
+	// server fills in req_pgoff for reads.
+	struct Fsreq_vec {
+		int req_fileid;
+		size_t req_n;
+		size_t req_pgoff;
+	} vec;
+	struct Fsstats statsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -59,10 +59,26 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_try_send_pages(envid_t to_env, uint32_t value, void *pg,
+			       size_t npages, int perm);
+int	sys_ipc_recv_pages(void *rcv_pg, size_t npages);
+int	sys_ipc_recv_arm(void *rcv_pg, size_t npages);
+int	sys_ipc_recv_wait(void);
+int	sys_irq_register(int irq);
+int	sys_irq_ack(int irq);
+int	sys_irq_wait(void);
+int	sys_page_paddr(void *va);
+int	sys_ide_dma_base(void);
 unsigned int sys_time_msec(void);
 int sys_mmap(envid_t child, void *va, uint32_t memsz, int perm, struct MMap *mmap);
 int sys_packet_send(void *packet, uint16_t size);
 int sys_packet_recv(void *packet, uint16_t *buf_len);
+int sys_packet_send_pages(const void *pkts, int n);
+int sys_packet_send_frags(const struct PacketFrag *frags, int nfrags, uint32_t *ndone);
+int sys_packet_recv_pages(envid_t peer, void *va, int n);
+int sys_packet_send_wait(void);
+int sys_packet_stats(struct PacketStats *st);
+int sys_packet_recv_wait(void);
 void sys_get_mac_addr(void *addr_buf, int raw);
 
 // This must be inlined.  Exercise for reader: why?
@@ -81,12 +97,20 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg,
+		       size_t npages, int perm);
+int32_t	ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages,
+		       int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
 #define	PTE_SHARE	0x400
+// PTE_COW marks copy-on-write page table entries.
+// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
+#define	PTE_COW		0x800
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
+int	cow_enable(void);
 
 // fd.c
 int	close(int fd);
@@ -98,12 +122,22 @@ ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
+int	poll(struct pollfd *fds, int nfds, int timeout);
+int	epoll_create(void);
+int	epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int	epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+		   int timeout);
 
 // file.c
 int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	dropcache(void);
+int	fsstats(struct Fsstats *st);
+int	fscheck(void);
+int	setbuf(int fd, size_t size);
+int	flush(int fd);
 
 // pageref.c
 int	pageref(void *addr);
@@ -126,6 +160,19 @@ int     nsipc_listen(int s, int backlog);
 int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
 int     nsipc_socket(int domain, int type, int protocol);
+int     nsipc_watch(int s, struct Nsevents *ev);
+envid_t nsipc_env(void);
+
+// nsring.c
+int	jif_ring_alloc(struct jif_ring *r);
+struct jif_pkt *jif_ring_slot(struct jif_ring *r, uint32_t i);
+uint32_t jif_ring_count(struct jif_ring *r);
+uint32_t jif_ring_space(struct jif_ring *r);
+void	jif_ring_produce(struct jif_ring *r, uint32_t n, envid_t consumer,
+			 uint32_t req);
+void	jif_ring_consume(struct jif_ring *r, uint32_t n);
+bool	jif_ring_idle(struct jif_ring *r);
+void	jif_ring_busy(struct jif_ring *r);
 
 // spawn.c
 envid_t	spawn(const char *program, const char **argv);
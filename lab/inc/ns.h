@@ -9,6 +9,8 @@
 
 struct jif_pkt {
 	int jp_len;
+	uint16_t jp_flags;	// PACKET_CSUM_IP etc. (see inc/syscall.h)
+	uint16_t jp_mss;	// segment payload for PACKET_TSO
 	char jp_data[0];
 };
 
@@ -26,15 +28,65 @@ enum {
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
-
-	// The following two messages pass a page containing a struct jif_pkt
+	// Watch passes the client's struct Nsevents instead.
+	NSREQ_WATCH,
+
+	// The following messages pass no page.  NSREQ_INPUT and
+	// NSREQ_OUTPUT are the doorbells of struct jif_ring: NSREQ_INPUT
+	// tells the network server that the input environment has packets
+	// for it, and NSREQ_OUTPUT, unlike the other messages but
+	// NSREQ_WAKE, is sent *from* the network server, to the output
+	// environment.  NSREQ_WAKE is the doorbell of struct Nsevents.
 	NSREQ_INPUT,
-	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
-	// network server, to the output environment
 	NSREQ_OUTPUT,
-
-	// The following message passes no page
 	NSREQ_TIMER,
+	NSREQ_WAKE,
+};
+
+// The readiness of a client's sockets, in a page it shares with the
+// network server.  NSREQ_WATCH hands the page over along with the
+// socket named in ne_watch; from then on the server keeps
+// ne_state[s] up to date with the POLL* conditions (see inc/fd.h) that
+// hold for socket s, and sets bit s of ne_changed whenever it changes
+// them.  The client clears the bits it has seen.  A client about to
+// block sets ne_waiting, checks ne_changed once more and then waits
+// in ipc_recv; the server that finds ne_waiting set clears it and
+// sends the client NSREQ_WAKE.  A client that changes its mind takes
+// ne_waiting back the same way, and if the server beat it to that,
+// takes the doorbell too.  See lib/sockets.c.
+#define NSEV_MAXSOCKS	MEMP_NUM_NETCONN
+
+struct Nsevents {
+	volatile uint32_t ne_waiting;
+	int ne_watch;
+	volatile uint32_t ne_changed[NSEV_MAXSOCKS / 32];
+	volatile uint8_t ne_state[NSEV_MAXSOCKS];
+};
+
+// Packets pass between the network server and its input and output
+// environments through rings in memory they share, one for input and
+// one for output.  A ring has one producer and one consumer, and is a
+// header page followed by JIF_RING_SLOTS pages holding a struct
+// jif_pkt each.  The input environment does not write the slots: the
+// driver maps the pages packets were received into in their place
+// (see sys_packet_recv_pages).  The producer fills slots and then
+// advances jr_head past them; the consumer empties them and then
+// advances jr_tail.  Neither takes a lock or makes a system call for
+// that.  A consumer that runs out of packets sets jr_idle and blocks
+// in ipc_recv, and the producer that finds jr_idle set clears it and
+// sends the consumer a doorbell.  See lib/nsring.c.
+#define JIF_RING_SLOTS	64
+#define JIF_RING_PAGES	(1 + JIF_RING_SLOTS)
+
+struct jif_ring {
+	// Packets produced and consumed so far, each written by one side
+	// only and kept in a cache line of its own
+	volatile uint32_t jr_head;
+	uint8_t jr_pad0[60];
+	volatile uint32_t jr_tail;
+	uint8_t jr_pad1[60];
+	volatile uint32_t jr_idle;	// the consumer wants a doorbell
+	uint32_t jr_doorbells;		// doorbells the producer has sent
 };
 
 union Nsipc {
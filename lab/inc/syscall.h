@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -21,7 +23,70 @@ enum {
     SYS_packet_send,
     SYS_packet_recv,
     SYS_get_mac_addr,
+	SYS_ipc_try_send_pages,
+	SYS_ipc_recv_pages,
+	SYS_ipc_recv_arm,
+	SYS_ipc_recv_wait,
+	SYS_irq_register,
+	SYS_irq_ack,
+	SYS_irq_wait,
+	SYS_page_paddr,
+	SYS_ide_dma_base,
+	SYS_packet_recv_wait,
+	SYS_packet_recv_pages,
+	SYS_packet_send_pages,
+	SYS_packet_send_frags,
+	SYS_packet_stats,
+	SYS_packet_send_wait,
 	NSYSCALLS
 };
 
+// One piece of a packet for sys_packet_send_frags.  A piece may not
+// cross a page boundary.  The last piece of each packet has
+// PACKET_FRAG_EOP set in pf_flags; the first carries the packet's
+// offload flags, below.
+struct PacketFrag {
+	const void *pf_va;
+	uint16_t pf_len;
+	uint16_t pf_flags;
+	uint16_t pf_mss;	// first piece of a PACKET_TSO packet: TCP
+				// payload bytes per segment
+};
+
+#define PACKET_FRAG_EOP		0x1
+
+// Checksum offload flags, for the first piece of a packet and for the
+// jp_flags of a struct jif_pkt.  On transmit they ask the card to fill
+// in the IPv4 header checksum, which must be 0, and the TCP or UDP
+// checksum, which must hold the sum of the pseudo-header.  On receive
+// they say which checksums the card has verified.
+#define PACKET_CSUM_IP		0x2
+#define PACKET_CSUM_L4		0x4
+// Transmit only: the packet is a TCP segment of up to PACKET_TSO_MAXLEN
+// bytes for the card to split into segments of pf_mss (or jp_mss)
+// payload bytes.  The TCP checksum field must hold the sum of the
+// pseudo-header without the length; both checksums are filled in.
+#define PACKET_TSO		0x8
+#define PACKET_TSO_MAXLEN	65535
+
+// Most pieces a packet may have, and a call may pass
+#define PACKET_MAXFRAGS		16
+#define PACKET_BATCH_MAXFRAGS	64
+// Most packets sys_packet_recv_pages and sys_packet_send_pages move
+// in one call
+#define PACKET_MAXBATCH		32
+
+// Network driver counters (see sys_packet_stats)
+struct PacketStats {
+	uint32_t ps_rx_calls;		// receive calls into the driver
+	uint32_t ps_rx_packets;		// packets they returned
+	uint32_t ps_tx_calls;		// transmit calls into the driver
+	uint32_t ps_tx_packets;		// packets they queued
+	uint32_t ps_tx_full;		// calls that found the ring full
+	uint32_t ps_tx_dropped;		// packets dropped: too big, or the
+					// ring was full for sys_packet_send
+	uint32_t ps_rx_missed;		// packets the card had no room for
+	uint32_t ps_rx_intrs;		// receive interrupts
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
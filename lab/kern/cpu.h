@@ -23,6 +23,9 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	volatile bool cpu_user;         // Running cpu_env's code, in user mode
+	volatile bool cpu_tlbstale;     // cpu_env's page table changed under
+	                                // our TLB (see tlb_shootdown)
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +45,6 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
 
 #endif
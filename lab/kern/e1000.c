@@ -1,45 +1,395 @@
 #include <kern/e1000.h>
 #include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/picirq.h>
 #include <inc/string.h>
+#include <inc/error.h>
 
 volatile uint32_t *e1000;
+// IRQ line of the card; its interrupts are handled by e1000_intr
+int e1000_irq = -1;
+// Environment blocked in packet_recv_wait, if any
+static envid_t rx_waiter;
 
-struct e1000_tx_desc tx_queue[NTXDESC];
-char tx_packet_buf[NTXDESC * PKTSIZE];
+// Ring sizes; init may change them before E1000_attach
+uint32_t e1000_ntxdesc = NTXDESC, e1000_nrxdesc = NRXDESC;
+// Environment blocked in packet_send_wait, if any
+static envid_t tx_waiter;
+// Interrupt throttling; init may change these before E1000_attach
+uint32_t e1000_itr = NET_ITR_DEFAULT, e1000_rdtr = NET_RDTR_DEFAULT;
+uint32_t e1000_radv = NET_RADV_DEFAULT, e1000_poll_budget = NET_POLL_BUDGET_DEFAULT;
+// Set while receive interrupts are off because the input environment
+// is polling the ring, and the packets it may still take before
+// letting others run
+static int rx_polling;
+static uint32_t rx_budget;
+
+// The rings and the copying path's transmit buffers, allocated by
+// E1000_attach
+struct e1000_tx_desc *tx_queue;
+char *tx_packet_buf;
+// The page each transmit descriptor points into, pinned until the card
+// is done with it; NULL for descriptors using tx_packet_buf
+static struct PageInfo **tx_pages;
+// Oldest descriptor not yet reclaimed
+static uint32_t tx_clean;
+// Packets sent by packet_send_frags that the card has finished with
+static uint32_t tx_frags_done;
+// The offload context the card was last given
+static struct e1000_context_desc tx_ctx;
+// Offload flags a packet may carry
+#define TX_OFFLOADS (PACKET_CSUM_IP | PACKET_CSUM_L4 | PACKET_TSO)
+// Most bytes of a packet's headers tx_context looks at
+#define TX_HDRMAX 128
+// Interrupt causes that mean packets have arrived
+#define RX_CAUSES (E1000_ICR_RXT0 | E1000_ICR_RXDMT0 | E1000_ICR_RXO)
+// Counters for packet_stats
+static struct PacketStats stats;
+
+struct e1000_rx_desc *rx_queue;
+// The page each receive descriptor points into
+static struct PageInfo **rx_pages;
 
-struct e1000_rx_desc rx_queue[NRXDESC];
-char rx_packet_buf[NRXDESC * 2048];
 /*
-struct e1000_tx_desc *tx_queue = NULL;
-void * tx_packet_buf = NULL;
+ * Is transmit descriptor i the last of a packet?  Context descriptors
+ * have their TCP bit where data descriptors have EOP.
+ */
+static int tx_is_eop(uint32_t i)
+{
+    uint32_t d = tx_queue[i].lower.data;
+
+    if ((d & E1000_TXD_CMD_DEXT) && !(d & E1000_TXD_DTYP_D))
+        return 0;
+    return d & E1000_TXD_CMD_EOP;
+}
 
-struct e1000_rx_desc *rx_queue = NULL;
-void* rx_packet_buf = NULL;
-*/
 /*
- * Return 0 on success, -1 on fail.
+ * Reclaim the transmit descriptors of every packet the card has
+ * finished with, unpinning the pages they pointed into.  The card
+ * reports status only for the last descriptor of each packet.
  */
-int packet_send(void * packet, uint16_t length)
+static void tx_reclaim(void)
+{
+    uint32_t tail = *(uint32_t *)((void*)e1000 + E1000_TDT);
+    uint32_t eop;
+
+    while (tx_clean != tail)
+    {
+        for (eop = tx_clean; !tx_is_eop(eop); eop = (eop + 1) % e1000_ntxdesc)
+            ;
+        if (!(tx_queue[eop].upper.fields.status & E1000_TXD_STAT_DD))
+            break;
+        if (tx_pages[eop])
+            tx_frags_done++;
+        for (; tx_clean != (eop + 1) % e1000_ntxdesc; tx_clean = (tx_clean + 1) % e1000_ntxdesc)
+        {
+            if (tx_pages[tx_clean])
+            {
+                page_decref(tx_pages[tx_clean]);
+                tx_pages[tx_clean] = NULL;
+            }
+        }
+    }
+}
+
+/*
+ * Number of transmit descriptors free for new packets.  One always
+ * stays unused, since a full ring would look empty to the card.
+ */
+static uint32_t tx_nfree(void)
 {
     uint32_t tail = *(uint32_t *)((void*)e1000 + E1000_TDT);
-    if (tx_queue[tail].upper.fields.status & E1000_TXD_STAT_DD)
+
+    return (tx_clean + e1000_ntxdesc - tail - 1) % e1000_ntxdesc;
+}
+
+/*
+ * Fill in c with the context the card needs to apply the offload flags
+ * (PACKET_CSUM_IP etc.) to a packet of len bytes, the first n of which
+ * are at hdr, with segments of mss payload bytes for PACKET_TSO.
+ * Return 0 on success, -E_INVAL if the packet is not an IPv4 packet
+ * the card can do that for.
+ */
+static int tx_context(const uint8_t *hdr, uint32_t n, int flags, uint16_t mss, uint32_t len, struct e1000_context_desc *c)
+{
+    uint32_t ip = 14, l4, hdrlen;
+
+    memset(c, 0, sizeof(*c));
+    if (n < ip + 20 || hdr[12] != 0x08 || hdr[13] != 0x00
+        || (hdr[ip] >> 4) != 4 || (hdr[ip] & 0xf) < 5)
+        return -E_INVAL;
+    l4 = ip + (hdr[ip] & 0xf) * 4;
+    c->ipcss = ip;
+    c->ipcso = ip + 10;
+    c->ipcse = l4 - 1;
+    c->tucss = l4;
+    c->cmd_and_length = E1000_TXD_CMD_DEXT | E1000_TXD_DTYP_C | E1000_TXD_CMD_IP;
+    if (flags & (PACKET_CSUM_L4 | PACKET_TSO))
     {
-        if (length > 1518)
+        if (hdr[ip + 9] == 6 && n >= l4 + 20)
         {
-            cprintf("Giant packet. Dropped it.\n");
-            return -1;
+            // TCP
+            c->tucso = l4 + 16;
+            c->cmd_and_length |= E1000_TXD_CMD_TCP;
         }
-        memcpy((void *)tx_packet_buf + tail*PKTSIZE, (void *)packet, length);
-        tx_queue[tail].lower.flags.length = length;
-        tx_queue[tail].upper.data &= ~E1000_TXD_STAT_DD;
-        tx_queue[tail].lower.data |= E1000_TXD_CMD_RS;
-        tx_queue[tail].lower.data |= E1000_TXD_CMD_EOP;
-        tail = (tail+1) % NTXDESC;
-        *(uint32_t *)((void*)e1000 + E1000_TDT) = tail;
+        else if (hdr[ip + 9] == 17 && !(flags & PACKET_TSO))
+            // UDP
+            c->tucso = l4 + 6;
+        else
+            return -E_INVAL;
+    }
+    if (flags & PACKET_TSO)
+    {
+        hdrlen = l4 + (hdr[l4 + 12] >> 4) * 4;
+        if (mss == 0 || hdrlen + mss > PKTSIZE || len <= hdrlen)
+            return -E_INVAL;
+        c->hdr_len = hdrlen;
+        c->mss = mss;
+        c->cmd_and_length |= E1000_TXD_CMD_TSE | (len - hdrlen);
+    }
+    return 0;
+}
+
+/*
+ * Number of descriptors needed to give the card context c: 0 if it
+ * has it already.  A TSO context holds the length of one packet, so it
+ * is never reused.
+ */
+static uint32_t tx_context_needed(const struct e1000_context_desc *c)
+{
+    if (!(c->cmd_and_length & E1000_TXD_CMD_TSE) && memcmp(c, &tx_ctx, sizeof(*c)) == 0)
+        return 0;
+    return 1;
+}
+
+/*
+ * Queue a context descriptor for c at *tail if the card needs one,
+ * and advance *tail past it.
+ */
+static void tx_put_context(uint32_t *tail, const struct e1000_context_desc *c)
+{
+    if (!tx_context_needed(c))
+        return;
+    memcpy(&tx_queue[*tail], c, sizeof(*c));
+    tx_ctx = *c;
+    *tail = (*tail + 1) % e1000_ntxdesc;
+}
+
+/*
+ * Command bits for the data descriptors of a packet with the offload
+ * flags, and in *upper their checksum options.
+ */
+static uint32_t tx_offload_bits(int flags, uint32_t *upper)
+{
+    *upper = 0;
+    if (!(flags & TX_OFFLOADS))
         return 0;
+    if (flags & (PACKET_CSUM_IP | PACKET_TSO))
+        *upper |= E1000_TXD_POPTS_IXSM << 8;
+    if (flags & (PACKET_CSUM_L4 | PACKET_TSO))
+        *upper |= E1000_TXD_POPTS_TXSM << 8;
+    return E1000_TXD_CMD_DEXT | E1000_TXD_DTYP_D | (flags & PACKET_TSO ? E1000_TXD_CMD_TSE : 0);
+}
+
+/*
+ * Copy a packet of length bytes into the buffer of descriptor i.  cmd
+ * and upper are its offload bits, from tx_offload_bits.
+ */
+static void tx_copy(uint32_t i, const void *packet, uint16_t length, uint32_t cmd, uint32_t upper)
+{
+    memcpy((void *)tx_packet_buf + i*PKTSIZE, packet, length);
+    // The descriptor may have last pointed at a caller's page
+    tx_queue[i].buffer_addr = (uint32_t)(PADDR(tx_packet_buf + PKTSIZE * i));
+    tx_queue[i].lower.data = length | cmd | E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
+    tx_queue[i].upper.data = upper;
+}
+
+/*
+ * Copy up to n bytes from the start of the packet made of the pieces
+ * frags[start] to frags[end - 1], in pages pp, to buf.
+ * Return the number of bytes copied.
+ */
+static uint32_t tx_gather(struct PageInfo **pp, const struct PacketFrag *frags, int start, int end, uint8_t *buf, uint32_t n)
+{
+    uint32_t got = 0, k;
+    int i;
+
+    for (i = start; i < end && got < n; i++)
+    {
+        k = MIN(n - got, frags[i].pf_len);
+        memcpy(buf + got, page2kva(pp[i]) + PGOFF(frags[i].pf_va), k);
+        got += k;
+    }
+    return got;
+}
+
+/*
+ * Return 0 on success, -1 on fail: the packet is too big or the ring is
+ * full, and the packet is dropped.
+ */
+int packet_send(void * packet, uint16_t length)
+{
+    uint32_t tail = *(uint32_t *)((void*)e1000 + E1000_TDT);
+    tx_reclaim();
+    stats.ps_tx_calls++;
+    if (length > PKTSIZE || tx_nfree() == 0)
+    {
+        stats.ps_tx_dropped++;
+        return -1;
+    }
+    tx_copy(tail, packet, length, 0, 0);
+    tail = (tail+1) % e1000_ntxdesc;
+    *(uint32_t *)((void*)e1000 + E1000_TDT) = tail;
+    stats.ps_tx_packets++;
+    return 0;
+}
+
+/*
+ * Copy up to n packets to the card at once.  The packets are in
+ * consecutive pages starting at pkts, each holding a struct jif_pkt:
+ * the length of the packet, its offload flags, then the packet.
+ * Return the number of packets taken, which is less than n if the ring
+ * is full (see packet_send_wait).  Giant packets, and packets the card
+ * cannot apply their offload flags to, are taken but dropped.
+ */
+int packet_send_pages(const void *pkts, int n)
+{
+    uint32_t tail = *(uint32_t *)((void*)e1000 + E1000_TDT);
+    struct e1000_context_desc c;
+    uint32_t avail, need, cmd, upper;
+    int i, len, flags;
+
+    tx_reclaim();
+    stats.ps_tx_calls++;
+    avail = tx_nfree();
+    for (i = 0; i < n; i++)
+    {
+        const void *pkt = pkts + i * PGSIZE;
+        len = *(const int *)pkt;
+        flags = *(const uint16_t *)(pkt + PKT_FLAGS) & TX_OFFLOADS;
+        if (len < 0 || len > PKTSIZE
+            || (flags && tx_context(pkt + PKT_OFFSET, len, flags,
+                                    *(const uint16_t *)(pkt + PKT_MSS), len, &c) < 0))
+        {
+            stats.ps_tx_dropped++;
+            continue;
+        }
+        need = 1 + (flags ? tx_context_needed(&c) : 0);
+        if (need > avail)
+            break;
+        if (flags)
+            tx_put_context(&tail, &c);
+        cmd = tx_offload_bits(flags, &upper);
+        tx_copy(tail, pkt + PKT_OFFSET, len, cmd, upper);
+        tail = (tail + 1) % e1000_ntxdesc;
+        avail -= need;
+        stats.ps_tx_packets++;
     }
-    cprintf("Transmit queue full. OOM\n\n");
-    return -1;
+    if (i < n)
+        stats.ps_tx_full++;
+    *(uint32_t *)((void*)e1000 + E1000_TDT) = tail;
+    return i;
+}
+
+/*
+ * Send the packets made of the nfrags pieces in ufrags, which lie in the
+ * address space of environment e, without copying them: each piece gets
+ * a descriptor pointing at it, and its page stays pinned until the
+ * card has read it.  The last piece of each packet has PACKET_FRAG_EOP
+ * set, and the first carries the packet's offload flags.  Packets are
+ * queued in order for as long as they fit in the ring, with one tail
+ * update for all of them.  nfrags may be 0.
+ * Set *ndone to the number of packets sent this way that the card has
+ * finished with, modulo 2^31.
+ * Return the number of packets queued on success; -E_INVAL or -E_FAULT
+ * if the pieces are bad, in which case nothing is sent.
+ */
+int packet_send_frags(struct Env *e, const struct PacketFrag *ufrags, int nfrags, uint32_t *ndone)
+{
+    struct PacketFrag frags[PACKET_BATCH_MAXFRAGS];
+    struct PageInfo *pp[PACKET_BATCH_MAXFRAGS];
+    uint32_t tail = *(uint32_t *)((void*)e1000 + E1000_TDT);
+    uint32_t total = 0, avail, need, cmd, upper;
+    struct e1000_context_desc c;
+    uint8_t hdr[TX_HDRMAX];
+    int i, start, end, flags, npkts = 0;
+    pte_t *pte;
+
+    if (nfrags < 0 || nfrags > PACKET_BATCH_MAXFRAGS)
+        return -E_INVAL;
+    // The environment may change its array while we work from it, so
+    // check and send from one copy
+    memmove(frags, ufrags, nfrags * sizeof(frags[0]));
+    tx_reclaim();
+    stats.ps_tx_calls++;
+
+    // Check every piece before sending anything
+    for (i = 0, start = 0; i < nfrags; i++)
+    {
+        const void *va = frags[i].pf_va;
+        uint32_t len = frags[i].pf_len;
+        if (len == 0 || PGOFF(va) + len > PGSIZE)
+            return -E_INVAL;
+        if ((uintptr_t)va >= UTOP
+            || !(pp[i] = page_lookup(e->env_pgdir, (void *)va, &pte))
+            || !(*pte & PTE_U))
+            return -E_FAULT;
+        total += len;
+        if (frags[i].pf_flags & PACKET_FRAG_EOP)
+        {
+            flags = frags[start].pf_flags & TX_OFFLOADS;
+            if (i + 1 - start > PACKET_MAXFRAGS
+                || total > (flags & PACKET_TSO ? PACKET_TSO_MAXLEN : PKTSIZE))
+                return -E_INVAL;
+            if (flags && tx_context(hdr, tx_gather(pp, frags, start, i + 1, hdr, TX_HDRMAX),
+                                    flags, frags[start].pf_mss, total, &c) < 0)
+                return -E_INVAL;
+            start = i + 1;
+            total = 0;
+        }
+    }
+    if (start != nfrags)
+        return -E_INVAL;
+
+    avail = tx_nfree();
+    for (start = 0; start < nfrags; start = end)
+    {
+        for (end = start, total = 0; !(frags[end].pf_flags & PACKET_FRAG_EOP); end++)
+            total += frags[end].pf_len;
+        total += frags[end].pf_len;
+        end++;
+        flags = frags[start].pf_flags & TX_OFFLOADS;
+        need = end - start;
+        if (flags)
+        {
+            tx_context(hdr, tx_gather(pp, frags, start, end, hdr, TX_HDRMAX),
+                       flags, frags[start].pf_mss, total, &c);
+            need += tx_context_needed(&c);
+        }
+        if (need > avail)
+            break;
+        if (flags)
+            tx_put_context(&tail, &c);
+        cmd = tx_offload_bits(flags, &upper);
+        for (i = start; i < end; i++)
+        {
+            pp[i]->pp_ref++;
+            tx_pages[tail] = pp[i];
+            tx_queue[tail].buffer_addr = page2pa(pp[i]) + PGOFF(frags[i].pf_va);
+            tx_queue[tail].lower.data = frags[i].pf_len | cmd
+                | (i == end - 1 ? E1000_TXD_CMD_EOP | E1000_TXD_CMD_RS : 0);
+            tx_queue[tail].upper.data = upper;
+            tail = (tail + 1) % e1000_ntxdesc;
+        }
+        avail -= need;
+        npkts++;
+    }
+    if (start < nfrags)
+        stats.ps_tx_full++;
+    *(uint32_t *)((void*)e1000 + E1000_TDT) = tail;
+    stats.ps_tx_packets += npkts;
+    *ndone = tx_frags_done & 0x7fffffff;
+    return npkts;
 }
 
 /*
@@ -48,12 +398,14 @@ int packet_send(void * packet, uint16_t length)
  */
 int packet_recv(void *dest_buf, uint16_t* buf_len)
 {
-    uint32_t tail = (*(uint32_t *)((void*)e1000 + E1000_RDT) + 1) % NRXDESC;
+    uint32_t tail = (*(uint32_t *)((void*)e1000 + E1000_RDT) + 1) % e1000_nrxdesc;
+    stats.ps_rx_calls++;
     if (rx_queue[tail].status & E1000_RXD_STAT_DD)
     {
+        stats.ps_rx_packets++;
         *buf_len = (uint16_t)rx_queue[tail].gth;
 
-        memcpy(dest_buf, (void *)rx_packet_buf + tail * 2048, rx_queue[tail].gth);
+        memcpy(dest_buf, page2kva(rx_pages[tail]) + PKT_OFFSET, rx_queue[tail].gth);
         rx_queue[tail].status &= ~E1000_RXD_STAT_DD;
         rx_queue[tail].status |= E1000_RXD_STAT_EOP;
         *(uint32_t *)((void*)e1000 + E1000_RDT) = tail;
@@ -65,22 +417,282 @@ int packet_recv(void *dest_buf, uint16_t* buf_len)
     }
 }
 
+/*
+ * The checksums of the packet in receive descriptor d that the card
+ * has verified, as PACKET_CSUM_IP and PACKET_CSUM_L4.
+ */
+static uint16_t rx_csum_flags(const struct e1000_rx_desc *d)
+{
+    uint16_t flags = 0;
+
+    if (d->status & E1000_RXD_STAT_IXSM)
+        return 0;
+    if ((d->status & E1000_RXD_STAT_IPCS) && !(d->errors & E1000_RXD_ERR_IPE))
+        flags |= PACKET_CSUM_IP;
+    if ((d->status & E1000_RXD_STAT_TCPCS) && !(d->errors & E1000_RXD_ERR_TCPE))
+        flags |= PACKET_CSUM_L4;
+    return flags;
+}
+
+/*
+ * May the page e maps at va be replaced in both e and peer?  Only if
+ * both map the same page there, writable: then e could already write
+ * whatever it likes into peer's page.
+ * Return the software bits (PTE_AVAIL) of e's mapping if so, or -1.
+ */
+static int rx_shared(struct Env *e, struct Env *peer, void *va)
+{
+    struct PageInfo *pp;
+    pte_t *pte, *peer_pte;
+
+    pp = page_lookup(e->env_pgdir, va, &pte);
+    if (!pp || !(*pte & PTE_W)
+        || page_lookup(peer->env_pgdir, va, &peer_pte) != pp
+        || !(*peer_pte & PTE_W))
+        return -1;
+    return *pte & PTE_AVAIL;
+}
+
+/*
+ * Give environment e the pages holding up to n received packets,
+ * mapped at va, va + PGSIZE, ... with permission perm, and put fresh
+ * pages in their places in the ring, with one tail update for all of
+ * them.  Each page holds a struct jif_pkt: the length of the packet,
+ * the checksums the card verified, then the packet.  Nothing is copied.
+ * If peer is not null, each page is mapped at the same address in
+ * peer as well, so that e can receive straight into memory it shares
+ * with peer; every page replaced must then be one e and peer both map
+ * writable (see rx_shared), and its replacement keeps the software
+ * bits of e's mapping, so that a page the library shares across fork
+ * (PTE_SHARE) stays shared.
+ * While the ring is being polled, no more packets are returned than
+ * are left of the budget (see packet_recv_wait).
+ * Return the number of packets on success, -1 on "try again",
+ * -E_INVAL if the first page is not shared with peer, or -E_NO_MEM if
+ * out of memory before any packet could be returned.
+ */
+int packet_recv_pages(struct Env *e, struct Env *peer, void *va, int n, int perm)
+{
+    uint32_t tail = (*(uint32_t *)((void*)e1000 + E1000_RDT) + 1) % e1000_nrxdesc;
+    struct PageInfo *pp, *fresh;
+    int i, len, avail = 0, r = -1;
+
+    stats.ps_rx_calls++;
+    if (rx_polling)
+        n = MIN(n, rx_budget);
+    for (i = 0; i < n && (rx_queue[tail].status & E1000_RXD_STAT_DD); i++)
+    {
+        if (peer && (avail = rx_shared(e, peer, va + i * PGSIZE)) < 0)
+        {
+            r = -E_INVAL;
+            break;
+        }
+        if (!(fresh = page_alloc(0)))
+        {
+            r = -E_NO_MEM;
+            break;
+        }
+        pp = rx_pages[tail];
+        len = rx_queue[tail].gth;
+        // Fill in the length and flags, and clear what the previous
+        // user of the page left after the packet
+        *(int *)page2kva(pp) = len;
+        *(uint16_t *)(page2kva(pp) + PKT_FLAGS) = rx_csum_flags(&rx_queue[tail]);
+        *(uint16_t *)(page2kva(pp) + PKT_MSS) = 0;
+        memset(page2kva(pp) + PKT_OFFSET + len, 0, PGSIZE - PKT_OFFSET - len);
+        if ((r = page_insert(e->env_pgdir, pp, va + i * PGSIZE, perm | avail)) < 0)
+        {
+            page_free(fresh);
+            break;
+        }
+        // Both already map a page here, so this needs no page table
+        // and cannot fail
+        if (peer)
+            page_insert(peer->env_pgdir, pp, va + i * PGSIZE, perm | avail);
+        // The environments hold the page now
+        page_decref(pp);
+
+        fresh->pp_ref++;
+        rx_pages[tail] = fresh;
+        rx_queue[tail].buffer_addr = page2pa(fresh) + PKT_OFFSET;
+        rx_queue[tail].status = 0;
+        tail = (tail + 1) % e1000_nrxdesc;
+    }
+    if (i == 0)
+        return r;
+    // The pages peer mapped before may be reused now, and peer must
+    // not look at them through its TLB
+    if (peer)
+        tlb_shootdown(peer);
+    *(uint32_t *)((void*)e1000 + E1000_RDT) = (tail + e1000_nrxdesc - 1) % e1000_nrxdesc;
+    stats.ps_rx_packets += i;
+    if (rx_polling)
+        rx_budget -= i;
+    return i;
+}
+
+/*
+ * Copy the driver's counters to st.
+ */
+void packet_stats(struct PacketStats *st)
+{
+    // The card counts the packets it had no descriptor for
+    stats.ps_rx_missed += *(uint32_t *)((void*)e1000 + E1000_MPC);
+    *st = stats;
+}
+
+/*
+ * Is there a received packet that packet_recv would return?
+ */
+static int rx_ready(void)
+{
+    uint32_t tail = (*(uint32_t *)((void*)e1000 + E1000_RDT) + 1) % e1000_nrxdesc;
+    return rx_queue[tail].status & E1000_RXD_STAT_DD;
+}
+
+// Make the environment with id *waiter runnable, if it still waits.
+static void wake(envid_t *waiter)
+{
+    struct Env *e;
+
+    if (*waiter && envid2env(*waiter, &e, 0) == 0 && e->env_status == ENV_NOT_RUNNABLE)
+        e->env_status = ENV_RUNNABLE;
+    *waiter = 0;
+}
+
+/*
+ * Make the environment waiting for room to send runnable, now that
+ * the card has written back transmit descriptors.
+ */
+static void tx_written_back(void)
+{
+    if (tx_waiter)
+    {
+        wake(&tx_waiter);
+        *(uint32_t *)((void*)e1000 + E1000_IMC) = E1000_IMS_TXDW;
+    }
+}
+
+/*
+ * Called by environment e when packet_recv_pages has nothing for it.
+ * A receive interrupt turns receive interrupts off, and e polls the
+ * ring until it is empty, taking up to e1000_poll_budget packets
+ * before letting other environments run.  Once the ring is empty,
+ * interrupts go back on and e blocks until one comes.
+ * Return 0 if packets are waiting and e may take them, 1 if e must
+ * block, or 2 if e has used up its budget and must yield first.
+ * The caller marks e not runnable for 1, and e1000_intr makes it
+ * runnable again; for 2, the caller just lets the others run.
+ */
+int packet_recv_wait(struct Env *e)
+{
+    if (rx_ready())
+    {
+        if (!rx_polling || rx_budget > 0)
+            return 0;
+        rx_budget = e1000_poll_budget;
+        return 2;
+    }
+    // Causes left by packets e has already taken would interrupt at
+    // once: clear them, passing on a transmit one
+    if (*(uint32_t *)((void*)e1000 + E1000_ICR) & E1000_ICR_TXDW)
+        tx_written_back();
+    rx_polling = 0;
+    rx_waiter = e->env_id;
+    *(uint32_t *)((void*)e1000 + E1000_IMS) = RX_CAUSES;
+    // A packet that came in before that would not interrupt
+    if (rx_ready())
+    {
+        rx_waiter = 0;
+        *(uint32_t *)((void*)e1000 + E1000_IMC) = RX_CAUSES;
+        rx_polling = 1;
+        rx_budget = e1000_poll_budget;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Block environment e until the transmit ring has room.
+ * Return 1 if e must block, 0 if there is room already.
+ * The caller marks e not runnable; e1000_intr makes it runnable again.
+ */
+int packet_send_wait(struct Env *e)
+{
+    tx_reclaim();
+    if (tx_nfree() > 0)
+        return 0;
+    // Descriptor write-backs interrupt only while someone waits for
+    // them.  Check again once they do, in case the last one has
+    // already happened.
+    tx_waiter = e->env_id;
+    *(uint32_t *)((void*)e1000 + E1000_IMS) = E1000_IMS_TXDW;
+    tx_reclaim();
+    if (tx_nfree() > 0)
+    {
+        tx_waiter = 0;
+        *(uint32_t *)((void*)e1000 + E1000_IMC) = E1000_IMS_TXDW;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Handle an interrupt from the card: reading ICR acknowledges it.
+ * Receive interrupts wake the environment waiting for packets and
+ * turn themselves off while it polls (see packet_recv_wait), and
+ * transmit write-backs wake the one waiting for room to send.
+ */
+void e1000_intr(void)
+{
+    uint32_t icr = *(uint32_t *)((void*)e1000 + E1000_ICR);
+
+    if (icr & RX_CAUSES)
+    {
+        stats.ps_rx_intrs++;
+        *(uint32_t *)((void*)e1000 + E1000_IMC) = RX_CAUSES;
+        rx_polling = 1;
+        rx_budget = e1000_poll_budget;
+        wake(&rx_waiter);
+    }
+    if (icr & E1000_ICR_TXDW)
+        tx_written_back();
+}
+
+/*
+ * Allocate zeroed, page-aligned, physically contiguous memory for
+ * the card.  It is never freed.
+ */
+static void *ring_alloc(uint32_t size)
+{
+    uint32_t i, n = ROUNDUP(size, PGSIZE) / PGSIZE;
+    struct PageInfo *pp = page_alloc_npages(n, ALLOC_ZERO);
+
+    if (!pp)
+        panic("E1000_attach: no %d contiguous pages for the rings", n);
+    for (i = 0; i < n; i++)
+        pp[i].pp_ref++;
+    return page2kva(pp);
+}
+
 // LAB 6: Your driver code here
 int E1000_attach(struct pci_func *f)
 {
     pci_func_enable(f);
     e1000 = mmio_map_region(f->reg_base[0], f->reg_size[0]);
     //uint32_t v = *(uint32_t *)((void*)e1000 + E1000_STATUS);
-    /*
-    tx_queue = boot_alloc(NTXDESC * sizeof(struct e1000_tx_desc));
-    rx_queue = boot_alloc(NRXDESC * sizeof(struct e1000_rx_desc));
-    tx_packet_buf = boot_alloc(NTXDESC * PKTSIZE);
-    rx_packet_buf = boot_alloc(NRXDESC * 2048);
-    */
-    memset((void *) tx_queue, 0, NTXDESC * sizeof(struct e1000_tx_desc));
-    memset(tx_packet_buf, 0, NTXDESC * PKTSIZE);
+    if (e1000_ntxdesc < 8 || e1000_ntxdesc > E1000_MAXDESC || e1000_ntxdesc % 8
+        || e1000_nrxdesc < 8 || e1000_nrxdesc > E1000_MAXDESC || e1000_nrxdesc % 8)
+        panic("E1000_attach: bad ring sizes %d and %d", e1000_ntxdesc, e1000_nrxdesc);
+    tx_queue = ring_alloc(e1000_ntxdesc * sizeof(struct e1000_tx_desc));
+    tx_packet_buf = ring_alloc(e1000_ntxdesc * PKTSIZE);
+    tx_pages = ring_alloc(e1000_ntxdesc * sizeof(struct PageInfo *));
+    rx_queue = ring_alloc(e1000_nrxdesc * sizeof(struct e1000_rx_desc));
+    rx_pages = ring_alloc(e1000_nrxdesc * sizeof(struct PageInfo *));
+    cprintf("e1000: %d transmit and %d receive descriptors\n", e1000_ntxdesc, e1000_nrxdesc);
+
     int i;
-    for (i=0; i<NTXDESC; i++)
+    for (i=0; i<e1000_ntxdesc; i++)
     {
         tx_queue[i].buffer_addr = (uint32_t)(PADDR(tx_packet_buf + PKTSIZE * i));
         tx_queue[i].upper.fields.status |= E1000_TXD_STAT_DD;
@@ -88,7 +700,7 @@ int E1000_attach(struct pci_func *f)
 
     *(uint32_t *)((void*)e1000 + E1000_TDBAL) = (uint32_t)PADDR(tx_queue);
     *(uint32_t *)((void*)e1000 + E1000_TDBAH) = 0;
-    *(uint32_t *)((void*)e1000 + E1000_TDLEN) = NTXDESC * sizeof(struct e1000_tx_desc);
+    *(uint32_t *)((void*)e1000 + E1000_TDLEN) = e1000_ntxdesc * sizeof(struct e1000_tx_desc);
     *(uint32_t *)((void*)e1000 + E1000_TDH) = 0;
     *(uint32_t *)((void*)e1000 + E1000_TDT) = 0;
 
@@ -100,12 +712,12 @@ int E1000_attach(struct pci_func *f)
     *(uint32_t *)((void*)e1000 + E1000_TIPG) = 10;
 
     // Initializing receive queue
-    memset((void *)rx_queue, 0, NRXDESC * sizeof(struct e1000_rx_desc));
-    memset(rx_packet_buf, 0, NRXDESC * 2048);
-    
-    for (i=0; i<NRXDESC; i++)
+    for (i=0; i<e1000_nrxdesc; i++)
     {
-        rx_queue[i].buffer_addr = (uint32_t)(PADDR(rx_packet_buf + 2048*i));
+        if (!(rx_pages[i] = page_alloc(ALLOC_ZERO)))
+            panic("E1000_attach: out of memory for receive buffers");
+        rx_pages[i]->pp_ref++;
+        rx_queue[i].buffer_addr = page2pa(rx_pages[i]) + PKT_OFFSET;
     }
     uint16_t buf[3];
     get_mac_addr((void *)&buf, 1);
@@ -117,13 +729,34 @@ int E1000_attach(struct pci_func *f)
     
     *(uint32_t *)((void *)e1000 + E1000_MTA) = 0;
   
-    *(uint32_t *)((void *)e1000 + E1000_RDLEN) = NRXDESC * sizeof(struct e1000_rx_desc); 
+    *(uint32_t *)((void *)e1000 + E1000_RDLEN) = e1000_nrxdesc * sizeof(struct e1000_rx_desc); 
     
     *(uint32_t *)((void*)e1000 + E1000_RDH) = 0;
-    *(uint32_t *)((void*)e1000 + E1000_RDT) = NRXDESC -1;
+    *(uint32_t *)((void*)e1000 + E1000_RDT) = e1000_nrxdesc -1;
 
+    // Have the card check IPv4, TCP and UDP checksums
+    *(uint32_t *)((void*)e1000 + E1000_RXCSUM) = E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL;
     *(uint32_t *)((void*)e1000 + E1000_RCTL) = 0x04008002;
-  
+
+    // Throttle interrupts: ITR counts in 256 ns units, the receive
+    // delay timers in 1.024 us units
+    if (e1000_poll_budget == 0)
+        e1000_poll_budget = 1;
+    if (e1000_itr)
+        *(uint32_t *)((void*)e1000 + E1000_ITR) = 1000000000 / 256 / e1000_itr;
+    *(uint32_t *)((void*)e1000 + E1000_RDTR) = e1000_rdtr * 1000 / 1024;
+    *(uint32_t *)((void*)e1000 + E1000_RADV) = e1000_radv * 1000 / 1024;
+    cprintf("e1000: at most %d interrupts/s, receive delay %d/%d us, poll budget %d\n",
+            e1000_itr, e1000_rdtr, e1000_radv, e1000_poll_budget);
+
+    // Interrupt when packets arrive, when the free receive descriptors
+    // run low, and when packets are lost for lack of them
+    e1000_irq = f->irq_line;
+    *(uint32_t *)((void*)e1000 + E1000_ICR);
+    *(uint32_t *)((void*)e1000 + E1000_MPC);
+    *(uint32_t *)((void*)e1000 + E1000_IMS) = RX_CAUSES;
+    irq_setmask_8259A(irq_mask_8259A & ~(1 << e1000_irq));
+
     return 0;
 }
 
@@ -2,6 +2,8 @@
 #define JOS_KERN_E1000_H
 
 #include<kern/pci.h>
+#include <inc/env.h>
+#include <inc/syscall.h>
 
 #define E1000_STATUS   0x00008  /* Device Status - RO */
 #define E1000_TDBAL    0x03800  /* TX Descriptor Base Address Low - RW */
@@ -9,7 +11,7 @@
 #define E1000_TDLEN    0x03808  /* TX Descriptor Length - RW */
 #define E1000_TDH      0x03810  /* TX Descriptor Head - RW */
 #define E1000_TDT      0x03818  /* TX Descripotr Tail - RW */
-#define NTXDESC        32       /* Total number of transmit descriptors*/
+#define NTXDESC        256      /* Default number of transmit descriptors*/
 #define PKTSIZE        1518
 
 /* Transmit Control */
@@ -24,9 +26,25 @@
 #define E1000_TXD_STAT_DD    0x00000001 /* Descriptor Done */
 #define E1000_TXD_CMD_RS     0x08000000 /* Report Status */
 #define E1000_TXD_CMD_EOP    0x01000000 /* End of Packet */
+#define E1000_TXD_CMD_DEXT   0x20000000 /* Descriptor extension (0 = legacy) */
+#define E1000_TXD_CMD_TSE    0x04000000 /* TCP Seg enable */
+#define E1000_TXD_DTYP_D     0x00100000 /* Data Descriptor */
+#define E1000_TXD_DTYP_C     0x00000000 /* Context Descriptor */
+#define E1000_TXD_CMD_IP     0x02000000 /* IP packet (context) */
+#define E1000_TXD_CMD_TCP    0x01000000 /* TCP packet (context) */
+#define E1000_TXD_POPTS_IXSM 0x01       /* Insert IP checksum */
+#define E1000_TXD_POPTS_TXSM 0x02       /* Insert TCP/UDP checksum */
 
 /* Receiving packets*/
-#define NRXDESC         128
+#define NRXDESC         256      /* Default number of receive descriptors */
+// Most descriptors a ring may have; a ring must be a multiple of 8
+#define E1000_MAXDESC   4096
+// Each receive descriptor has a page of its own.  Pages passed between
+// the driver and user environments hold a struct jif_pkt: the length
+// of the packet, its offload flags and segment size, then the packet.
+#define PKT_FLAGS       4
+#define PKT_MSS         6
+#define PKT_OFFSET      8
 #define E1000_RDBAL    0x02800  /* RX Descriptor Base Address Low - RW */
 #define E1000_RDBAH    0x02804  /* RX Descriptor Base Address High - RW */
 #define E1000_RDBAL0   E1000_RDBAL /* RX Desc Base Address Low (0) - RW */
@@ -50,13 +68,54 @@
 #define E1000_RDT      0x02818  /* RX Descriptor Tail - RW */
 
 #define E1000_RCTL     0x00100  /* RX Control - RW */
+#define E1000_MPC      0x04010  /* Missed Packet Count - R/clr */
 #define E1000_RXD_STAT_DD       0x01    /* Descriptor Done */
 #define E1000_RXD_STAT_EOP      0x02    /* End of Packet */
+#define E1000_RXD_STAT_IXSM     0x04    /* Ignore checksum */
+#define E1000_RXD_STAT_TCPCS    0x20    /* TCP xsum calculated */
+#define E1000_RXD_STAT_IPCS     0x40    /* IP xsum calculated */
+#define E1000_RXD_ERR_TCPE      0x20    /* TCP/UDP Checksum Error */
+#define E1000_RXD_ERR_IPE       0x40    /* IP Checksum Error */
+
+#define E1000_RXCSUM   0x05000  /* RX Checksum Control - RW */
+#define E1000_RXCSUM_IPOFL     0x00000100   /* IPv4 checksum offload */
+#define E1000_RXCSUM_TUOFL     0x00000200   /* TCP / UDP checksum offload */
+
+/* Interrupts */
+#define E1000_ICR      0x000C0  /* Interrupt Cause Read - R/clr */
+#define E1000_IMS      0x000D0  /* Interrupt Mask Set - RW */
+#define E1000_IMC      0x000D8  /* Interrupt Mask Clear - WO */
+#define E1000_ICR_TXDW    0x00000001 /* Transmit desc written back */
+#define E1000_ICR_RXDMT0  0x00000010 /* rx desc min. threshold (0) */
+#define E1000_ICR_RXO     0x00000040 /* rx overrun */
+#define E1000_ICR_RXT0    0x00000080 /* rx timer intr (ring 0) */
+#define E1000_IMS_TXDW    E1000_ICR_TXDW
+#define E1000_IMS_RXDMT0  E1000_ICR_RXDMT0
+#define E1000_IMS_RXO     E1000_ICR_RXO
+#define E1000_IMS_RXT0    E1000_ICR_RXT0
+#define E1000_ITR      0x000C4  /* Interrupt Throttling Rate - RW */
+#define E1000_RDTR     0x02820  /* RX Delay Timer - RW */
+#define E1000_RADV     0x0282C  /* RX Interrupt Absolute Delay Timer - RW */
+// Defaults for the interrupt throttling boot parameters: interrupts a
+// second (0 for no limit), the receive delay timers in microseconds,
+// and the packets the input environment takes per interrupt before
+// letting others run
+#define NET_ITR_DEFAULT          20000
+#define NET_RDTR_DEFAULT         0
+#define NET_RADV_DEFAULT         0
+#define NET_POLL_BUDGET_DEFAULT  64
 
 
 int E1000_attach(struct pci_func *pcif);
 int packet_send(void *packet, uint16_t size);
+int packet_send_pages(const void *pkts, int n);
+int packet_send_frags(struct Env *e, const struct PacketFrag *ufrags, int nfrags, uint32_t *ndone);
 int packet_recv(void *dest_buf, uint16_t *buf_len);
+int packet_recv_pages(struct Env *e, struct Env *peer, void *va, int n, int perm);
+int packet_recv_wait(struct Env *e);
+int packet_send_wait(struct Env *e);
+void packet_stats(struct PacketStats *st);
+void e1000_intr(void);
 void get_mac_addr(void *addr_buf, int raw);
 
 struct e1000_tx_desc {
@@ -79,6 +138,20 @@ struct e1000_tx_desc {
     } upper;
 };
 
+/* Offload context for the data descriptors that follow it */
+struct e1000_context_desc {
+    uint8_t ipcss;              /* IP checksum start */
+    uint8_t ipcso;              /* IP checksum offset */
+    uint16_t ipcse;             /* IP checksum end */
+    uint8_t tucss;              /* TCP checksum start */
+    uint8_t tucso;              /* TCP checksum offset */
+    uint16_t tucse;             /* TCP checksum end */
+    uint32_t cmd_and_length;    /* TSO payload length and command */
+    uint8_t status;             /* Descriptor status */
+    uint8_t hdr_len;            /* Header length */
+    uint16_t mss;               /* Maximum segment size */
+};
+
 struct e1000_rx_desc {
     uint64_t buffer_addr; /* Address of the descriptor's data buffer */
     uint16_t gth;     /* Length of data DMAed into data buffer */
@@ -87,16 +160,12 @@ struct e1000_rx_desc {
     uint8_t errors;      /* Descriptor Errors */
     uint16_t special;
 };
-/*
+extern int e1000_irq;
+extern uint32_t e1000_ntxdesc, e1000_nrxdesc;
+extern uint32_t e1000_itr, e1000_rdtr, e1000_radv, e1000_poll_budget;
+
 extern struct e1000_tx_desc *tx_queue;
-extern void *tx_packet_buf;
+extern char *tx_packet_buf;
 extern struct e1000_rx_desc *rx_queue;
-extern void *rx_packet_buf;
-*/
-extern struct e1000_tx_desc tx_queue[NTXDESC];
-extern char tx_packet_buf[NTXDESC * PKTSIZE];
-
-extern struct e1000_rx_desc rx_queue[NRXDESC];
-extern char rx_packet_buf[NRXDESC * 2048];
 
 #endif	// JOS_KERN_E1000_H
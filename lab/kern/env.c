@@ -268,6 +268,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// No interrupts have been delivered yet.
+	e->env_irq_pending = 0;
+	e->env_irq_waiting = 0;
+
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
@@ -559,6 +563,10 @@ env_run(struct Env *e)
         (curenv->env_runs)++;
         lcr3(PADDR(curenv->env_pgdir));
     }
+    else if (thiscpu->cpu_tlbstale)
+        lcr3(PADDR(curenv->env_pgdir));
+    thiscpu->cpu_tlbstale = 0;
+    thiscpu->cpu_user = 1;
     unlock_kernel();
     env_pop_tf(&(e->env_tf));
 }
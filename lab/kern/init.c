@@ -16,6 +16,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/e1000.h>
 
 static void boot_aps(void);
 
@@ -52,6 +53,29 @@ i386_init(void)
 
 	// Lab 6 hardware initialization functions
 	time_init();
+	// Ring sizes can be chosen when building, e.g. with
+	// make INIT_CFLAGS=-DNET_NTXDESC=1024
+#ifdef NET_NTXDESC
+	e1000_ntxdesc = NET_NTXDESC;
+#endif
+#ifdef NET_NRXDESC
+	e1000_nrxdesc = NET_NRXDESC;
+#endif
+	// So can interrupt throttling and the input environment's polling
+	// budget, e.g. with
+	// make INIT_CFLAGS='-DNET_ITR=8000 -DNET_POLL_BUDGET=16'
+#ifdef NET_ITR
+	e1000_itr = NET_ITR;
+#endif
+#ifdef NET_RDTR
+	e1000_rdtr = NET_RDTR;
+#endif
+#ifdef NET_RADV
+	e1000_radv = NET_RADV;
+#endif
+#ifdef NET_POLL_BUDGET
+	e1000_poll_budget = NET_POLL_BUDGET;
+#endif
 	pci_init();
 
 	// Acquire the big kernel lock before waking up APs
@@ -30,11 +30,18 @@ struct pci_driver pci_attach_class[] = {
 
 // pci_attach_vendor matches the vendor ID and device ID of a PCI device. key1
 // and key2 should be the vendor ID and device ID respectively
+static int piix_ide_attach(struct pci_func *pcif);
+
 struct pci_driver pci_attach_vendor[] = {
     {0x8086, 0x100E, &E1000_attach},
+	{ 0x8086, 0x7010, &piix_ide_attach },	// PIIX3 IDE
+	{ 0x8086, 0x7111, &piix_ide_attach },	// PIIX4 IDE
 	{ 0, 0, 0 },
 };
 
+// I/O base of the IDE bus-master DMA registers, or 0 if none
+uint32_t pci_ide_bmbase;
+
 static void
 pci_conf1_set_addr(uint32_t bus,
 		   uint32_t dev,
@@ -86,6 +93,18 @@ pci_attach_match(uint32_t key1, uint32_t key2,
 	return 0;
 }
 
+// The file system server drives the IDE disk itself.  All the kernel
+// does for the PIIX controller is enable bus mastering and note where
+// the bus-master registers (I/O BAR 4) are, for sys_ide_dma_base.
+static int
+piix_ide_attach(struct pci_func *pcif)
+{
+	pci_func_enable(pcif);
+	pci_ide_bmbase = pcif->reg_base[4];
+	cprintf("PCI: IDE bus-master DMA registers at 0x%x\n", pci_ide_bmbase);
+	return 1;
+}
+
 static int
 pci_attach(struct pci_func *f)
 {
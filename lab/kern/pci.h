@@ -30,4 +30,6 @@ struct pci_bus {
 int  pci_init(void);
 void pci_func_enable(struct pci_func *f);
 
+extern uint32_t pci_ide_bmbase;
+
 #endif
@@ -391,6 +391,50 @@ page_alloc(int alloc_flags)
     return phy_page;
 }
 
+//
+// Allocates 'n' physically contiguous pages and returns the first, for
+// devices that DMA to structures larger than a page.  As with
+// page_alloc, the reference counts are left at 0, and ALLOC_ZERO in
+// alloc_flags zeroes the pages.  This searches all of memory, so use it
+// for long-lived allocations such as at boot.
+//
+// Returns NULL if there is no run of 'n' free pages.
+//
+struct PageInfo *
+page_alloc_npages(size_t n, int alloc_flags)
+{
+	struct PageInfo **pl, *pp;
+	size_t i, run = 0;
+
+	if (n == 0)
+		return NULL;
+	// Free pages are those on the free list, which all have pp_link
+	// set except the last one; skipping that one is harmless.
+	// Search downward, to leave low memory for others.
+	for (i = npages; i-- > 0; ) {
+		if (pages[i].pp_ref == 0 && pages[i].pp_link)
+			run++;
+		else
+			run = 0;
+		if (run == n)
+			break;
+	}
+	if (run < n)
+		return NULL;
+
+	for (pl = &page_free_list; *pl; ) {
+		pp = *pl;
+		if (pp >= &pages[i] && pp < &pages[i + n]) {
+			*pl = pp->pp_link;
+			pp->pp_link = NULL;
+		} else
+			pl = &pp->pp_link;
+	}
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(&pages[i]), 0, n * PGSIZE);
+	return &pages[i];
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -618,6 +662,28 @@ tlb_invalidate(pde_t *pgdir, void *va)
 		invlpg(va);
 }
 
+//
+// Make sure that no CPU goes on using stale TLB entries for
+// environment e, whose page table the caller has changed.  Only a CPU
+// running e in user mode can have them: a CPU that switches to e
+// loads its page directory afresh.  That CPU is interrupted, and we
+// wait until it has left user mode; env_run reloads cr3 before it
+// goes back.
+//
+void
+tlb_shootdown(struct Env *e)
+{
+	struct CpuInfo *c;
+
+	if (e == curenv || e->env_status != ENV_RUNNING)
+		return;
+	c = &cpus[e->env_cpunum];
+	c->cpu_tlbstale = 1;
+	lapic_ipi_cpu(c->cpu_id, T_TLBFLUSH);
+	while (c->cpu_user)
+		asm volatile("pause");
+}
+
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
 // location.  Return the base of the reserved region.  size does *not*
@@ -13,6 +13,12 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/pci.h>
+
+static int sys_ipc_try_send_pages(envid_t envid, uint32_t value,
+				  void *srcva, size_t npages, unsigned perm);
+static int sys_ipc_recv_pages(void *dstva, size_t npages);
+static int sys_ipc_recv_arm(void *dstva, size_t npages);
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -286,7 +292,7 @@ sys_page_map(envid_t srcenvid, void *srcva,
     }
     srcpage = page_lookup(srcenv->env_pgdir, srcva, &srcpte);
     if (!srcpage ||
-        ((perm & PTE_W) && !((*srcpte) & (PTE_W | PTE_P | PTE_U)))
+        ((perm & PTE_W) && !((*srcpte) & PTE_W))
         )
     {
         return -E_INVAL;
@@ -369,50 +375,71 @@ static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
-    struct Env *dstenv;
-    struct PageInfo * pp;
-    pte_t * pte;
-    int r;
-    if ((r = envid2env(envid, &dstenv, 0)) < 0)
-    {
-        return r; //-E_BAD_ENV
-    }
-    if (!dstenv->env_ipc_recving)
-    {
-        return -E_IPC_NOT_RECV;
-    }
-    if ((int) srcva < UTOP)
-    {
-        if ((PGOFF(srcva) || 
-            ((perm | PTE_SYSCALL) != PTE_SYSCALL) || 
-            ((perm | PTE_U | PTE_P) != perm)))
-        {
-            return -E_INVAL;
-        }
-        pp = page_lookup(curenv->env_pgdir, srcva, &pte);
-        if ((int)srcva < UTOP && !pp)
-        {
-            return -E_INVAL;
-        }
-        if ((perm & PTE_W) && !(*pte & PTE_W))
-        {
-            return -E_INVAL;
-        }
-        if ((int)dstenv->env_ipc_dstva < UTOP)
-        {
-            if (page_insert(dstenv->env_pgdir, pp, dstenv->env_ipc_dstva, perm) < 0)
-            {
-                return -E_NO_MEM;
-            }
-            dstenv->env_ipc_perm = perm;
-        }
-    }
-    dstenv-> env_ipc_recving = 0;
-    dstenv-> env_ipc_from = curenv->env_id;
-    dstenv-> env_ipc_value = value;
-    dstenv->env_status = ENV_RUNNABLE;
-    sys_yield();
-    return 0; 
+	return sys_ipc_try_send_pages(envid, value, srcva, 1, perm);
+}
+
+// Like sys_ipc_try_send, but send the 'npages' consecutive pages
+// starting at 'srcva'.  The receiver gets as many of them as it asked
+// for in sys_ipc_recv_pages, mapped consecutively starting at its
+// dstva, and its env_ipc_npages is set to the number of pages mapped.
+// Every page is checked before any of them is mapped.
+//
+// Errors are the same as for sys_ipc_try_send, plus:
+//	-E_INVAL if srcva < UTOP and npages is 0 or the pages would
+//		extend past UTOP.
+static int
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva,
+		       size_t npages, unsigned perm)
+{
+	struct Env *dstenv;
+	struct PageInfo *pp;
+	pte_t *pte;
+	size_t i, n;
+	int r;
+
+	if ((r = envid2env(envid, &dstenv, 0)) < 0)
+		return r;
+	if (!dstenv->env_ipc_recving)
+		return -E_IPC_NOT_RECV;
+
+	n = 0;
+	if ((uintptr_t) srcva < UTOP) {
+		if (PGOFF(srcva) || npages == 0
+		    || npages > (UTOP - (uintptr_t) srcva) / PGSIZE
+		    || (perm | PTE_SYSCALL) != PTE_SYSCALL
+		    || (perm | PTE_U | PTE_P) != perm)
+			return -E_INVAL;
+		for (i = 0; i < npages; i++) {
+			pp = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, &pte);
+			if (!pp || ((perm & PTE_W) && !(*pte & PTE_W)))
+				return -E_INVAL;
+		}
+		if ((uintptr_t) dstenv->env_ipc_dstva < UTOP)
+			n = MIN(npages, dstenv->env_ipc_npages);
+		for (i = 0; i < n; i++) {
+			pp = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, 0);
+			if (page_insert(dstenv->env_pgdir, pp,
+					dstenv->env_ipc_dstva + i * PGSIZE, perm) < 0)
+				return -E_NO_MEM;
+		}
+	}
+	dstenv->env_ipc_from = curenv->env_id;
+	dstenv->env_ipc_value = value;
+	dstenv->env_ipc_perm = n ? perm : 0;
+	dstenv->env_ipc_npages = n;
+	dstenv->env_irq_waiting = 0;
+	// A receiver that armed its receive may be watching
+	// env_ipc_recving from another CPU: the message must be complete
+	// before it drops.  The processor keeps stores in order.
+	asm volatile("" : : : "memory");
+	dstenv->env_ipc_recving = 0;
+	// The receiver may still be running if it used sys_ipc_recv_arm
+	if (dstenv->env_status == ENV_NOT_RUNNABLE)
+		dstenv->env_status = ENV_RUNNABLE;
+	// sys_yield does not return, so set our return value here
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sys_yield();
+	return 0;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -430,17 +457,154 @@ static int
 sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
-    int r;
-    if ((int)dstva < UTOP && PGOFF(dstva))
-    {
-        return -E_INVAL;
-    }
-    curenv->env_ipc_recving = 1;
-    curenv->env_ipc_dstva = dstva;
-    curenv->env_status = ENV_NOT_RUNNABLE;
+	return sys_ipc_recv_pages(dstva, 1);
+}
+
+// Like sys_ipc_recv, but be willing to receive up to 'npages' pages,
+// mapped consecutively starting at 'dstva'.
+//
+// Return < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned,
+//		npages is 0, or the pages would extend past UTOP.
+static int
+sys_ipc_recv_pages(void *dstva, size_t npages)
+{
+	int r;
+
+	if ((r = sys_ipc_recv_arm(dstva, npages)) < 0)
+		return r;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	return 0;
+}
+
+// Like sys_ipc_recv_pages, but do not block: record that we are willing
+// to receive and return to the caller at once.  The message arrives
+// while we keep running; env_ipc_recving drops to 0 when it has.  Use
+// sys_ipc_recv_wait to block until then.
+//
+// Return < 0 on error.  Errors are as for sys_ipc_recv_pages.
+static int
+sys_ipc_recv_arm(void *dstva, size_t npages)
+{
+	if ((uintptr_t) dstva < UTOP
+	    && (PGOFF(dstva) || npages == 0
+		|| npages > (UTOP - (uintptr_t) dstva) / PGSIZE))
+		return -E_INVAL;
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_npages = npages;
+	return 0;
+}
+
+// Block until the receive started by sys_ipc_recv_arm has completed,
+// or until one of our interrupts fires (see sys_irq_register).
+// Returns 0 at once if the receive already has completed or an
+// interrupt is pending.
+static int
+sys_ipc_recv_wait(void)
+{
+	if (curenv->env_ipc_recving && !curenv->env_irq_pending) {
+		curenv->env_irq_waiting = 1;
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	}
 	return 0;
 }
 
+// Does the current environment have I/O privilege?
+static bool
+curenv_has_iopl(void)
+{
+	return (curenv->env_tf.tf_eflags & FL_IOPL_MASK) == FL_IOPL_3;
+}
+
+// Deliver hardware interrupt 'irq' to the current environment from now
+// on, replacing any environment that has exited.  Each time the
+// interrupt fires, the kernel sets bit 'irq' of env_irq_pending and
+// wakes us if we are blocked in sys_irq_wait or sys_ipc_recv_wait.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment does not have I/O privilege.
+//	-E_INVAL if irq is not a valid IRQ, is handled by the kernel, or
+//		is already delivered to another environment.
+static int
+sys_irq_register(int irq)
+{
+	struct Env *e;
+
+	if (!curenv_has_iopl())
+		return -E_BAD_ENV;
+	if (irq < 0 || irq >= MAX_IRQS || irq == IRQ_TIMER || irq == IRQ_KBD
+	    || irq == IRQ_SLAVE || irq == IRQ_SERIAL || irq == IRQ_SPURIOUS
+	    || irq == e1000_irq)
+		return -E_INVAL;
+	if (irq_env[irq] && irq_env[irq] != curenv->env_id
+	    && envid2env(irq_env[irq], &e, 0) == 0)
+		return -E_INVAL;
+	irq_env[irq] = curenv->env_id;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	return 0;
+}
+
+// Clear bit 'irq' of env_irq_pending.
+// Returns 0 on success, -E_INVAL if irq is not a valid IRQ.
+static int
+sys_irq_ack(int irq)
+{
+	if (irq < 0 || irq >= MAX_IRQS)
+		return -E_INVAL;
+	curenv->env_irq_pending &= ~(1 << irq);
+	return 0;
+}
+
+// Block until one of our interrupts has fired, that is, until
+// env_irq_pending is not 0.  Returns 0.
+static int
+sys_irq_wait(void)
+{
+	if (!curenv->env_irq_pending) {
+		curenv->env_irq_waiting = 1;
+		curenv->env_status = ENV_NOT_RUNNABLE;
+	}
+	return 0;
+}
+
+// Return the physical address of the page mapped at 'va', so that the
+// caller can point a device's DMA at it.  Only environments with I/O
+// privilege may ask, since they can reach all of memory through
+// devices anyway.  The page must stay mapped until the DMA completes.
+//
+// Returns the physical address on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment does not have I/O privilege.
+//	-E_INVAL if va >= UTOP or va is not mapped.
+static int
+sys_page_paddr(void *va)
+{
+	struct PageInfo *pp;
+
+	if (!curenv_has_iopl())
+		return -E_BAD_ENV;
+	if ((uintptr_t) va >= UTOP
+	    || !(pp = page_lookup(curenv->env_pgdir, va, 0)))
+		return -E_INVAL;
+	return page2pa(pp) | PGOFF(va);
+}
+
+// Return the I/O base of the IDE controller's bus-master DMA
+// registers.
+//
+// Returns < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment does not have I/O privilege.
+//	-E_NOT_SUPP if there is no bus-master IDE controller.
+static int
+sys_ide_dma_base(void)
+{
+	if (!curenv_has_iopl())
+		return -E_BAD_ENV;
+	if (!pci_ide_bmbase)
+		return -E_NOT_SUPP;
+	return pci_ide_bmbase;
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -456,6 +620,42 @@ sys_packet_send(void *packet, uint16_t size)
     return packet_send(packet, size);
 }
 
+/*
+ * Copy up to n packets to the card at once.  The packets are in the
+ * consecutive pages starting at pkts, each holding a struct jif_pkt.
+ * return the number of packets taken, fewer than n if the ring is full
+ * (see sys_packet_send_wait)
+ * return -E_INVAL if n is out of range
+ */
+static int
+sys_packet_send_pages(const void *pkts, int n)
+{
+    if (n < 0 || n > PACKET_MAXBATCH)
+        return -E_INVAL;
+    user_mem_assert(curenv, pkts, n * PGSIZE, 0);
+    return packet_send_pages(pkts, n);
+}
+
+/*
+ * Send the packets made of the nfrags pieces in frags without copying
+ * them.  The pages stay pinned until the card has read them, but the
+ * caller must not change them until the packets have been sent:
+ * *ndone counts the packets sent this way that the card has finished
+ * with.  nfrags may be 0 to only read that count.
+ * return the number of whole packets queued, fewer than given if the
+ * ring is full
+ * return -E_INVAL or -E_FAULT if the pieces are bad
+ */
+static int
+sys_packet_send_frags(const struct PacketFrag *frags, int nfrags, uint32_t *ndone)
+{
+    if (nfrags < 0 || nfrags > PACKET_BATCH_MAXFRAGS)
+        return -E_INVAL;
+    user_mem_assert(curenv, frags, nfrags * sizeof(struct PacketFrag), 0);
+    user_mem_assert(curenv, ndone, sizeof(*ndone), PTE_W);
+    return packet_send_frags(curenv, frags, nfrags, ndone);
+}
+
 /*
  * return 0: success
  * return -1: try again
@@ -468,6 +668,80 @@ sys_packet_recv(void *packet, uint16_t *buf_len)
     return packet_recv(packet, buf_len);
 }
 
+/*
+ * Map the pages holding up to n received packets at va, va + PGSIZE,
+ * ..., in place of whatever was mapped there, without copying the
+ * packets.  Each page holds a struct jif_pkt.  Unless peerid is 0, the
+ * pages go in place of ones the caller shares writable with
+ * environment peerid, and are mapped in both (see packet_recv_pages).
+ * return the number of packets on success
+ * return -1: try again
+ * return -E_INVAL if n is out of range, va is above UTOP or not
+ * page-aligned, or the page at va is not shared with peerid
+ * return -E_BAD_ENV if peerid does not exist
+ * return -E_NO_MEM if out of memory
+ */
+static int
+sys_packet_recv_pages(envid_t peerid, void *va, int n)
+{
+    struct Env *peer = NULL;
+    int r;
+
+    if (n <= 0 || n > PACKET_MAXBATCH || (uintptr_t)va >= UTOP
+        || PGOFF(va) || n > (UTOP - (uintptr_t)va) / PGSIZE)
+        return -E_INVAL;
+    // Mapping into peer is no more than the caller could do by writing
+    // to the pages they share, so peer need not be its child
+    if (peerid && (r = envid2env(peerid, &peer, 0)) < 0)
+        return r;
+    if (peer == curenv)
+        peer = NULL;
+    return packet_recv_pages(curenv, peer, va, n, PTE_U | PTE_P | PTE_W);
+}
+
+/*
+ * Block until the transmit ring has room for a packet.
+ * Return 0, at once if there is room already.
+ */
+static int
+sys_packet_send_wait(void)
+{
+    if (packet_send_wait(curenv))
+        curenv->env_status = ENV_NOT_RUNNABLE;
+    return 0;
+}
+
+// Copy the network driver's counters to *st.
+static int
+sys_packet_stats(struct PacketStats *st)
+{
+    user_mem_assert(curenv, st, sizeof(*st), PTE_W);
+    packet_stats(st);
+    return 0;
+}
+
+/*
+ * Block until sys_packet_recv has a packet to return, or, if the
+ * caller has used up its polling budget, let other environments run
+ * first (see packet_recv_wait).
+ * Return 0, at once if a packet is already waiting.
+ */
+static int
+sys_packet_recv_wait(void)
+{
+    switch (packet_recv_wait(curenv))
+    {
+    case 1:
+        curenv->env_status = ENV_NOT_RUNNABLE;
+        break;
+    case 2:
+        // Still runnable, but no longer running: trap schedules
+        curenv->env_status = ENV_RUNNABLE;
+        break;
+    }
+    return 0;
+}
+
 void
 sys_get_mac_addr(void *addr_buf, int raw)
 {
@@ -482,6 +756,7 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// Return any appropriate return value.
 	// LAB 3: Your code here.
 
+	curenv->env_syscalls++;
 	switch (syscallno) {
     case SYS_cputs:
         sys_cputs((char *)a1, a2);
@@ -519,9 +794,39 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         return sys_packet_send((void *)a1, a2);
     case SYS_packet_recv:
         return sys_packet_recv((void *)a1, (void *)a2);
+    case SYS_packet_send_pages:
+        return sys_packet_send_pages((const void *)a1, a2);
+    case SYS_packet_send_frags:
+        return sys_packet_send_frags((const struct PacketFrag *)a1, a2, (uint32_t *)a3);
+    case SYS_packet_recv_pages:
+        return sys_packet_recv_pages(a1, (void *)a2, a3);
+    case SYS_packet_stats:
+        return sys_packet_stats((struct PacketStats *)a1);
+    case SYS_packet_send_wait:
+        return sys_packet_send_wait();
+    case SYS_packet_recv_wait:
+        return sys_packet_recv_wait();
     case SYS_get_mac_addr:
         sys_get_mac_addr((void *)a1, a2);
         return 0;
+    case SYS_ipc_try_send_pages:
+        return sys_ipc_try_send_pages(a1, a2, (void *)a3, a4, a5);
+    case SYS_ipc_recv_pages:
+        return sys_ipc_recv_pages((void *)a1, a2);
+    case SYS_ipc_recv_arm:
+        return sys_ipc_recv_arm((void *)a1, a2);
+    case SYS_ipc_recv_wait:
+        return sys_ipc_recv_wait();
+    case SYS_irq_register:
+        return sys_irq_register(a1);
+    case SYS_irq_ack:
+        return sys_irq_ack(a1);
+    case SYS_irq_wait:
+        return sys_irq_wait();
+    case SYS_page_paddr:
+        return sys_page_paddr((void *)a1);
+    case SYS_ide_dma_base:
+        return sys_ide_dma_base();
 	default:
 		return -E_INVAL;
 	}
@@ -14,6 +14,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/e1000.h>
 
 static struct Taskstate ts;
 
@@ -63,12 +64,34 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_TLBFLUSH)
+		return "TLB shootdown";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
 }
 
 
+envid_t irq_env[MAX_IRQS];
+
+// Hand hardware interrupt 'irq' to the environment that registered for
+// it with sys_irq_register, waking it if it is waiting for one.
+// Returns false if no live environment has registered.
+static bool
+irq_deliver(int irq)
+{
+	struct Env *e;
+
+	if (!irq_env[irq] || envid2env(irq_env[irq], &e, 0) < 0)
+		return 0;
+	e->env_irq_pending |= 1 << irq;
+	if (e->env_irq_waiting && e->env_status == ENV_NOT_RUNNABLE) {
+		e->env_irq_waiting = 0;
+		e->env_status = ENV_RUNNABLE;
+	}
+	return 1;
+}
+
 void
 trap_init(void)
 {
@@ -82,6 +105,7 @@ trap_init(void)
     }
     SETGATE(idt[T_BRKPT], 0, GD_KT, handler[T_BRKPT], 3);
     SETGATE(idt[T_SYSCALL], 0, GD_KT, handler[T_SYSCALL], 3);
+    SETGATE(idt[T_TLBFLUSH], 0, GD_KT, handler[T_TLBFLUSH], 0);
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -195,6 +219,11 @@ trap_dispatch(struct Trapframe *tf)
     case T_SYSCALL:
         tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx, tf->tf_regs.reg_ecx, tf->tf_regs.reg_ebx, tf->tf_regs.reg_edi, tf->tf_regs.reg_esi);
         return;
+    case T_TLBFLUSH:
+        // Leaving user mode is all tlb_shootdown waits for; env_run
+        // reloads cr3 on the way back
+        lapic_eoi();
+        return;
 	// Handle spurious interrupts
 	// The hardware sometimes raises these because of noise on the
 	// IRQ line or other reasons. We don't care.
@@ -226,7 +255,22 @@ trap_dispatch(struct Trapframe *tf)
         sched_yield();
         return;
     default:
-        ;
+        // The network card, driven by the kernel
+        if (e1000_irq >= 0 && tf->tf_trapno == IRQ_OFFSET + e1000_irq) {
+            e1000_intr();
+            irq_eoi();
+            return;
+        }
+        // Interrupts from devices driven by user environments
+        if (tf->tf_trapno >= IRQ_OFFSET
+            && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS) {
+            int irq = tf->tf_trapno - IRQ_OFFSET;
+            // Nobody is listening anymore; stop the interrupt
+            if (!irq_deliver(irq))
+                irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+            irq_eoi();
+            return;
+        }
     }
 
 	// Unexpected trap: The user process or the kernel has a bug.
@@ -265,6 +309,7 @@ trap(struct Trapframe *tf)
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
 		// LAB 4: Your code here.
+        thiscpu->cpu_user = 0;
         lock_kernel();
 		assert(curenv);
 
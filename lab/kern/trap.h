@@ -8,11 +8,16 @@
 
 #include <inc/trap.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
+#include <kern/picirq.h>
 
 /* The kernel's interrupt descriptor table */
 extern struct Gatedesc idt[];
 extern struct Pseudodesc idt_pd;
 
+/* Environment that each hardware interrupt is delivered to, if any */
+extern envid_t irq_env[MAX_IRQS];
+
 void trap_init(void);
 void trap_init_percpu(void);
 void print_regs(struct PushRegs *regs);
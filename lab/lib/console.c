@@ -38,6 +38,7 @@ static ssize_t devcons_read(struct Fd*, void*, size_t);
 static ssize_t devcons_write(struct Fd*, const void*, size_t);
 static int devcons_close(struct Fd*);
 static int devcons_stat(struct Fd*, struct Stat*);
+static int devcons_poll(struct Fd*);
 
 struct Dev devcons =
 {
@@ -46,7 +47,8 @@ struct Dev devcons =
 	.dev_read =	devcons_read,
 	.dev_write =	devcons_write,
 	.dev_close =	devcons_close,
-	.dev_stat =	devcons_stat
+	.dev_stat =	devcons_stat,
+	.dev_poll =	devcons_poll
 };
 
 int
@@ -83,8 +85,11 @@ devcons_read(struct Fd *fd, void *vbuf, size_t n)
 	if (n == 0)
 		return 0;
 
-	while ((c = sys_cgetc()) == 0)
-		sys_yield();
+	if ((c = fd->fd_cons.ahead))
+		fd->fd_cons.ahead = 0;
+	else
+		while ((c = sys_cgetc()) == 0)
+			sys_yield();
 	if (c < 0)
 		return c;
 	if (c == 0x04)	// ctl-d is eof
@@ -119,6 +124,17 @@ devcons_close(struct Fd *fd)
 	return 0;
 }
 
+// The console can only be asked whether a character has arrived by
+// taking it, so keep it for the next read.  It goes in the Fd page,
+// which every environment and descriptor reading this console shares.
+static int
+devcons_poll(struct Fd *fd)
+{
+	if (!fd->fd_cons.ahead)
+		fd->fd_cons.ahead = sys_cgetc();
+	return (fd->fd_cons.ahead ? POLLIN : 0) | POLLOUT;
+}
+
 static int
 devcons_stat(struct Fd *fd, struct Stat *stat)
 {
@@ -2,8 +2,12 @@
 
 #define debug		0
 
-// Maximum number of file descriptors a program may hold open concurrently
-#define MAXFD		32
+// Maximum number of file descriptors a program may hold open concurrently.
+// 1024 matches the sockets the network server allows (MEMP_NUM_NETCONN)
+// and the keys an epoll instance tracks (DEV_MAXKEYS).  Each fd takes
+// 72 KB of address space below, so past about 3400 the areas would run
+// into the page at NSEVVA (see lib/sockets.c).
+#define MAXFD		1024
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
 // Bottom of file data area.  We reserve one data page for each FD,
@@ -14,6 +18,11 @@
 #define INDEX2FD(i)	((struct Fd*) (FDTABLE + (i)*PGSIZE))
 // Return the file data page for file descriptor index i
 #define INDEX2DATA(i)	((char*) (FILEDATA + (i)*PGSIZE))
+// Bottom of file buffer area.  Each FD may have a buffer of up to
+// FDBUFMAX bytes, which devices can use if they choose.
+#define FDBUFTABLE	(FILEDATA + MAXFD*PGSIZE)
+// Return the buffer area for file descriptor index i
+#define INDEX2BUF(i)	((char*) (FDBUFTABLE + (i)*FDBUFMAX))
 
 
 // --------------------------------------------------------------
@@ -32,6 +41,18 @@ fd2data(struct Fd *fd)
 	return INDEX2DATA(fd2num(fd));
 }
 
+char*
+fd2buf(struct Fd *fd)
+{
+	return INDEX2BUF(fd2num(fd));
+}
+
+static bool
+va_is_mapped(void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
 // Finds the smallest i from 0 to MAXFD-1 that doesn't have
 // its fd page mapped.
 // Sets *fd_store to the corresponding fd page virtual address.
@@ -102,7 +123,7 @@ fd_close(struct Fd *fd, bool must_exist)
 {
 	struct Fd *fd2;
 	struct Dev *dev;
-	int r;
+	int i, r;
 	if ((r = fd_lookup(fd2num(fd), &fd2)) < 0
 	    || fd != fd2)
 		return (must_exist ? r : 0);
@@ -115,6 +136,9 @@ fd_close(struct Fd *fd, bool must_exist)
 	// Make sure fd is unmapped.  Might be a no-op if
 	// (*dev->dev_close)(fd) already unmapped it.
 	(void) sys_page_unmap(0, fd);
+	for (i = 0; i < FDBUFMAX; i += PGSIZE)
+		if (va_is_mapped(fd2buf(fd) + i))
+			(void) sys_page_unmap(0, fd2buf(fd) + i);
 	return r;
 }
 
@@ -129,6 +153,7 @@ static struct Dev *devtab[] =
 	&devsock,
 	&devpipe,
 	&devcons,
+	&devepoll,
 	0
 };
 
@@ -174,7 +199,7 @@ close_all(void)
 int
 dup(int oldfdnum, int newfdnum)
 {
-	int r;
+	int i, r;
 	char *ova, *nva;
 	pte_t pte;
 	struct Fd *oldfd, *newfd;
@@ -190,6 +215,11 @@ dup(int oldfdnum, int newfdnum)
 	if ((uvpd[PDX(ova)] & PTE_P) && (uvpt[PGNUM(ova)] & PTE_P))
 		if ((r = sys_page_map(0, ova, 0, nva, uvpt[PGNUM(ova)] & PTE_SYSCALL)) < 0)
 			goto err;
+	for (i = 0; i < FDBUFMAX; i += PGSIZE)
+		if (va_is_mapped(fd2buf(oldfd) + i)
+		    && (r = sys_page_map(0, fd2buf(oldfd) + i, 0, fd2buf(newfd) + i,
+					 uvpt[PGNUM(fd2buf(oldfd) + i)] & PTE_SYSCALL)) < 0)
+			goto err;
 	if ((r = sys_page_map(0, oldfd, 0, newfd, uvpt[PGNUM(oldfd)] & PTE_SYSCALL)) < 0)
 		goto err;
 
@@ -198,6 +228,8 @@ dup(int oldfdnum, int newfdnum)
 err:
 	sys_page_unmap(0, newfd);
 	sys_page_unmap(0, nva);
+	for (i = 0; i < FDBUFMAX; i += PGSIZE)
+		sys_page_unmap(0, fd2buf(newfd) + i);
 	return r;
 }
 
@@ -261,9 +293,13 @@ int
 seek(int fdnum, off_t offset)
 {
 	int r;
+	struct Dev *dev;
 	struct Fd *fd;
 
-	if ((r = fd_lookup(fdnum, &fd)) < 0)
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+	    || (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if (dev->dev_seek && (r = (*dev->dev_seek)(fd, offset)) < 0)
 		return r;
 	fd->fd_offset = offset;
 	return 0;
@@ -319,3 +355,395 @@ stat(const char *path, struct Stat *stat)
 	return r;
 }
 
+
+
+// --------------------------------------------------------------
+// Readiness: poll and epoll
+// --------------------------------------------------------------
+
+// An epoll instance, kept in the heap of the environment that made it.
+// Descriptors whose device reports changes (see dev_watch) are looked
+// at again only when their key is reported; the others are polled on
+// every wait.  Both kinds go on ep_ready when they may be ready, and
+// stay there while they are, so that epoll_wait costs time in
+// proportion to what is ready and what changed rather than to the
+// size of the set.
+struct Epoll {
+	struct Epoll *ep_next;		// in 'epolls'
+	struct {
+		bool member;		// fd is in the set
+		bool ready;		// fd is on ep_ready
+		uint32_t events;
+		uint32_t data;
+		int16_t key;		// key its device reports it by, or -1
+		int16_t next;		// next fd with the same key, or -1
+	} ep_items[MAXFD];
+	int16_t ep_bykey[DEV_MAXKEYS];	// first fd with each key, or -1
+	uint32_t ep_changed[DEV_MAXKEYS / 32];
+	// The device the keyed descriptors belong to
+	struct Dev *ep_dev;
+	int16_t ep_ready[MAXFD];
+	int ep_nready;
+	int16_t ep_polled[MAXFD];
+	int ep_npolled;
+};
+
+static int devepoll_close(struct Fd *fd);
+static int devepoll_poll(struct Fd *fd);
+
+struct Dev devepoll =
+{
+	.dev_id =	'e',
+	.dev_name =	"epoll",
+	.dev_close =	devepoll_close,
+	.dev_poll =	devepoll_poll,
+};
+
+// This environment's epoll instances.  Each sees every key reported.
+static struct Epoll *epolls;
+
+// The readiness of 'fd', less what its open mode rules out
+static int
+fd_ready(struct Fd *fd, struct Dev *dev)
+{
+	int r = dev->dev_poll ? (*dev->dev_poll)(fd) : POLLIN | POLLOUT;
+
+	if ((fd->fd_omode & O_ACCMODE) == O_WRONLY)
+		r &= ~POLLIN;
+	if ((fd->fd_omode & O_ACCMODE) == O_RDONLY)
+		r &= ~POLLOUT;
+	return r;
+}
+
+// Collect the keys reported since the last call, for every instance.
+static void
+fd_collect(void)
+{
+	uint32_t keys[DEV_MAXKEYS / 32];
+	struct Epoll *ep;
+	int i;
+
+	memset(keys, 0, sizeof(keys));
+	for (i = 0; devtab[i]; i++)
+		if (devtab[i]->dev_changed)
+			(*devtab[i]->dev_changed)(keys);
+	for (ep = epolls; ep; ep = ep->ep_next)
+		for (i = 0; i < DEV_MAXKEYS / 32; i++)
+			ep->ep_changed[i] |= keys[i];
+}
+
+// Wait for something to change.  Only a device that reports changes
+// can wake us, and only without a timeout; otherwise we poll.
+static void
+fd_wait(struct Dev *dev, int timeout)
+{
+	if (dev && timeout < 0)
+		(*dev->dev_block)();
+	else
+		sys_yield();
+}
+
+// Has a timeout of 'timeout' milliseconds from 'start' passed?
+static bool
+fd_timedout(int timeout, unsigned start)
+{
+	return timeout == 0
+		|| (timeout > 0 && sys_time_msec() - start >= (unsigned) timeout);
+}
+
+// Wait until one of the 'nfds' descriptors in 'fds' is ready for what
+// its 'events' ask, for at most 'timeout' milliseconds (forever if
+// negative).  POLLERR and POLLHUP are always reported.
+// Returns the number of descriptors with nonzero 'revents', 0 if the
+// time ran out, or < 0 on error.
+int
+poll(struct pollfd *fds, int nfds, int timeout)
+{
+	unsigned start = sys_time_msec();
+	struct Dev *dev, *wdev;
+	struct Fd *fd;
+	bool polled;
+	int i, n;
+
+	while (1) {
+		fd_collect();
+		n = 0;
+		wdev = NULL;
+		polled = 0;
+		for (i = 0; i < nfds; i++) {
+			fds[i].revents = 0;
+			if (fds[i].fd < 0)
+				continue;
+			if (fd_lookup(fds[i].fd, &fd) < 0
+			    || dev_lookup(fd->fd_dev_id, &dev) < 0) {
+				fds[i].revents = POLLERR;
+				n++;
+				continue;
+			}
+			fds[i].revents = fd_ready(fd, dev)
+				& (fds[i].events | POLLERR | POLLHUP);
+			if (fds[i].revents)
+				n++;
+			else if (!dev->dev_watch || (wdev && wdev != dev)
+				 || (*dev->dev_watch)(fd) < 0)
+				polled = 1;
+			else
+				wdev = dev;
+		}
+		if (n || fd_timedout(timeout, start))
+			return n;
+		fd_wait(polled ? NULL : wdev, timeout);
+	}
+}
+
+static int
+epoll_lookup(int epfd, struct Epoll **ep_store)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(epfd, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devepoll.dev_id)
+		return -E_INVAL;
+	*ep_store = fd->fd_epoll.ep;
+	return 0;
+}
+
+// Put 'fdnum' on the ready list, to be looked at by the next wait.
+static void
+epoll_mark(struct Epoll *ep, int fdnum)
+{
+	if (ep->ep_items[fdnum].ready)
+		return;
+	ep->ep_items[fdnum].ready = 1;
+	ep->ep_ready[ep->ep_nready++] = fdnum;
+}
+
+// The events of interest that hold for 'fdnum', or 0 if none do or
+// it has left the set.
+static uint32_t
+epoll_check(struct Epoll *ep, int fdnum)
+{
+	struct Fd *fd;
+	struct Dev *dev;
+
+	if (!ep->ep_items[fdnum].member || fd_lookup(fdnum, &fd) < 0
+	    || dev_lookup(fd->fd_dev_id, &dev) < 0)
+		return 0;
+	return fd_ready(fd, dev)
+		& (ep->ep_items[fdnum].events | POLLERR | POLLHUP);
+}
+
+// Mark the descriptors that may have become ready since the last wait.
+static void
+epoll_scan(struct Epoll *ep)
+{
+	uint32_t bits;
+	int i, b, fdnum;
+
+	for (i = 0; i < DEV_MAXKEYS / 32; i++) {
+		if (!(bits = ep->ep_changed[i]))
+			continue;
+		ep->ep_changed[i] = 0;
+		for (b = 0; b < 32; b++)
+			if (bits & (1 << b))
+				for (fdnum = ep->ep_bykey[i * 32 + b]; fdnum >= 0;
+				     fdnum = ep->ep_items[fdnum].next)
+					epoll_mark(ep, fdnum);
+	}
+	for (i = 0; i < ep->ep_npolled; i++)
+		epoll_mark(ep, ep->ep_polled[i]);
+}
+
+static void
+epoll_reverse(int16_t *a, int n)
+{
+	int16_t t;
+	int i;
+
+	for (i = 0; i < n / 2; i++) {
+		t = a[i];
+		a[i] = a[n - 1 - i];
+		a[n - 1 - i] = t;
+	}
+}
+
+// Move the first 'k' entries of the ready list to its end.
+static void
+epoll_rotate(struct Epoll *ep, int k)
+{
+	epoll_reverse(ep->ep_ready, k);
+	epoll_reverse(ep->ep_ready + k, ep->ep_nready - k);
+	epoll_reverse(ep->ep_ready, ep->ep_nready);
+}
+
+// Make a new, empty epoll instance.  It belongs to this environment:
+// a child made by fork should make its own.
+// Returns its file descriptor, or < 0 on error.
+int
+epoll_create(void)
+{
+	struct Epoll *ep;
+	struct Fd *fd;
+	int i, r;
+
+	if ((r = fd_alloc(&fd)) < 0)
+		return r;
+	if (!(ep = malloc(sizeof(*ep))))
+		return -E_NO_MEM;
+	memset(ep, 0, sizeof(*ep));
+	for (i = 0; i < DEV_MAXKEYS; i++)
+		ep->ep_bykey[i] = -1;
+	// Not PTE_SHARE: the instance is in our heap, which spawn does
+	// not pass on
+	if ((r = sys_page_alloc(0, fd, PTE_P|PTE_W|PTE_U)) < 0) {
+		free(ep);
+		return r;
+	}
+	fd->fd_dev_id = devepoll.dev_id;
+	fd->fd_omode = O_RDONLY;
+	fd->fd_epoll.ep = ep;
+	ep->ep_next = epolls;
+	epolls = ep;
+	return fd2num(fd);
+}
+
+// Add descriptor 'fdnum' to epoll instance 'epfd', change what it is
+// watched for, or remove it, as 'op' says.  Remove descriptors before
+// closing them.
+// Returns 0 on success, < 0 on error.
+int
+epoll_ctl(int epfd, int op, int fdnum, struct epoll_event *event)
+{
+	struct Epoll *ep;
+	struct Fd *fd;
+	struct Dev *dev;
+	int16_t *p;
+	int key, r, i;
+
+	if ((r = epoll_lookup(epfd, &ep)) < 0)
+		return r;
+	if (fdnum < 0 || fdnum >= MAXFD)
+		return -E_INVAL;
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		if ((r = fd_lookup(fdnum, &fd)) < 0
+		    || (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+			return r;
+		if (dev == &devepoll)
+			return -E_INVAL;
+		if (ep->ep_items[fdnum].member)
+			return -E_FILE_EXISTS;
+		ep->ep_items[fdnum].member = 1;
+		ep->ep_items[fdnum].events = event->events;
+		ep->ep_items[fdnum].data = event->data;
+		ep->ep_items[fdnum].key = -1;
+		// Only one device can wake a wait, so descriptors of any
+		// other are polled
+		if (dev->dev_watch && (!ep->ep_dev || ep->ep_dev == dev)
+		    && (key = (*dev->dev_watch)(fd)) >= 0) {
+			ep->ep_dev = dev;
+			ep->ep_items[fdnum].key = key;
+			ep->ep_items[fdnum].next = ep->ep_bykey[key];
+			ep->ep_bykey[key] = fdnum;
+		} else
+			ep->ep_polled[ep->ep_npolled++] = fdnum;
+		epoll_mark(ep, fdnum);
+		return 0;
+
+	case EPOLL_CTL_MOD:
+		if (!ep->ep_items[fdnum].member)
+			return -E_NOT_FOUND;
+		ep->ep_items[fdnum].events = event->events;
+		ep->ep_items[fdnum].data = event->data;
+		epoll_mark(ep, fdnum);
+		return 0;
+
+	case EPOLL_CTL_DEL:
+		if (!ep->ep_items[fdnum].member)
+			return -E_NOT_FOUND;
+		ep->ep_items[fdnum].member = 0;
+		if ((key = ep->ep_items[fdnum].key) >= 0) {
+			for (p = &ep->ep_bykey[key]; *p != fdnum;
+			     p = &ep->ep_items[*p].next)
+				;
+			*p = ep->ep_items[fdnum].next;
+		} else {
+			for (i = 0; ep->ep_polled[i] != fdnum; i++)
+				;
+			ep->ep_polled[i] = ep->ep_polled[--ep->ep_npolled];
+		}
+		// The wait drops it from the ready list
+		return 0;
+
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Wait until descriptors in epoll instance 'epfd' are ready for what
+// they are watched for, for at most 'timeout' milliseconds (forever if
+// negative), and describe up to 'maxevents' of them in 'events'.
+// Readiness is level-triggered: a descriptor is reported by every
+// wait for as long as it stays ready.
+// Returns the number of events, 0 if the time ran out, or < 0 on error.
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	unsigned start = sys_time_msec();
+	struct Epoll *ep;
+	uint32_t ev;
+	int i, n, r, fdnum;
+
+	if ((r = epoll_lookup(epfd, &ep)) < 0)
+		return r;
+	if (maxevents <= 0)
+		return -E_INVAL;
+
+	while (1) {
+		fd_collect();
+		epoll_scan(ep);
+		n = 0;
+		for (i = 0; i < ep->ep_nready && n < maxevents; ) {
+			fdnum = ep->ep_ready[i];
+			if (!(ev = epoll_check(ep, fdnum))) {
+				ep->ep_items[fdnum].ready = 0;
+				ep->ep_ready[i] = ep->ep_ready[--ep->ep_nready];
+				continue;
+			}
+			events[n].events = ev;
+			events[n].data = ep->ep_items[fdnum].data;
+			n++;
+			i++;
+		}
+		// Those not reported go first next time
+		if (i < ep->ep_nready)
+			epoll_rotate(ep, i);
+		if (n || fd_timedout(timeout, start))
+			return n;
+		fd_wait(ep->ep_npolled ? NULL : ep->ep_dev, timeout);
+	}
+}
+
+static int
+devepoll_close(struct Fd *fd)
+{
+	struct Epoll **pp;
+
+	if (pageref(fd) > 1)
+		return 0;
+	for (pp = &epolls; *pp != fd->fd_epoll.ep; pp = &(*pp)->ep_next)
+		;
+	*pp = fd->fd_epoll.ep->ep_next;
+	free(fd->fd_epoll.ep);
+	return 0;
+}
+
+// An epoll instance cannot itself be waited for
+static int
+devepoll_poll(struct Fd *fd)
+{
+	return POLLERR;
+}
@@ -6,6 +6,30 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Virtual address at which vectored requests assemble their pages:
+// the request page followed by up to FSVEC_MAXPAGES data pages.
+#define FSVECVA		0xCFF00000
+
+// Send an inter-environment request made of the 'nsend' pages starting
+// at 'srcva', mapped with permission 'perm', to the file server, and
+// wait for a reply of up to *nrecv pages at 'dstva'.  Sets *nrecv to
+// the number of reply pages received.  Returns result from the file
+// server.
+static int
+fsipc_pages(unsigned type, void *srcva, size_t nsend, int perm,
+	    void *dstva, size_t *nrecv)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)srcva);
+
+	ipc_send_pages(fsenv, type, srcva, nsend, perm);
+	return ipc_recv_pages(NULL, dstva, nrecv, NULL);
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,24 +39,38 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
+	size_t npages = 1;
 
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
-	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+	return fsipc_pages(type, &fsipcbuf, 1, PTE_P | PTE_W | PTE_U,
+			   dstva, &npages);
+}
+
+static void
+unmap_pages(void *va, size_t npages)
+{
+	size_t i;
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, va + i * PGSIZE);
 }
 
 static int devfile_flush(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
+static ssize_t devfile_read_map(struct Fd *fd, void *buf, size_t n);
+static ssize_t devfile_readv(struct Fd *fd, void *buf, size_t n);
+static ssize_t devfile_writev(struct Fd *fd, const void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
 static int devfile_trunc(struct Fd *fd, off_t newsize);
+static int devfile_seek(struct Fd *fd, off_t offset);
+static int devfile_poll(struct Fd *fd);
+static ssize_t devfile_read_direct(struct Fd *fd, void *buf, size_t n);
+static ssize_t devfile_read_buffered(struct Fd *fd, void *buf, size_t n);
+static ssize_t devfile_write_direct(struct Fd *fd, const void *buf, size_t n);
+static ssize_t devfile_write_buffered(struct Fd *fd, const void *buf, size_t n);
+static int devfile_flushbuf(struct Fd *fd);
 
 struct Dev devfile =
 {
@@ -42,7 +80,9 @@ struct Dev devfile =
 	.dev_close =	devfile_flush,
 	.dev_stat =	devfile_stat,
 	.dev_write =	devfile_write,
-	.dev_trunc =	devfile_trunc
+	.dev_trunc =	devfile_trunc,
+	.dev_seek =	devfile_seek,
+	.dev_poll =	devfile_poll
 };
 
 // Open a file (or directory).
@@ -99,6 +139,10 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
+	int r;
+
+	if ((r = devfile_flushbuf(fd)) < 0)
+		return r;
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
 	return fsipc(FSREQ_FLUSH, NULL);
 }
@@ -110,6 +154,16 @@ devfile_flush(struct Fd *fd)
 // 	< 0 on error.
 static ssize_t
 devfile_read(struct Fd *fd, void *buf, size_t n)
+{
+	if (fd->fd_file.buf_size)
+		return devfile_read_buffered(fd, buf, n);
+	return devfile_read_direct(fd, buf, n);
+}
+
+// Read at most 'n' bytes from 'fd' at the current position into 'buf',
+// bypassing any client-side buffer.
+static ssize_t
+devfile_read_direct(struct Fd *fd, void *buf, size_t n)
 {
 	// Make an FSREQ_READ request to the file system server after
 	// filling fsipcbuf.read with the request arguments.  The
@@ -117,6 +171,16 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	// Reads of more than a page go out as one vectored request.
+	if (n > PGSIZE)
+		return devfile_readv(fd, buf, n);
+
+	// Whole-page reads into a page-aligned buffer can have the file
+	// server map its block-cache page straight into the buffer.
+	if (n >= PGSIZE && PGOFF(buf) == 0 && PGOFF(fd->fd_offset) == 0
+	    && !(uvpt[PGNUM(buf)] & PTE_SHARE) && cow_enable() == 0)
+		return devfile_read_map(fd, buf, n);
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -127,6 +191,67 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	return r;
 }
 
+// Read the page at the current position of 'fd' into the page-aligned
+// buffer 'buf' without copying.  The server maps the page read-only and
+// copy-on-write at 'buf', replacing whatever was mapped there; if it
+// cannot share the page, the bytes come back in fsipcbuf as usual.
+//
+// Returns:
+// 	The number of bytes successfully read.
+// 	< 0 on error.
+static ssize_t
+devfile_read_map(struct Fd *fd, void *buf, size_t n)
+{
+	int r;
+
+	fsipcbuf.read.req_fileid = fd->fd_file.id;
+	fsipcbuf.read.req_n = n;
+	if ((r = fsipc(FSREQ_READ_MAP, buf)) < 0)
+		return r;
+	assert(r <= n);
+	assert(r <= PGSIZE);
+	if (!thisenv->env_ipc_perm)
+		memmove(buf, fsipcbuf.readRet.ret_buf, r);
+	return r;
+}
+
+// Read up to FSVEC_MAXPAGES pages' worth of bytes from 'fd' at the
+// current position with a single vectored request.  The server replies
+// with its block-cache pages; whole pages that line up with 'buf' are
+// mapped into it copy-on-write, and the rest is copied.
+//
+// Returns:
+// 	The number of bytes successfully read.
+// 	< 0 on error.
+static ssize_t
+devfile_readv(struct Fd *fd, void *buf, size_t n)
+{
+	size_t npages, pgoff, done, m;
+	bool map;
+	char *src;
+	int r;
+
+	fsipcbuf.vec.req_fileid = fd->fd_file.id;
+	fsipcbuf.vec.req_n = n;
+	npages = FSVEC_MAXPAGES;
+	if ((r = fsipc_pages(FSREQ_READV, &fsipcbuf, 1, PTE_P | PTE_W | PTE_U,
+			     (void*) FSVECVA, &npages)) < 0)
+		return r;
+	pgoff = fsipcbuf.vec.req_pgoff;
+	assert(r <= n);
+	assert(r == 0 || pgoff + r <= npages * PGSIZE);
+
+	map = (PGOFF(buf) == pgoff && cow_enable() == 0);
+	for (done = 0; done < r; done += m) {
+		src = (char*) FSVECVA + pgoff + done;
+		m = MIN(r - done, PGSIZE - PGOFF(src));
+		if (!map || m < PGSIZE || (uvpt[PGNUM(buf + done)] & PTE_SHARE)
+		    || sys_page_map(0, src, 0, buf + done, PTE_P | PTE_U | PTE_COW) < 0)
+			memmove(buf + done, src, m);
+	}
+	unmap_pages((void*) FSVECVA, npages);
+	return r;
+}
 
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
@@ -135,6 +260,16 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 //	 < 0 on error.
 static ssize_t
 devfile_write(struct Fd *fd, const void *buf, size_t n)
+{
+	if (fd->fd_file.buf_size)
+		return devfile_write_buffered(fd, buf, n);
+	return devfile_write_direct(fd, buf, n);
+}
+
+// Write 'n' bytes from 'buf' to 'fd' at the current seek position,
+// bypassing any client-side buffer.
+static ssize_t
+devfile_write_direct(struct Fd *fd, const void *buf, size_t n)
 {
 	// Make an FSREQ_WRITE request to the file system server.  Be
 	// careful: fsipcbuf.write.req_buf is only so large, but
@@ -146,6 +281,19 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
     int end = 0;
     int max_size = sizeof(fsipcbuf.write.req_buf);
 
+    // Writes of more than a request page's worth go out in vectored
+    // requests, which map buf's pages instead of copying them.
+    if (n > max_size)
+    {
+        while (next_byte < n)
+        {
+            if ((r = devfile_writev(fd, buf + next_byte, n - next_byte)) < 0)
+                return r;
+            next_byte += r;
+        }
+        return next_byte;
+    }
+
     fsipcbuf.write.req_fileid = fd->fd_file.id;
     while (n - next_byte >= max_size)
     {
@@ -166,11 +314,51 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
     return next_byte;
 }
 
+// Write up to FSVEC_MAXPAGES pages' worth of 'buf' to 'fd' at the
+// current seek position with a single vectored request.  The pages
+// holding 'buf' are mapped read-only after the request page, so the
+// bytes themselves are never copied on this side.
+//
+// Returns:
+//	 The number of bytes successfully written.
+//	 < 0 on error.
+static ssize_t
+devfile_writev(struct Fd *fd, const void *buf, size_t n)
+{
+	const void *start = ROUNDDOWN(buf, PGSIZE);
+	size_t pgoff = PGOFF(buf), npages, nrecv, i;
+	int r;
+
+	n = MIN(n, FSVEC_MAXPAGES * PGSIZE - pgoff);
+	npages = ROUNDUP(pgoff + n, PGSIZE) / PGSIZE;
+
+	fsipcbuf.vec.req_fileid = fd->fd_file.id;
+	fsipcbuf.vec.req_n = n;
+	fsipcbuf.vec.req_pgoff = pgoff;
+	if ((r = sys_page_map(0, &fsipcbuf, 0, (void*) FSVECVA, PTE_P | PTE_U)) < 0)
+		return r;
+	for (i = 0; i < npages; i++)
+		if ((r = sys_page_map(0, (void*) start + i * PGSIZE,
+				      0, (void*) FSVECVA + (i + 1) * PGSIZE,
+				      PTE_P | PTE_U)) < 0)
+			goto out;
+
+	nrecv = 0;
+	r = fsipc_pages(FSREQ_WRITEV, (void*) FSVECVA, 1 + npages, PTE_P | PTE_U,
+			NULL, &nrecv);
+out:
+	unmap_pages((void*) FSVECVA, 1 + npages);
+	return r;
+}
+
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
 	int r;
 
+	if ((r = devfile_flushbuf(fd)) < 0)
+		return r;
+
 	fsipcbuf.stat.req_fileid = fd->fd_file.id;
 	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
 		return r;
@@ -180,15 +368,189 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 	return 0;
 }
 
+// A file server request never waits for anything but the disk, so a
+// file is always ready.
+static int
+devfile_poll(struct Fd *fd)
+{
+	return POLLIN | POLLOUT;
+}
+
 // Truncate or extend an open file to 'size' bytes
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
+	int r;
+
+	if ((r = devfile_flushbuf(fd)) < 0)
+		return r;
+	fd->fd_file.buf_len = 0;
 	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
 	fsipcbuf.set_size.req_size = newsize;
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
+// Write-behind data must reach the server before the position moves.
+static int
+devfile_seek(struct Fd *fd, off_t offset)
+{
+	return devfile_flushbuf(fd);
+}
+
+// --------------------------------------------------------------
+// Client-side buffering
+// --------------------------------------------------------------
+
+// A file descriptor with a buffer (see setbuf) keeps up to buf_size
+// bytes of the file in pages at fd2buf(fd), holding either read-ahead
+// data or, if buf_dirty is set, written bytes that have not been sent
+// to the server yet.  The buffer pages are PTE_SHARE and the
+// bookkeeping lives in the Fd page, so environments that share the
+// descriptor across fork, spawn or dup share the buffer too, and
+// fd_offset remains the logical seek position for all of them.
+// Buffered data may be stale with respect to writes through other
+// descriptors to the same file, as with stdio.
+
+// Give file descriptor 'fdnum' a client-side buffer of 'size' bytes,
+// rounded up to whole pages and at most FDBUFMAX; a size of 0 removes
+// the buffer.  Only file server files can be buffered.  Call this
+// before the descriptor is shared with other environments, since they
+// would not have the buffer pages mapped.
+// Returns 0 on success, < 0 on error.
+int
+setbuf(int fdnum, size_t size)
+{
+	struct Fd *fd;
+	char *b;
+	size_t i;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if (size > FDBUFMAX)
+		return -E_INVAL;
+	if ((r = devfile_flushbuf(fd)) < 0)
+		return r;
+
+	size = ROUNDUP(size, PGSIZE);
+	b = fd2buf(fd);
+	for (i = 0; i < FDBUFMAX; i += PGSIZE) {
+		if (i >= size)
+			sys_page_unmap(0, b + i);
+		else if (i >= fd->fd_file.buf_size
+			 && (r = sys_page_alloc(0, b + i, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			return r;
+	}
+	fd->fd_file.buf_size = size;
+	fd->fd_file.buf_len = 0;
+	return 0;
+}
+
+// Send any write-behind data buffered on file descriptor 'fdnum' to the
+// file server.
+// Returns 0 on success, < 0 on error.
+int
+flush(int fdnum)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return 0;
+	return devfile_flushbuf(fd);
+}
+
+// Write out the buffer of 'fd' if it is dirty.  The bytes stay in the
+// buffer as read-ahead data.
+static int
+devfile_flushbuf(struct Fd *fd)
+{
+	struct FdFile *ff = &fd->fd_file;
+	off_t pos = fd->fd_offset;
+	int r;
+
+	if (!ff->buf_dirty)
+		return 0;
+	fd->fd_offset = ff->buf_off;
+	r = devfile_write_direct(fd, fd2buf(fd), ff->buf_len);
+	fd->fd_offset = pos;
+	if (r < 0)
+		return r;
+	ff->buf_dirty = 0;
+	return 0;
+}
+
+// Read from the buffer of 'fd', refilling it with one vectored read
+// at the current position when that position is not buffered.  Reads
+// at least as large as the buffer bypass it.
+static ssize_t
+devfile_read_buffered(struct Fd *fd, void *buf, size_t n)
+{
+	struct FdFile *ff = &fd->fd_file;
+	off_t pos = fd->fd_offset;
+	size_t m;
+	int r;
+
+	if ((r = devfile_flushbuf(fd)) < 0)
+		return r;
+	if (pos < ff->buf_off || pos >= ff->buf_off + ff->buf_len) {
+		if (n >= ff->buf_size)
+			return devfile_read_direct(fd, buf, n);
+		// The server advances fd_offset past what it returns
+		ff->buf_len = 0;
+		if ((r = devfile_readv(fd, fd2buf(fd), ff->buf_size)) <= 0)
+			return r;
+		ff->buf_off = pos;
+		ff->buf_len = r;
+	}
+
+	m = MIN(n, ff->buf_off + ff->buf_len - pos);
+	memmove(buf, fd2buf(fd) + (pos - ff->buf_off), m);
+	fd->fd_offset = pos + m;
+	return m;
+}
+
+// Append to the buffer of 'fd' if this write continues the buffered
+// dirty run and fits; otherwise write out the buffer and start a new
+// run.  Writes at least as large as the buffer bypass it.
+static ssize_t
+devfile_write_buffered(struct Fd *fd, const void *buf, size_t n)
+{
+	struct FdFile *ff = &fd->fd_file;
+	off_t pos = fd->fd_offset;
+	int r;
+
+	if (!ff->buf_dirty || pos != ff->buf_off + ff->buf_len
+	    || ff->buf_len + n > ff->buf_size) {
+		if ((r = devfile_flushbuf(fd)) < 0)
+			return r;
+		// Buffered read-ahead data is about to be out of date
+		ff->buf_len = 0;
+		if (n >= ff->buf_size)
+			return devfile_write_direct(fd, buf, n);
+		ff->buf_off = pos;
+	}
+
+	memmove(fd2buf(fd) + ff->buf_len, buf, n);
+	ff->buf_len += n;
+	ff->buf_dirty = 1;
+	fd->fd_offset = pos + n;
+	return n;
+}
+
+// Delete a file
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
 
 // Synchronize disk with buffer cache
 int
@@ -200,3 +562,30 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Ask the file server to write back and forget its cached blocks, so
+// that subsequent reads go to the disk.  Useful for benchmarks.
+int
+dropcache(void)
+{
+	return fsipc(FSREQ_DROP_CACHE, NULL);
+}
+
+// Fetch the file server's block cache statistics into *st.
+int
+fsstats(struct Fsstats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet;
+	return 0;
+}
+
+// Ask the file server to check the file system for inconsistencies,
+// which it describes on the console.  Returns the number found.
+int
+fscheck(void)
+{
+	return fsipc(FSREQ_CHECK, NULL);
+}
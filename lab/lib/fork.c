@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -168,6 +164,23 @@ fork(void)
     return envid;
 }
 
+// Make sure writes to copy-on-write pages are handled in this
+// environment, installing the fork page fault handler if there is no
+// handler yet.  Pages shared copy-on-write by someone other than fork
+// (such as the file server) need this before they can be mapped.
+//
+// Returns 0 on success, -E_NOT_SUPP if the environment has a page fault
+// handler of its own that may not know about PTE_COW.
+int
+cow_enable(void)
+{
+	extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+	if (_pgfault_handler == 0)
+		set_pgfault_handler(pgfault);
+	return _pgfault_handler == pgfault ? 0 : -E_NOT_SUPP;
+}
+
 // Challenge!
 int
 sfork(void)
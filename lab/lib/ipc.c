@@ -64,6 +64,47 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
     }
 }
 
+// Like ipc_send, but send the 'npages' consecutive pages starting at
+// 'pg'.  The receiver maps as many of them as it asked for.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, size_t npages, int perm)
+{
+	int r;
+
+	if (!pg)
+		pg = (void*)UTOP;
+	while ((r = sys_ipc_try_send_pages(to_env, val, pg, npages, perm)) == -E_IPC_NOT_RECV)
+		sys_yield();
+	if (r < 0)
+		panic("ipc_send_pages: %e", r);
+}
+
+// Like ipc_recv, but be willing to receive up to *npages pages, mapped
+// consecutively starting at 'pg'.  On return *npages holds the number
+// of pages actually received.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages, int *perm_store)
+{
+	int r;
+
+	if (!pg)
+		pg = (void*)UTOP;
+	if ((r = sys_ipc_recv_pages(pg, *npages)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		*npages = 0;
+		return r;
+	}
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	*npages = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
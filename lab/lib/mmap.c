@@ -29,6 +29,17 @@ mmap(envid_t child, uintptr_t va, size_t memsz,
 				return r;
 			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
 				return r;
+			// readn may have mapped a read-only page shared
+			// with the file server; writable segments need a
+			// private copy.
+			if ((perm & PTE_W) && !(uvpt[PGNUM(UTEMP)] & PTE_W)) {
+				if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+					return r;
+				memmove(PFTEMP, UTEMP, PGSIZE);
+				if ((r = sys_page_map(0, PFTEMP, 0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+					return r;
+				sys_page_unmap(0, PFTEMP);
+			}
 			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
 				panic("spawn: sys_page_map data: %e", r);
 			sys_page_unmap(0, UTEMP);
@@ -8,6 +8,15 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
+envid_t
+nsipc_env(void)
+{
+	static envid_t nsenv;
+	if (nsenv == 0)
+		nsenv = ipc_find_env(ENV_TYPE_NS);
+	return nsenv;
+}
+
 // Send an IP request to the network server, and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
@@ -16,16 +25,12 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 nsipc(unsigned type)
 {
-	static envid_t nsenv;
-	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
-
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	ipc_send(nsipc_env(), type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
 	return ipc_recv(NULL, NULL, NULL);
 }
 
@@ -121,3 +126,13 @@ nsipc_socket(int domain, int type, int protocol)
 	nsipcbuf.socket.req_protocol = protocol;
 	return nsipc(NSREQ_SOCKET);
 }
+
+// Ask the network server to keep the readiness of socket 's' up to
+// date in 'ev', a page of our own (see struct Nsevents).
+int
+nsipc_watch(int s, struct Nsevents *ev)
+{
+	ev->ne_watch = s;
+	ipc_send(nsipc_env(), NSREQ_WATCH, ev, PTE_P|PTE_W|PTE_U);
+	return ipc_recv(NULL, NULL, NULL);
+}
@@ -0,0 +1,94 @@
+// Packet rings shared between the network server and its input and
+// output environments (see struct jif_ring in inc/ns.h).
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// Keep the compiler from moving memory accesses across this point.
+// The processor keeps stores in order, and loads in order, by itself.
+#define barrier()	asm volatile("" : : : "memory")
+
+// Map fresh pages for ring 'r', shared with the environments we fork
+// from now on.  Returns 0 on success, < 0 on error.
+int
+jif_ring_alloc(struct jif_ring *r)
+{
+	int i, ret;
+
+	for (i = 0; i < JIF_RING_PAGES; i++)
+		if ((ret = sys_page_alloc(0, (char*) r + i * PGSIZE,
+					  PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			return ret;
+	return 0;
+}
+
+// The slot for packet number 'i' of 'r'.
+struct jif_pkt *
+jif_ring_slot(struct jif_ring *r, uint32_t i)
+{
+	return (struct jif_pkt*) ((char*) r + (1 + i % JIF_RING_SLOTS) * PGSIZE);
+}
+
+// The number of packets waiting in 'r' for the consumer.
+uint32_t
+jif_ring_count(struct jif_ring *r)
+{
+	uint32_t n = r->jr_head - r->jr_tail;
+
+	barrier();
+	return n;
+}
+
+// The number of slots the producer may fill, from slot jr_head on.
+uint32_t
+jif_ring_space(struct jif_ring *r)
+{
+	uint32_t n = JIF_RING_SLOTS - (r->jr_head - r->jr_tail);
+
+	barrier();
+	return n;
+}
+
+// Hand the 'n' slots filled from jr_head on to the consumer, and if it
+// is idle, wake it by sending it 'req' with no page.
+void
+jif_ring_produce(struct jif_ring *r, uint32_t n, envid_t consumer, uint32_t req)
+{
+	barrier();
+	r->jr_head += n;
+	// Only a locked instruction keeps the load of jr_idle from
+	// passing the store to jr_head, which jif_ring_idle relies on,
+	// so even a check whether jr_idle is set must use one
+	if (xchg(&r->jr_idle, 0)) {
+		r->jr_doorbells++;
+		ipc_send(consumer, req, 0, 0);
+	}
+}
+
+// Give the 'n' slots emptied from jr_tail on back to the producer.
+void
+jif_ring_consume(struct jif_ring *r, uint32_t n)
+{
+	barrier();
+	r->jr_tail += n;
+}
+
+// Called by the consumer before it blocks in ipc_recv, so that the
+// producer's next jif_ring_produce sends it a doorbell.  Returns 1 if
+// it may block, or 0 if 'r' has packets after all; then the consumer
+// calls jif_ring_busy and takes them instead.
+bool
+jif_ring_idle(struct jif_ring *r)
+{
+	xchg(&r->jr_idle, 1);
+	return jif_ring_count(r) == 0;
+}
+
+// Called by the consumer once it is running again, so that producers
+// do not send doorbells it does not need.  It may still get one sent
+// before this.
+void
+jif_ring_busy(struct jif_ring *r)
+{
+	r->jr_idle = 0;
+}
@@ -1,10 +1,15 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 #include <lwip/sockets.h>
 
 static ssize_t devsock_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devsock_write(struct Fd *fd, const void *buf, size_t n);
 static int devsock_close(struct Fd *fd);
 static int devsock_stat(struct Fd *fd, struct Stat *stat);
+static int devsock_poll(struct Fd *fd);
+static int devsock_watch(struct Fd *fd);
+static void devsock_changed(uint32_t *keys);
+static void devsock_block(void);
 
 struct Dev devsock =
 {
@@ -14,8 +19,24 @@ struct Dev devsock =
 	.dev_write =	devsock_write,
 	.dev_close =	devsock_close,
 	.dev_stat =	devsock_stat,
+	.dev_poll =	devsock_poll,
+	.dev_watch =	devsock_watch,
+	.dev_changed =	devsock_changed,
+	.dev_block =	devsock_block,
 };
 
+// Where the network server tells us about our sockets (see struct
+// Nsevents): above the file descriptor areas, where fork and spawn
+// share the page instead of copying it
+#define NSEVVA		0xDF000000
+
+static struct Nsevents *const nsev = (struct Nsevents*) NSEVVA;
+// The environment the page at NSEVVA belongs to.  A child of fork or
+// spawn sees its parent's there, and needs one of its own.
+static envid_t nsev_env;
+// Sockets the network server reports on to us
+static uint32_t nsev_watched[NSEV_MAXSOCKS / 32];
+
 static int
 fd2sockid(int fd)
 {
@@ -79,9 +100,13 @@ shutdown(int s, int how)
 static int
 devsock_close(struct Fd *fd)
 {
-	if (pageref(fd) == 1)
+	int s = fd->fd_sock.sockid;
+
+	if (pageref(fd) == 1) {
+		// The server forgets the watch when the socket goes
+		nsev_watched[s / 32] &= ~(1 << (s % 32));
 		return nsipc_close(fd->fd_sock.sockid);
-	else
+	} else
 		return 0;
 }
 
@@ -130,3 +155,75 @@ socket(int domain, int type, int protocol)
 		return r;
 	return alloc_sockfd(r);
 }
+
+// Start the network server reporting on the socket behind 'fd', if it
+// is not already.  Returns the socket's key (see dev_watch), or < 0 on
+// error.
+static int
+devsock_watch(struct Fd *fd)
+{
+	int s = fd->fd_sock.sockid, r;
+
+	static_assert(NSEV_MAXSOCKS <= DEV_MAXKEYS);
+	static_assert(sizeof(struct Nsevents) <= PGSIZE);
+	if (nsev_env != thisenv->env_id) {
+		if ((r = sys_page_alloc(0, nsev, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			return r;
+		memset(nsev_watched, 0, sizeof(nsev_watched));
+		nsev_env = thisenv->env_id;
+	}
+	if (!(nsev_watched[s / 32] & (1 << (s % 32)))) {
+		if ((r = nsipc_watch(s, nsev)) < 0)
+			return r;
+		nsev_watched[s / 32] |= 1 << (s % 32);
+	}
+	return s;
+}
+
+static int
+devsock_poll(struct Fd *fd)
+{
+	int s;
+
+	if ((s = devsock_watch(fd)) < 0)
+		return POLLERR;
+	return nsev->ne_state[s];
+}
+
+static void
+devsock_changed(uint32_t *keys)
+{
+	int i;
+
+	if (nsev_env != thisenv->env_id)
+		return;
+	for (i = 0; i < NSEV_MAXSOCKS / 32; i++)
+		if (nsev->ne_changed[i])
+			keys[i] |= xchg(&nsev->ne_changed[i], 0);
+}
+
+// Wait for the network server to report a change.
+static void
+devsock_block(void)
+{
+	envid_t from;
+	int i;
+
+	if (nsev_env != thisenv->env_id) {
+		sys_yield();
+		return;
+	}
+	xchg(&nsev->ne_waiting, 1);
+	for (i = 0; i < NSEV_MAXSOCKS / 32; i++)
+		if (nsev->ne_changed[i]) {
+			if (xchg(&nsev->ne_waiting, 0))
+				return;
+			// Too late: the doorbell is on its way
+			break;
+		}
+	do {
+		if (ipc_recv(&from, NULL, NULL) != NSREQ_WAKE)
+			cprintf("devsock_block: unexpected message from %08x\n",
+				from);
+	} while (from != nsipc_env());
+}
@@ -117,6 +117,60 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva, size_t npages, int perm)
+{
+	return syscall(SYS_ipc_try_send_pages, 0, envid, value, (uint32_t) srcva, npages, perm);
+}
+
+int
+sys_ipc_recv_pages(void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recv_pages, 1, (uint32_t) dstva, npages, 0, 0, 0);
+}
+
+int
+sys_ipc_recv_arm(void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recv_arm, 1, (uint32_t) dstva, npages, 0, 0, 0);
+}
+
+int
+sys_ipc_recv_wait(void)
+{
+	return syscall(SYS_ipc_recv_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_irq_register(int irq)
+{
+	return syscall(SYS_irq_register, 1, irq, 0, 0, 0, 0);
+}
+
+int
+sys_irq_ack(int irq)
+{
+	return syscall(SYS_irq_ack, 1, irq, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(void)
+{
+	return syscall(SYS_irq_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_paddr(void *va)
+{
+	return syscall(SYS_page_paddr, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_ide_dma_base(void)
+{
+	return syscall(SYS_ide_dma_base, 0, 0, 0, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
@@ -135,6 +189,42 @@ sys_packet_recv(void *packet, uint16_t *buf_len)
     return syscall(SYS_packet_recv, 0, (uint32_t)packet, (uint32_t)buf_len, 0, 0, 0);
 }
 
+int
+sys_packet_send_pages(const void *pkts, int n)
+{
+    return syscall(SYS_packet_send_pages, 0, (uint32_t)pkts, n, 0, 0, 0);
+}
+
+int
+sys_packet_send_frags(const struct PacketFrag *frags, int nfrags, uint32_t *ndone)
+{
+    return syscall(SYS_packet_send_frags, 0, (uint32_t)frags, nfrags, (uint32_t)ndone, 0, 0);
+}
+
+int
+sys_packet_recv_pages(envid_t peer, void *va, int n)
+{
+    return syscall(SYS_packet_recv_pages, 0, peer, (uint32_t)va, n, 0, 0);
+}
+
+int
+sys_packet_send_wait(void)
+{
+    return syscall(SYS_packet_send_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_packet_stats(struct PacketStats *st)
+{
+    return syscall(SYS_packet_stats, 0, (uint32_t)st, 0, 0, 0, 0);
+}
+
+int
+sys_packet_recv_wait(void)
+{
+    return syscall(SYS_packet_recv_wait, 0, 0, 0, 0, 0, 0);
+}
+
 void
 sys_get_mac_addr(void *addr_buf, int raw)
 {
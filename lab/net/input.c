@@ -3,6 +3,10 @@
 
 extern union Nsipc nsipcbuf;
 
+// Pass the packets the card receives on to the network server, through
+// the ring INPUT_RING.  The driver maps the pages it received them into
+// straight into the ring's free slots, in the network server as well as
+// here, so nothing is copied.
 void
 input(envid_t ns_envid)
 {
@@ -15,23 +19,38 @@ input(envid_t ns_envid)
 	// reading from it for a while, so don't immediately receive
 	// another packet in to the same physical page.
 
-    int value;
-    
+    struct jif_ring *ring = INPUT_RING;
+    int value, n;
+
     while(1)
     {
-        //nsipcbuf.pkt.jp_len = 0;
-        if ((value = sys_page_alloc(0, (void *)&nsipcbuf, PTE_P|PTE_U|PTE_W)) < 0)
+        // While the ring is full, the network server has work enough
+        while ((n = jif_ring_space(ring)) == 0)
+            sys_yield();
+        // The free slots from jr_head on, up to the end of the ring
+        n = MIN(n, JIF_RING_SLOTS - ring->jr_head % JIF_RING_SLOTS);
+        // Take all the packets that are waiting, up to a batch, into
+        // those slots, in place of the pages the network server has
+        // finished with, and hand them to it, waking it if it is idle
+        if ((value = sys_packet_recv_pages(ns_envid, jif_ring_slot(ring, ring->jr_head),
+                                           MIN(n, PACKET_MAXBATCH))) > 0)
         {
-            panic("input: can't page alloc with error %e", value);
+            jif_ring_produce(ring, value, ns_envid, NSREQ_INPUT);
         }
-        if ((value = sys_packet_recv((void *)nsipcbuf.pkt.jp_data, (uint16_t *)(&(nsipcbuf.pkt.jp_len)))) == 0)
+        else if (value == -1)
         {
-            cprintf("received! sending to network server packet %s\n\n", nsipcbuf.pkt.jp_data); 
-            ipc_send(ns_envid, NSREQ_INPUT, (void *)&nsipcbuf, PTE_P|PTE_U|PTE_W);
+            // The ring is empty, or this turn's budget is used up:
+            // sleep until the card interrupts with new packets, or let
+            // the network server catch up before polling on
+            sys_packet_recv_wait();
         }
-        else
+        else if (value == -E_NO_MEM)
         {
             sys_yield();
         }
+        else
+        {
+            panic("input: packet_recv_pages failed with error %e", value);
+        }
     }
 }
@@ -117,6 +117,9 @@ static struct lwip_socket sockets[NUM_SOCKETS];
 /** The global list of tasks waiting for select */
 static struct lwip_select_cb *select_cb_list;
 
+/** JOS: called with each socket whose events may have changed */
+void (*lwip_socket_event_hook)(int s);
+
 /** Semaphore protecting the sockets array */
 static sys_sem_t socksem;
 /** Semaphore protecting select_cb_list */
@@ -987,6 +990,27 @@ lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
   return nready;
 }
 
+/**
+ * JOS: report what select would find for socket s: whether a receive
+ * would return (data, the end of the connection or, on a listening
+ * socket, a connection to accept) without blocking, whether a send
+ * would find room, and whether the connection has failed.
+ *
+ * @return 0, or -1 if s is not a socket
+ */
+int
+lwip_socket_state(int s, int *readable, int *writable, int *failed)
+{
+  struct lwip_socket *sock = get_socket(s);
+
+  if (!sock)
+    return -1;
+  *readable = sock->lastdata != NULL || sock->rcvevent > 0;
+  *writable = sock->sendevent != 0;
+  *failed = ERR_IS_FATAL(sock->conn->err);
+  return 0;
+}
+
 /**
  * Callback registered in the netconn layer for each socket-netconn.
  * Processes recvevent (data available) and wakes up tasks waiting for select.
@@ -1049,6 +1073,9 @@ event_callback(struct netconn *conn, enum netconn_evt evt, u16_t len)
   }
   sys_sem_signal(selectsem);
 
+  if (lwip_socket_event_hook)
+    lwip_socket_event_hook(s);
+
   /* Now decide if anyone is waiting for this socket */
   /* NOTE: This code is written this way to protect the select link list
      but to avoid a deadlock situation by releasing socksem before
@@ -599,6 +599,13 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb)
   u16_t len;
   struct netif *netif;
 
+  /* The driver may still be sending this segment from where it is
+     (see jif.c), so it cannot be changed for a retransmission yet;
+     the retransmission timer will try again. */
+  if (seg->p->ref != 1) {
+    return;
+  }
+
   /** @bug Exclude retransmitted segments from this count. */
   snmp_inc_tcpoutsegs();
 
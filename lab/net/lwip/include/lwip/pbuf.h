@@ -60,6 +60,10 @@ typedef enum {
 
 /** indicates this packet's data should be immediately passed to the application */
 #define PBUF_FLAG_PUSH 0x01U
+/** indicates the network interface has verified this packet's IP header checksum */
+#define PBUF_FLAG_CSUM_IP_OK 0x02U
+/** indicates the network interface has verified this packet's TCP or UDP checksum */
+#define PBUF_FLAG_CSUM_L4_OK 0x04U
 
 struct pbuf {
   /** next pbuf in singly linked pbuf chain */
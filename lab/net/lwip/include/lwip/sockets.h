@@ -321,6 +321,8 @@ int lwip_write(int s, const void *dataptr, int size);
 int lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset,
                 struct timeval *timeout);
 int lwip_ioctl(int s, long cmd, void *argp);
+int lwip_socket_state(int s, int *readable, int *writable, int *failed);
+extern void (*lwip_socket_event_hook)(int s);
 
 #if LWIP_COMPAT_SOCKETS
 #define accept(a,b,c)         lwip_accept(a,b,c)
@@ -9,8 +9,11 @@
 
 #define debug 0
 
-#define NSEM		256
-#define NMBOX		128
+// A mailbox for each netconn and another for each listening one, and
+// a few for the tcpip thread.  Each mailbox takes two semaphores and
+// each netconn one more.
+#define NMBOX		(MEMP_NUM_NETCONN + MEMP_NUM_TCP_PCB_LISTEN + 16)
+#define NSEM		(2 * NMBOX + MEMP_NUM_NETCONN + 64)
 #define MBOXSLOTS	32
 
 struct sys_sem_entry {
@@ -40,17 +40,358 @@
 #include "lwip/mem.h"
 #include "lwip/pbuf.h"
 #include "lwip/sys.h"
+#include "lwip/ip.h"
+#include "lwip/tcp.h"
 #include <lwip/stats.h>
 
 #include <netif/etharp.h>
 
-#define PKTMAP		0x10000000
+// Most packets sent without copying that the card may still be reading
+#define TXPENDING	256
 
 struct jif {
     struct eth_addr *ethaddr;
     envid_t envid;
+    struct jif_ring *ring;
 };
 
+// Outgoing packets wait here until jif_flush hands each kind over with
+// one call: the pieces of packets to send where they are, and packets
+// copied into the output environment's ring.  A staged
+// packet is one pbuf, or several TCP segments for the card to cut up
+// again (see tx_join); tx_staged_eop marks the last pbuf of each.
+static struct PacketFrag tx_frags[PACKET_BATCH_MAXFRAGS];
+static struct pbuf *tx_staged[PACKET_MAXBATCH];
+static char tx_staged_eop[PACKET_MAXBATCH];
+static int tx_nfrags, tx_nstaged, tx_ncopied;
+
+// The last staged packet, while later TCP segments may join it
+static struct {
+    struct pbuf *p;	// its first segment, or NULL
+    struct tcp_hdr *tcp;	// the TCP header of p
+    int hlen;		// length of the headers of p
+    int first;		// its first piece in tx_frags
+    int mss;		// data in each of its segments but the last
+    int last;		// data in its last segment
+    int len;		// its length
+    u32_t nextseq;	// sequence number of the segment to follow it
+} tx_tso;
+
+// Pbufs sent without copying, oldest first.  Each holds a reference
+// to its pbuf, so that lwIP neither frees nor changes it, until the card
+// is done with it.  tx_pending_eop marks the last pbuf of each packet.
+static struct pbuf *tx_pending[TXPENDING];
+static char tx_pending_eop[TXPENDING];
+static uint32_t tx_nsent, tx_nfreed, tx_pktsfreed;
+
+/*
+ * Release the pbufs of the packets the card is done with: 'ndone' is the
+ * driver's count of them, as returned by sys_packet_send_frags.
+ */
+static void
+tx_complete(uint32_t ndone)
+{
+    uint32_t i;
+
+    while (tx_nfreed != tx_nsent && ((ndone - tx_pktsfreed) & 0x7fffffff) != 0) {
+	i = tx_nfreed++ % TXPENDING;
+	pbuf_free(tx_pending[i]);
+	if (tx_pending_eop[i])
+	    tx_pktsfreed++;
+    }
+}
+
+/*
+ * Set up the checksum fields of the Ethernet frame whose first n bytes
+ * are at 'frame' for the card to fill in: lwIP leaves them to it (see
+ * PACKET_CSUM_IP in inc/syscall.h).  With 'tso', the frame is a TCP
+ * segment for the card to cut up.  Returns the frame's offload flags.
+ */
+static int
+tx_csum(u8_t *frame, int n, int tso)
+{
+    struct ip_hdr *ip = (struct ip_hdr *)(frame + sizeof(struct eth_hdr));
+    u8_t *l4;
+    u32_t acc;
+    u16_t seed;
+    int off;
+
+    if (n < sizeof(struct eth_hdr) + IP_HLEN
+	|| ((struct eth_hdr *)frame)->type != htons(ETHTYPE_IP))
+	return 0;
+    IPH_CHKSUM_SET(ip, 0);
+    // The card cannot sum a datagram split over several packets
+    if (IPH_OFFSET(ip) & htons(IP_OFFMASK | IP_MF))
+	return PACKET_CSUM_IP;
+    if (IPH_PROTO(ip) == IP_PROTO_TCP)
+	off = 16;
+    else if (IPH_PROTO(ip) == IP_PROTO_UDP)
+	off = 6;
+    else
+	return PACKET_CSUM_IP;
+    l4 = (u8_t *)ip + IPH_HL(ip) * 4;
+    if (l4 + off + 2 > frame + n)
+	panic("jif: transport header not in the first pbuf");
+
+    // The sum of the pseudo-header, which the card adds to its own
+    acc = (ip->src.addr & 0xffff) + (ip->src.addr >> 16)
+	+ (ip->dest.addr & 0xffff) + (ip->dest.addr >> 16)
+	+ htons(IPH_PROTO(ip));
+    if (!tso)
+	acc += htons(ntohs(IPH_LEN(ip)) - IPH_HL(ip) * 4);
+    acc = (acc & 0xffff) + (acc >> 16);
+    seed = (acc & 0xffff) + (acc >> 16);
+    memcpy(l4 + off, &seed, sizeof(seed));
+    return PACKET_CSUM_IP | PACKET_CSUM_L4;
+}
+
+/*
+ * If p is a TCP segment carrying data and no flags but ACK and PSH,
+ * return its TCP header, and set *hlen to the length of its headers
+ * and *plen to that of its data.
+ */
+static struct tcp_hdr *
+tx_tcp(struct pbuf *p, int *hlen, int *plen)
+{
+    struct ip_hdr *ip = (struct ip_hdr *)((u8_t *)p->payload + sizeof(struct eth_hdr));
+    struct tcp_hdr *tcp;
+
+    if (p->len < sizeof(struct eth_hdr) + IP_HLEN + TCP_HLEN
+	|| ((struct eth_hdr *)p->payload)->type != htons(ETHTYPE_IP)
+	|| IPH_PROTO(ip) != IP_PROTO_TCP
+	|| (IPH_OFFSET(ip) & htons(IP_OFFMASK | IP_MF)))
+	return NULL;
+    tcp = (struct tcp_hdr *)((u8_t *)ip + IPH_HL(ip) * 4);
+    *hlen = sizeof(struct eth_hdr) + IPH_HL(ip) * 4 + TCPH_HDRLEN(tcp) * 4;
+    *plen = p->tot_len - *hlen;
+    if (*hlen > p->len || *plen <= 0
+	|| (TCPH_FLAGS(tcp) & ~(TCP_ACK | TCP_PSH)) != 0)
+	return NULL;
+    return tcp;
+}
+
+/*
+ * Hand the copied packets to the output environment, waking it if it
+ * is idle.
+ */
+static void
+tx_flush_copies(struct jif *jif)
+{
+    if (tx_ncopied == 0)
+	return;
+    jif_ring_produce(jif->ring, tx_ncopied, jif->envid, NSREQ_OUTPUT);
+    tx_ncopied = 0;
+}
+
+/*
+ * Copy the pbuf chain p into the next slot of the output ring.
+ */
+static void
+tx_copy(struct jif *jif, struct pbuf *p)
+{
+    // Wait for the output environment to make room
+    while (jif_ring_space(jif->ring) == tx_ncopied) {
+	tx_flush_copies(jif);
+	sys_yield();
+    }
+
+    struct jif_pkt *pkt = jif_ring_slot(jif->ring, jif->ring->jr_head + tx_ncopied);
+
+    char *txbuf = pkt->jp_data;
+    int txsize = 0;
+    struct pbuf *q;
+    for (q = p; q != NULL; q = q->next) {
+	/* Send the data from the pbuf to the interface, one pbuf at a
+	   time. The size of the data in each pbuf is kept in the ->len
+	   variable. */
+
+	if (txsize + q->len > 2000)
+	    panic("oversized packet, fragment %d txsize %d\n", q->len, txsize);
+	memcpy(&txbuf[txsize], q->payload, q->len);
+	txsize += q->len;
+    }
+
+    pkt->jp_len = txsize;
+    pkt->jp_flags = tx_csum((u8_t *)txbuf, txsize, 0);
+    tx_ncopied++;
+}
+
+/*
+ * Send the staged packets without copying them, in one call.  Packets
+ * that do not fit in the card's ring are copied instead.
+ */
+static void
+tx_flush_frags(struct jif *jif)
+{
+    uint32_t ndone;
+    int i, r, npkts;
+
+    if (tx_nstaged == 0 && tx_nfreed == tx_nsent)
+	return;
+    if ((r = sys_packet_send_frags(tx_frags, tx_nfrags, &ndone)) < 0)
+	panic("jif: sys_packet_send_frags: %e", r);
+    for (i = 0, npkts = 0; i < tx_nstaged; i++) {
+	if (npkts < r) {
+	    tx_pending_eop[tx_nsent % TXPENDING] = tx_staged_eop[i];
+	    tx_pending[tx_nsent++ % TXPENDING] = tx_staged[i];
+	} else {
+	    // Each segment of a joined packet is a packet of its own
+	    tx_copy(jif, tx_staged[i]);
+	    pbuf_free(tx_staged[i]);
+	}
+	npkts += tx_staged_eop[i];
+    }
+    tx_nstaged = tx_nfrags = 0;
+    tx_tso.p = NULL;
+    tx_complete(ndone);
+}
+
+/*
+ * Add the pieces of the pbuf chain p, from byte 'skip' on, to tx_frags
+ * from index n on, using no index beyond 'max'.  Returns the index
+ * after the last piece, or -1 if there are too many pieces.
+ */
+static int
+tx_pieces(struct pbuf *p, int skip, int n, int max)
+{
+    struct pbuf *q;
+    char *va;
+    int len, chunk;
+
+    for (q = p; q != NULL; q = q->next, skip = 0) {
+	if (skip >= q->len) {
+	    skip -= q->len;
+	    continue;
+	}
+	// The card needs a separate descriptor for each page
+	for (va = (char *)q->payload + skip, len = q->len - skip; len > 0;
+	     va += chunk, len -= chunk) {
+	    chunk = MIN(len, PGSIZE - PGOFF(va));
+	    if (n == max)
+		return -1;
+	    tx_frags[n].pf_va = va;
+	    tx_frags[n].pf_len = chunk;
+	    tx_frags[n].pf_flags = 0;
+	    tx_frags[n].pf_mss = 0;
+	    n++;
+	}
+    }
+    return n;
+}
+
+/*
+ * Add the data of TCP segment p to the last staged packet, if that is
+ * a segment of the same connection that p follows, so that the card
+ * cuts the packet into the same segments again (see PACKET_TSO).
+ * Returns 0 on success, < 0 if p must be staged on its own.
+ */
+static int
+tx_join(struct pbuf *p)
+{
+    struct ip_hdr *ip, *ip0;
+    struct tcp_hdr *tcp, *tcp0 = tx_tso.tcp;
+    int hlen, plen, n;
+
+    if (!tx_tso.p || tx_tso.last != tx_tso.mss
+	|| tx_nstaged == PACKET_MAXBATCH
+	|| tx_nsent - tx_nfreed + tx_nstaged >= TXPENDING
+	|| !(tcp = tx_tcp(p, &hlen, &plen)))
+	return -1;
+    ip = (struct ip_hdr *)((u8_t *)p->payload + sizeof(struct eth_hdr));
+    ip0 = (struct ip_hdr *)((u8_t *)tx_tso.p->payload + sizeof(struct eth_hdr));
+    if (hlen != tx_tso.hlen || plen > tx_tso.mss
+	|| tx_tso.len + plen > PACKET_TSO_MAXLEN
+	|| !ip_addr_cmp(&ip->src, &ip0->src)
+	|| !ip_addr_cmp(&ip->dest, &ip0->dest)
+	|| tcp->src != tcp0->src || tcp->dest != tcp0->dest
+	|| ntohl(tcp->seqno) != tx_tso.nextseq
+	|| tcp->ackno != tcp0->ackno || tcp->wnd != tcp0->wnd)
+	return -1;
+    n = tx_pieces(p, hlen, tx_nfrags,
+		  MIN(tx_tso.first + PACKET_MAXFRAGS, PACKET_BATCH_MAXFRAGS));
+    if (n < 0)
+	return -1;
+
+    if (!(tx_frags[tx_tso.first].pf_flags & PACKET_TSO)) {
+	tx_frags[tx_tso.first].pf_flags |= tx_csum(tx_tso.p->payload, tx_tso.p->len, 1) | PACKET_TSO;
+	tx_frags[tx_tso.first].pf_mss = tx_tso.mss;
+    }
+    // The card gives the last segment the flags of the first
+    if (TCPH_FLAGS(tcp) & TCP_PSH)
+	TCPH_SET_FLAG(tcp0, TCP_PSH);
+    tx_frags[tx_nfrags - 1].pf_flags &= ~PACKET_FRAG_EOP;
+    tx_frags[n - 1].pf_flags |= PACKET_FRAG_EOP;
+    tx_nfrags = n;
+    pbuf_ref(p);
+    tx_staged_eop[tx_nstaged - 1] = 0;
+    tx_staged_eop[tx_nstaged] = 1;
+    tx_staged[tx_nstaged++] = p;
+    tx_tso.last = plen;
+    tx_tso.len += plen;
+    tx_tso.nextseq += plen;
+    return 0;
+}
+
+/*
+ * Stage the pbuf chain p to be sent by pointing the card at its pieces.
+ * Returns 0 on success, < 0 if the packet must be copied instead.
+ */
+static int
+tx_stage(struct jif *jif, struct pbuf *p)
+{
+    int n, plen;
+
+    if (tx_join(p) == 0)
+	return 0;
+    if (tx_nstaged == PACKET_MAXBATCH
+	|| tx_nfrags + PACKET_MAXFRAGS > PACKET_BATCH_MAXFRAGS
+	|| tx_nsent - tx_nfreed + tx_nstaged >= TXPENDING)
+	tx_flush_frags(jif);
+    if (tx_nsent - tx_nfreed >= TXPENDING)
+	return -1;
+
+    n = tx_pieces(p, 0, tx_nfrags, tx_nfrags + PACKET_MAXFRAGS);
+    if (n <= tx_nfrags)
+	return -1;
+    tx_frags[tx_nfrags].pf_flags = tx_csum(p->payload, p->len, 0);
+    tx_frags[n - 1].pf_flags |= PACKET_FRAG_EOP;
+
+    // Later segments of the same connection may join a TCP segment
+    tx_tso.p = NULL;
+    if ((tx_tso.tcp = tx_tcp(p, &tx_tso.hlen, &plen))) {
+	tx_tso.p = p;
+	tx_tso.first = tx_nfrags;
+	tx_tso.mss = tx_tso.last = plen;
+	tx_tso.len = p->tot_len;
+	tx_tso.nextseq = ntohl(tx_tso.tcp->seqno) + plen;
+    }
+
+    tx_nfrags = n;
+    pbuf_ref(p);
+    tx_staged_eop[tx_nstaged] = 1;
+    tx_staged[tx_nstaged++] = p;
+    return 0;
+}
+
+/*
+ * jif_flush():
+ *
+ * Send the packets that low_level_output has queued, and release the
+ * pbufs of packets the card has finished sending.  Call this whenever
+ * the network server is about to wait: before then, packets only
+ * collect (TCP also does not retransmit a segment until the card is
+ * done with it).
+ *
+ */
+void
+jif_flush(struct netif *netif)
+{
+    struct jif *jif = netif->state;
+
+    tx_flush_frags(jif);
+    tx_flush_copies(jif);
+}
+
 static void
 low_level_init(struct netif *netif)
 {
@@ -84,33 +425,10 @@ low_level_init(struct netif *netif)
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
-    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
-    if (r < 0)
-	panic("jif: could not allocate page of memory");
-    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
-
-    struct jif *jif;
-    jif = netif->state;
-
-    char *txbuf = pkt->jp_data;
-    int txsize = 0;
-    struct pbuf *q;
-    for (q = p; q != NULL; q = q->next) {
-	/* Send the data from the pbuf to the interface, one pbuf at a
-	   time. The size of the data in each pbuf is kept in the ->len
-	   variable. */
-
-	if (txsize + q->len > 2000)
-	    panic("oversized packet, fragment %d txsize %d\n", q->len, txsize);
-	memcpy(&txbuf[txsize], q->payload, q->len);
-	txsize += q->len;
-    }
-
-    pkt->jp_len = txsize;
-
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, (void *)pkt);
-
+    // Queue the packet to be sent where it is; copy it for the output
+    // environment only if that fails
+    if (tx_stage(netif->state, p) < 0)
+	tx_copy(netif->state, p);
     return ERR_OK;
 }
 
@@ -147,6 +465,12 @@ low_level_input(void *va)
 	copied += bytes;
     }
 
+    // Checksums the card has verified need not be checked again
+    if (pkt->jp_flags & PACKET_CSUM_IP)
+	p->flags |= PBUF_FLAG_CSUM_IP_OK;
+    if (pkt->jp_flags & PACKET_CSUM_L4)
+	p->flags |= PBUF_FLAG_CSUM_L4_OK;
+
     return p;
 }
 /*
@@ -226,7 +550,7 @@ err_t
 jif_init(struct netif *netif)
 {
     struct jif *jif;
-    envid_t *output_envid; 
+    struct jif_output *output;
 
     jif = mem_malloc(sizeof(struct jif));
 
@@ -235,7 +559,7 @@ jif_init(struct netif *netif)
 	return ERR_MEM;
     }
 
-    output_envid = (envid_t *)netif->state;
+    output = (struct jif_output *)netif->state;
 
     netif->state = jif;
     netif->output = jif_output;
@@ -243,7 +567,8 @@ jif_init(struct netif *netif)
     memcpy(&netif->name[0], "en", 2);
 
     jif->ethaddr = (struct eth_addr *)&(netif->hwaddr[0]);
-    jif->envid = *output_envid; 
+    jif->envid = output->jo_envid;
+    jif->ring = output->jo_ring;
 
     low_level_init(netif);
 
@@ -1,4 +1,13 @@
 #include <lwip/netif.h>
+#include <inc/ns.h>
+
+// The output environment and the ring that carries packets to it;
+// jif_init expects netif->state to point to one of these
+struct jif_output {
+    envid_t jo_envid;
+    struct jif_ring *jo_ring;
+};
 
 void	jif_input(struct netif *netif, void *va);
 err_t	jif_init(struct netif *netif);
+void	jif_flush(struct netif *netif);
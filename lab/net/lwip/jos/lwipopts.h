@@ -24,11 +24,12 @@ void *memcpy(void *dst, const void *src, size_t n);
 
 #define MEMP_NUM_PBUF		64
 #define MEMP_NUM_UDP_PCB	8
-#define MEMP_NUM_TCP_PCB	32
+// Enough connections for a server that waits on them with epoll
+#define MEMP_NUM_TCP_PCB	1024
 #define MEMP_NUM_TCP_PCB_LISTEN	16
 #define MEMP_NUM_TCP_SEG	TCP_SND_QUEUELEN// at least as big as TCP_SND_QUEUELEN
 #define MEMP_NUM_NETBUF		128
-#define MEMP_NUM_NETCONN	32
+#define MEMP_NUM_NETCONN	1024
 #define MEMP_NUM_SYS_TIMEOUT    6
 
 #define PER_TCP_PCB_BUFFER	(16 * 4096)
@@ -37,6 +38,11 @@ void *memcpy(void *dst, const void *src, size_t n);
 #define PBUF_POOL_SIZE		512
 #define PBUF_POOL_BUFSIZE	2000
 
+// The card fills in outgoing checksums; jif sets packets up for it
+#define CHECKSUM_GEN_IP		0
+#define CHECKSUM_GEN_UDP	0
+#define CHECKSUM_GEN_TCP	0
+
 #define TCP_MSS			1460
 #define TCP_WND			24000
 #define TCP_SND_BUF		(16 * TCP_MSS)
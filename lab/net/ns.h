@@ -11,6 +11,16 @@
 #define QUEUE_SIZE	20
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
 
+// Clients whose sockets' readiness we report, and where their struct
+// Nsevents pages are mapped
+#define NWATCHERS	32
+#define WATCHVA		(REQVA - NWATCHERS * PGSIZE)
+
+// The packet rings shared with the input and output environments
+#define RINGVA		0x10000000
+#define INPUT_RING	((struct jif_ring*) RINGVA)
+#define OUTPUT_RING	((struct jif_ring*) (RINGVA + JIF_RING_PAGES * PGSIZE))
+
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
 
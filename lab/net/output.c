@@ -3,6 +3,7 @@
 
 extern union Nsipc nsipcbuf;
 
+// Send the packets the network server puts in OUTPUT_RING.
 void
 output(envid_t ns_envid)
 {
@@ -11,18 +12,40 @@ output(envid_t ns_envid)
 	// LAB 6: Your code here:
 	// 	- read a packet from the network server
 	//	- send the packet to the device driver
-    int value;
-    int perm;
+    struct jif_ring *ring = OUTPUT_RING;
+    envid_t whom;
+    int value, n;
+
     while(1)
     {
-        if ((value = ipc_recv(&ns_envid, (void *)&nsipcbuf, &perm))<0)
+        if ((n = jif_ring_count(ring)) == 0)
+        {
+            // Sleep until the network server rings
+            if (jif_ring_idle(ring))
+            {
+                if ((value = ipc_recv(&whom, 0, 0)) < 0)
+                {
+                    panic("output: ipc_recv has error %e", value);
+                }
+                assert(value == NSREQ_OUTPUT && whom == ns_envid);
+            }
+            jif_ring_busy(ring);
+            continue;
+        }
+        // The driver takes consecutive pages, so stop at the end of
+        // the ring.  Rather than drop what does not fit, wait for the
+        // card to make room; the network server fills the ring
+        // meanwhile.
+        n = MIN(n, JIF_RING_SLOTS - ring->jr_tail % JIF_RING_SLOTS);
+        n = MIN(n, PACKET_MAXBATCH);
+        if ((value = sys_packet_send_pages(jif_ring_slot(ring, ring->jr_tail), n)) < 0)
         {
-            panic("output: ipc_recv has error %e", value);
+            panic("output: packet_send_pages failed with error %e", value);
         }
-        assert(value == NSREQ_OUTPUT);
-        if ((value = sys_packet_send((void *)(nsipcbuf.pkt.jp_data), nsipcbuf.pkt.jp_len)) < 0)
+        jif_ring_consume(ring, value);
+        if (value < n)
         {
-            cprintf("output: packet_send failed with error %d\n", value);
+            sys_packet_send_wait();
         }
     }
 }
@@ -45,7 +45,21 @@ static struct timer_thread t_tcps;
 
 static envid_t timer_envid;
 static envid_t input_envid;
-static envid_t output_envid;
+// Where jif sends the packets it does not hand to the driver itself
+static struct jif_output jif_output;
+
+// Clients that watch sockets (see struct Nsevents), each with its
+// page at WATCHER_EV
+static struct watcher {
+	envid_t w_env;		// 0 if the slot is free
+	bool w_wake;		// we have changed something it may wait for
+	bool w_ring;		// it is waiting and we owe it an NSREQ_WAKE
+} watchers[NWATCHERS];
+#define WATCHER_EV(i)	((struct Nsevents*) (WATCHVA + (i) * PGSIZE))
+// The watcher of each socket plus one, or 0
+static uint8_t sock_watcher[NSEV_MAXSOCKS];
+// Some watcher has w_wake or w_ring set
+static bool watch_wake;
 
 static bool buse[QUEUE_SIZE];
 static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
@@ -59,10 +73,9 @@ get_buffer(void) {
 	for (i = 0; i < QUEUE_SIZE; i++)
 		if (!buse[i]) break;
 
-	if (i == QUEUE_SIZE) {
-		panic("NS: buffer overflow");
-		return 0;
-	}
+	// Requests that block keep their pages, so there may be none left
+	if (i == QUEUE_SIZE)
+		return NULL;
 
 	va = (void *)(REQVA + i * PGSIZE);
 	buse[i] = 1;
@@ -76,6 +89,120 @@ put_buffer(void *va) {
 	buse[i] = 0;
 }
 
+// The readiness of socket s, as POLL* conditions
+static uint8_t
+sock_state(int s)
+{
+	int readable, writable, failed;
+
+	if (lwip_socket_state(s, &readable, &writable, &failed) < 0)
+		return POLLERR;
+	return (readable ? POLLIN : 0) | (writable ? POLLOUT : 0)
+		| (failed ? POLLERR : 0);
+}
+
+// Bring what socket s's watcher sees of it up to date.  lwIP calls
+// this whenever it posts an event on s, and so do we after each
+// request, which can change s without one.
+static void
+watch_update(int s)
+{
+	struct Nsevents *ev;
+	uint8_t state;
+	int w;
+
+	if (s < 0 || s >= NSEV_MAXSOCKS || !(w = sock_watcher[s]))
+		return;
+	ev = WATCHER_EV(w - 1);
+	if ((state = sock_state(s)) == ev->ne_state[s])
+		return;
+	ev->ne_state[s] = state;
+	// The client takes the bits with xchg, so set them atomically
+	asm volatile("lock; orl %1, %0"
+		     : "+m" (ev->ne_changed[s / 32]) : "r" (1 << (s % 32))
+		     : "memory");
+	watchers[w - 1].w_wake = 1;
+	watch_wake = 1;
+}
+
+// Ring the watchers that have blocked for changes we have made.  A
+// watcher whose ne_waiting we took is committed to receiving, but may
+// not have reached its receive yet; it stays in w_ring, and watch_wake
+// stays set so that the main loop keeps coming back here rather than
+// sleeping.
+static void
+watch_flush(void)
+{
+	struct Nsevents *ev;
+	int i, r;
+
+	if (!watch_wake)
+		return;
+	watch_wake = 0;
+	for (i = 0; i < NWATCHERS; i++) {
+		if (watchers[i].w_wake) {
+			watchers[i].w_wake = 0;
+			ev = WATCHER_EV(i);
+			if (ev->ne_waiting && xchg(&ev->ne_waiting, 0))
+				watchers[i].w_ring = 1;
+		}
+		if (!watchers[i].w_ring)
+			continue;
+		r = sys_ipc_try_send(watchers[i].w_env, NSREQ_WAKE,
+				     (void*) UTOP, 0);
+		if (r == -E_IPC_NOT_RECV)
+			watch_wake = 1;
+		else
+			watchers[i].w_ring = 0;
+	}
+}
+
+static bool
+watcher_alive(int i)
+{
+	envid_t e = watchers[i].w_env;
+
+	return e && envs[ENVX(e)].env_id == e
+		&& envs[ENVX(e)].env_status != ENV_FREE;
+}
+
+// Handle NSREQ_WATCH from 'whom', whose struct Nsevents arrived at
+// 'va': map it, unless we already have, and start reporting on socket
+// ne_watch.  The slot of a client that has exited is taken over.
+static int
+watch_request(envid_t whom, struct Nsevents *va)
+{
+	int i, j, w = -1, s = va->ne_watch, r;
+	int readable, writable, failed;
+
+	for (i = 0; i < NWATCHERS; i++) {
+		if (watchers[i].w_env == whom)
+			break;
+		if (w < 0 && !watcher_alive(i))
+			w = i;
+	}
+	if (i == NWATCHERS) {
+		if (w < 0)
+			return -E_NO_MEM;
+		i = w;
+		for (j = 0; j < NSEV_MAXSOCKS; j++)
+			if (sock_watcher[j] == i + 1)
+				sock_watcher[j] = 0;
+		if ((r = sys_page_map(0, va, 0, WATCHER_EV(i),
+				      PTE_P|PTE_W|PTE_U)) < 0)
+			return r;
+		watchers[i].w_env = whom;
+		watchers[i].w_wake = 0;
+		watchers[i].w_ring = 0;
+	}
+	if (s < 0 || s >= NSEV_MAXSOCKS
+	    || lwip_socket_state(s, &readable, &writable, &failed) < 0)
+		return -E_INVAL;
+	sock_watcher[s] = i + 1;
+	WATCHER_EV(i)->ne_state[s] = sock_state(s);
+	return 0;
+}
+
 static void
 lwip_init(struct netif *nif, void *if_state,
 	  uint32_t init_addr, uint32_t init_mask, uint32_t init_gw)
@@ -142,7 +269,8 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	thread_wait(&done, 0, (uint32_t)~0);
 	lwip_core_lock();
 
-	lwip_init(&nif, &output_envid, ipaddr, netmask, gw);
+	lwip_init(&nif, &jif_output, ipaddr, netmask, gw);
+	lwip_socket_event_hook = watch_update;
 
 	start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
 	start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
@@ -169,6 +297,7 @@ process_timer(envid_t envid) {
 		return;
 	}
 
+	jif_flush(&nif);
 	start = sys_time_msec();
 	thread_yield();
 	now = sys_time_msec();
@@ -187,12 +316,13 @@ static void
 serve_thread(uint32_t a) {
 	struct st_args *args = (struct st_args *)a;
 	union Nsipc *req = args->req;
-	int r;
+	int r, s = -1;
 
 	switch (args->reqno) {
 	case NSREQ_ACCEPT:
 	{
 		struct Nsret_accept ret;
+		s = req->accept.req_s;
 		ret.ret_addrlen = req->accept.req_addrlen;
 		r = lwip_accept(req->accept.req_s, &ret.ret_addr,
 				&ret.ret_addrlen);
@@ -208,6 +338,8 @@ serve_thread(uint32_t a) {
 		break;
 	case NSREQ_CLOSE:
 		r = lwip_close(req->close.req_s);
+		if (req->close.req_s >= 0 && req->close.req_s < NSEV_MAXSOCKS)
+			sock_watcher[req->close.req_s] = 0;
 		break;
 	case NSREQ_CONNECT:
 		r = lwip_connect(req->connect.req_s, &req->connect.req_name,
@@ -219,10 +351,12 @@ serve_thread(uint32_t a) {
 	case NSREQ_RECV:
 		// Note that we read the request fields before we
 		// overwrite it with the response data.
+		s = req->recv.req_s;
 		r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
 			      req->recv.req_len, req->recv.req_flags);
 		break;
 	case NSREQ_SEND:
+		s = req->send.req_s;
 		r = lwip_send(req->send.req_s, &req->send.req_buf,
 			      req->send.req_size, req->send.req_flags);
 		break;
@@ -230,47 +364,92 @@ serve_thread(uint32_t a) {
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
 		break;
-	case NSREQ_INPUT:
-		jif_input(&nif, (void *)&req->pkt);
-		r = 0;
-		break;
 	default:
 		cprintf("Invalid request code %d from %08x\n", args->whom, args->req);
 		r = -E_INVAL;
 		break;
 	}
 
+	// Taking data or a connection changes readiness without an event
+	watch_update(s);
+
 	if (r == -1) {
 		char buf[100];
 		snprintf(buf, sizeof buf, "ns req type %d", args->reqno);
 		perror(buf);
 	}
 
-	if (args->reqno != NSREQ_INPUT)
-		ipc_send(args->whom, r, 0, 0);
+	ipc_send(args->whom, r, 0, 0);
 
 	put_buffer(args->req);
 	sys_page_unmap(0, (void*) args->req);
 	free(args);
 }
 
+// Pass the packets waiting in the input ring to lwIP, at most a ring's
+// worth.
+static void
+input_drain(void)
+{
+	struct jif_ring *r = INPUT_RING;
+	uint32_t n;
+
+	for (n = jif_ring_count(r); n > 0; n--) {
+		jif_input(&nif, jif_ring_slot(r, r->jr_tail));
+		jif_ring_consume(r, 1);
+	}
+}
+
+// Do the work that is waiting: take in the packets the input
+// environment has queued, run the threads that are ready, and send
+// what that produced.
+static void
+serve_pending(void)
+{
+	int i;
+
+	input_drain();
+	// We limit the number of yields in case there's a rogue thread.
+	for (i = 0; thread_wakeups_pending() && i < 32; ++i)
+		thread_yield();
+	jif_flush(&nif);
+	watch_flush();
+}
+
 void
 serve(void) {
 	int32_t reqno;
 	uint32_t whom;
-	int i, perm;
+	int perm, r;
 	void *va;
 
 	while (1) {
-		// ipc_recv will block the entire process, so we flush
-		// all pending work from other threads.  We limit the
-		// number of yields in case there's a rogue thread.
-		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
-			thread_yield();
-
-		perm = 0;
-		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		// While every request page is taken, keep the threads that
+		// hold them going, and let clients wait
+		while (!(va = get_buffer())) {
+			serve_pending();
+			sys_yield();
+		}
+
+		// The receive is armed rather than blocking, so that we
+		// keep taking in packets until a request arrives.  Block
+		// only once there is nothing to do, and then the input
+		// environment rings when it has packets.
+		if ((r = sys_ipc_recv_arm(va, 1)) < 0)
+			panic("sys_ipc_recv_arm: %e", r);
+		// A watcher we still owe a wake has yet to reach its
+		// receive, so give it the CPU instead.
+		while (thisenv->env_ipc_recving) {
+			serve_pending();
+			if (thisenv->env_ipc_recving && watch_wake)
+				sys_yield();
+			else if (thisenv->env_ipc_recving && jif_ring_idle(INPUT_RING))
+				sys_ipc_recv_wait();
+			jif_ring_busy(INPUT_RING);
+		}
+		whom = thisenv->env_ipc_from;
+		reqno = thisenv->env_ipc_value;
+		perm = thisenv->env_ipc_perm;
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -281,6 +460,17 @@ serve(void) {
 			put_buffer(va);
 			continue;
 		}
+		if (reqno == NSREQ_INPUT) {
+			// A doorbell: the loop above takes the packets
+			put_buffer(va);
+			continue;
+		}
+		if (reqno == NSREQ_WATCH && (perm & PTE_P)) {
+			ipc_send(whom, watch_request(whom, va), 0, 0);
+			sys_page_unmap(0, va);
+			put_buffer(va);
+			continue;
+		}
 
 		// All remaining requests must contain an argument page
 		if (!(perm & PTE_P)) {
@@ -315,6 +505,7 @@ void
 umain(int argc, char **argv)
 {
 	envid_t ns_envid = sys_getenvid();
+	int r;
 
 	binaryname = "ns";
 
@@ -327,6 +518,13 @@ umain(int argc, char **argv)
 		return;
 	}
 
+	// Map the packet rings before forking, so that the input and
+	// output threads share them
+	if ((r = jif_ring_alloc(INPUT_RING)) < 0)
+		panic("could not allocate input ring: %e", r);
+	if ((r = jif_ring_alloc(OUTPUT_RING)) < 0)
+		panic("could not allocate output ring: %e", r);
+
 	// fork off the input thread which will poll the NIC driver for input
 	// packets
 	input_envid = fork();
@@ -339,10 +537,11 @@ umain(int argc, char **argv)
 
 	// fork off the output thread that will send the packets to the NIC
 	// driver
-	output_envid = fork();
-	if (output_envid < 0)
+	jif_output.jo_envid = fork();
+	jif_output.jo_ring = OUTPUT_RING;
+	if (jif_output.jo_envid < 0)
 		panic("error forking");
-	else if (output_envid == 0) {
+	else if (jif_output.jo_envid == 0) {
 		output(ns_envid);
 		return;
 	}
@@ -5,7 +5,7 @@
 static envid_t output_envid;
 static envid_t input_envid;
 
-static struct jif_pkt *pkt = (struct jif_pkt*)REQVA;
+static struct jif_ring *output_ring = OUTPUT_RING;
 
 
 static void
@@ -22,10 +22,7 @@ announce(void)
     //sys_get_mac_addr((void *)&mac, 0);
 	uint32_t myip = inet_addr(IP);
 	uint32_t gwip = inet_addr(DEFAULT);
-	int r;
-
-	if ((r = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
-		panic("sys_page_map: %e", r);
+	struct jif_pkt *pkt = jif_ring_slot(output_ring, output_ring->jr_head);
 
 	struct etharp_hdr *arp = (struct etharp_hdr*)pkt->jp_data;
 	pkt->jp_len = sizeof(*arp);
@@ -42,8 +39,7 @@ announce(void)
 	memset(arp->dhwaddr.addr,  0x00,  ETHARP_HWADDR_LEN);
 	memcpy(arp->dipaddr.addrw, &gwip, 4);
 
-	ipc_send(output_envid, NSREQ_OUTPUT, pkt, PTE_P|PTE_W|PTE_U);
-	sys_page_unmap(0, pkt);
+	jif_ring_produce(output_ring, 1, output_envid, NSREQ_OUTPUT);
 }
 
 static void
@@ -70,12 +66,19 @@ hexdump(const char *prefix, const void *data, int len)
 void
 umain(int argc, char **argv)
 {
-    cprintf("line 70: pkt = %x\n", pkt);
 	envid_t ns_envid = sys_getenvid();
-	int i, r, first = 1;
+	struct jif_ring *ring;
+	struct jif_pkt *pkt;
+	int r, first = 1;
 
 	binaryname = "testinput";
 
+	// The rings are shared with the environments we fork
+	if ((r = jif_ring_alloc(INPUT_RING)) < 0)
+		panic("jif_ring_alloc: %e", r);
+	if ((r = jif_ring_alloc(output_ring)) < 0)
+		panic("jif_ring_alloc: %e", r);
+
 	output_envid = fork();
 	if (output_envid < 0)
 		panic("error forking");
@@ -83,7 +86,6 @@ umain(int argc, char **argv)
 		output(ns_envid);
 		return;
 	}
-    cprintf("line 83: pkt = %x\n", pkt);
 
 	input_envid = fork();
 	if (input_envid < 0)
@@ -98,24 +100,30 @@ umain(int argc, char **argv)
 
 	while (1) {
 		envid_t whom;
-		int perm;
-
-		int32_t req = ipc_recv((int32_t *)&whom, pkt, &perm);
-        cprintf("received: 0x%x with perm 0x%x\n", pkt, perm);
-		if (req < 0)
-			panic("ipc_recv: %e", req);
-		if (whom != input_envid)
-			panic("IPC from unexpected environment %08x", whom);
-		if (req != NSREQ_INPUT)
-			panic("Unexpected IPC %d", req);
-
-		hexdump("input: ", pkt->jp_data, pkt->jp_len);
-		cprintf("\n");
-
-		// Only indicate that we're waiting for packets once
-		// we've received the ARP reply
-		if (first)
-			cprintf("Waiting for packets...\n");
-		first = 0;
+
+		ring = INPUT_RING;
+		for (; jif_ring_count(ring); jif_ring_consume(ring, 1)) {
+			pkt = jif_ring_slot(ring, ring->jr_tail);
+			hexdump("input: ", pkt->jp_data, pkt->jp_len);
+			cprintf("\n");
+
+			// Only indicate that we're waiting for packets once
+			// we've received the ARP reply
+			if (first)
+				cprintf("Waiting for packets...\n");
+			first = 0;
+		}
+
+		// Sleep until the input environment rings
+		if (jif_ring_idle(ring)) {
+			int32_t req = ipc_recv((int32_t *)&whom, 0, 0);
+			if (req < 0)
+				panic("ipc_recv: %e", req);
+			if (whom != input_envid)
+				panic("IPC from unexpected environment %08x", whom);
+			if (req != NSREQ_INPUT)
+				panic("Unexpected IPC %d", req);
+		}
+		jif_ring_busy(ring);
 	}
 }
@@ -6,17 +6,22 @@
 
 static envid_t output_envid;
 
-static struct jif_pkt *pkt = (struct jif_pkt*)REQVA;
+static struct jif_ring *ring = OUTPUT_RING;
 
 
 void
 umain(int argc, char **argv)
 {
 	envid_t ns_envid = sys_getenvid();
+	struct jif_pkt *pkt;
 	int i, r;
 
 	binaryname = "testoutput";
 
+	// The ring is shared with the output environment
+	if ((r = jif_ring_alloc(ring)) < 0)
+		panic("jif_ring_alloc: %e", r);
+
 	output_envid = fork();
 	if (output_envid < 0)
 		panic("error forking");
@@ -26,14 +31,14 @@ umain(int argc, char **argv)
 	}
 
 	for (i = 0; i < TESTOUTPUT_COUNT; i++) {
-		if ((r = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
-			panic("sys_page_alloc: %e", r);
+		while (jif_ring_space(ring) == 0)
+			sys_yield();
+		pkt = jif_ring_slot(ring, ring->jr_head);
 		pkt->jp_len = snprintf(pkt->jp_data,
-				       PGSIZE - sizeof(pkt->jp_len),
+				       PGSIZE - sizeof(*pkt),
 				       "Packet %02d", i);
 		cprintf("Transmitting packet %d\n", i);
-		ipc_send(output_envid, NSREQ_OUTPUT, pkt, PTE_P|PTE_W|PTE_U);
-		sys_page_unmap(0, pkt);
+		jif_ring_produce(ring, 1, output_envid, NSREQ_OUTPUT);
 	}
 
 	// Spin for a while, just in case IPC's or packets need to be flushed
@@ -0,0 +1,106 @@
+// Time appends to a nearly full disk.  Fills the file system to 90%
+// with files written a page at a time in turn, so that their blocks
+// interleave the way a busy disk's do, then appends to a new file in
+// large writes and syncs it.  The number of disk commands the sync
+// takes shows how contiguously the allocator laid the new file out.
+//
+// Usage: benchalloc [kbytes]
+
+#include <inc/lib.h>
+
+#define NFILL		4
+#define FILLPCT		90
+
+char buf[16 * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+fill_name(char *name, int i)
+{
+	strcpy(name, "/benchalloc.fill0");
+	name[strlen(name) - 1] = '0' + i;
+}
+
+// Write to NFILL files a page at a time, round robin, until the file
+// system is FILLPCT% full.
+static void
+fill(void)
+{
+	struct Fsstats st;
+	char name[MAXNAMELEN];
+	int fd[NFILL], i, r;
+	uint32_t target;
+
+	if ((r = fsstats(&st)) < 0)
+		panic("fsstats: %e", r);
+	target = st.st_nblocks * FILLPCT / 100;
+	cprintf("  filling: %u of %u blocks in use, target %u\n",
+		st.st_nblocks - st.st_freeblocks, st.st_nblocks, target);
+
+	for (i = 0; i < NFILL; i++) {
+		fill_name(name, i);
+		if ((fd[i] = open(name, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+			panic("open %s: %e", name, fd[i]);
+	}
+	while (st.st_nblocks - st.st_freeblocks < target) {
+		for (i = 0; i < NFILL; i++)
+			if ((r = write(fd[i], buf, PGSIZE)) != PGSIZE)
+				panic("write fill file: %e", r);
+		if ((r = fsstats(&st)) < 0)
+			panic("fsstats: %e", r);
+	}
+	for (i = 0; i < NFILL; i++)
+		close(fd[i]);
+	cprintf("  filled: %u of %u blocks in use\n",
+		st.st_nblocks - st.st_freeblocks, st.st_nblocks);
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *path = "/benchalloc";
+	char name[MAXNAMELEN];
+	struct Fsstats before, after;
+	int size = 1024 * 1024;
+	unsigned start, wms, sms;
+	int f, i, r;
+
+	binaryname = "benchalloc";
+	if (argc > 1)
+		size = strtol(argv[1], 0, 0) * 1024;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = 'a' + i % 26;
+	cprintf("benchalloc:\n");
+	fill();
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+
+	if ((f = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, f);
+	if ((r = fsstats(&before)) < 0)
+		panic("fsstats: %e", r);
+	start = sys_time_msec();
+	for (i = 0; i < size; i += r)
+		if ((r = write(f, buf, MIN(sizeof(buf), size - i))) <= 0)
+			panic("write %s: %e", path, r);
+	wms = sys_time_msec() - start;
+	start = sys_time_msec();
+	close(f);
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+	sms = sys_time_msec() - start;
+	if ((r = fsstats(&after)) < 0)
+		panic("fsstats: %e", r);
+
+	cprintf("  append %d KB: write %u ms (%u KB/s), sync %u ms, "
+		"%u disk commands for %u blocks\n", size / 1024, wms,
+		wms ? (size / 1024) * 1000 / wms : 0, sms,
+		after.st_diskcmds - before.st_diskcmds,
+		after.st_diskblocks - before.st_diskblocks);
+
+	remove(path);
+	for (i = 0; i < NFILL; i++) {
+		fill_name(name, i);
+		remove(name);
+	}
+}
@@ -0,0 +1,86 @@
+// Time sequential reads of a multi-megabyte file the way cat does,
+// once through the copying FSREQ_READ path and once through the
+// zero-copy FSREQ_READ_MAP path.
+//
+// Usage: benchcat [path [kbytes]]
+
+#include <inc/lib.h>
+
+#define BUFSIZE		(8 * PGSIZE)
+
+// One extra page so that buf + 1 stays in bounds
+char buf[BUFSIZE + PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+make_file(const char *path, int size)
+{
+	struct Stat st;
+	int f, i, r;
+
+	if (stat(path, &st) == 0 && st.st_size == size)
+		return;
+
+	cprintf("creating %s (%d KB)\n", path, size / 1024);
+	if ((f = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, f);
+	for (i = 0; i < BUFSIZE; i++)
+		buf[i] = 'a' + i % 26;
+	for (i = 0; i < size; i += r)
+		if ((r = write(f, buf, MIN(BUFSIZE, size - i))) <= 0)
+			panic("write %s: %e", path, r);
+	close(f);
+}
+
+// Read all of 'path' into 'b'.  Returns a checksum of the contents.
+static uint32_t
+cat(const char *path, char *b, int size)
+{
+	unsigned start, ms;
+	uint32_t sum;
+	int f, i, n, total;
+
+	if ((f = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, f);
+	sum = 0;
+	total = 0;
+	start = sys_time_msec();
+	while ((n = read(f, b, BUFSIZE)) > 0) {
+		for (i = 0; i < n; i += 64)
+			sum += b[i];
+		total += n;
+	}
+	ms = sys_time_msec() - start;
+	if (n < 0)
+		panic("read %s: %e", path, n);
+	close(f);
+
+	if (total != size)
+		panic("read %d bytes from %s, expected %d", total, path, size);
+	cprintf("  %s buffer: %d KB in %u ms (%u KB/s)\n",
+		PGOFF(b) ? "unaligned" : "aligned", total / 1024, ms,
+		ms ? (total / 1024) * 1000 / ms : 0);
+	return sum;
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *path = "/bigfile";
+	int size = 2048 * 1024;
+	uint32_t copy_sum, map_sum;
+
+	binaryname = "benchcat";
+	if (argc > 1)
+		path = argv[1];
+	if (argc > 2)
+		size = strtol(argv[2], 0, 0) * 1024;
+
+	make_file(path, size);
+
+	cprintf("benchcat %s:\n", path);
+	// An unaligned buffer forces the copying read path
+	copy_sum = cat(path, buf + 1, size);
+	map_sum = cat(path, buf, size);
+	if (copy_sum != map_sum)
+		panic("zero-copy read returned different data");
+}
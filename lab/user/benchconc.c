@@ -0,0 +1,130 @@
+// Run several file system clients at once: "hot" clients re-read a
+// small file that stays in the server's block cache, while "cold"
+// clients read files whose blocks have been dropped from the cache.
+// Hot reads should take about as long as they do with no cold clients
+// running, instead of queueing behind the cold clients' disk reads.
+//
+// Usage: benchconc [nhot [ncold]]
+
+#include <inc/lib.h>
+
+#define NHOTREADS	500
+#define COLDSIZE	(64 * 1024)
+#define MAXCLIENTS	16
+
+char buf[PGSIZE];
+
+static void
+make_file(const char *path, int size)
+{
+	struct Stat st;
+	int f, i, r;
+
+	if (stat(path, &st) == 0 && st.st_size == size)
+		return;
+
+	if ((f = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, f);
+	for (i = 0; i < PGSIZE; i++)
+		buf[i] = 'a' + i % 26;
+	for (i = 0; i < size; i += r)
+		if ((r = write(f, buf, MIN(PGSIZE, size - i))) <= 0)
+			panic("write %s: %e", path, r);
+	close(f);
+}
+
+static void
+hot_client(void)
+{
+	unsigned start;
+	int f, i, r;
+
+	if ((f = open("/benchhot", O_RDONLY)) < 0)
+		panic("open /benchhot: %e", f);
+	start = sys_time_msec();
+	for (i = 0; i < NHOTREADS; i++) {
+		seek(f, 0);
+		if ((r = read(f, buf, PGSIZE)) != PGSIZE)
+			panic("read /benchhot: %e", r);
+	}
+	cprintf("    hot  [%08x]: %d reads in %u ms\n", thisenv->env_id,
+		NHOTREADS, sys_time_msec() - start);
+}
+
+static void
+cold_client(int i)
+{
+	char path[MAXNAMELEN];
+	unsigned start;
+	int f, n, r;
+
+	snprintf(path, sizeof(path), "/benchcold%d", i);
+	if ((f = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, f);
+	start = sys_time_msec();
+	for (n = 0; (r = read(f, buf, PGSIZE)) > 0; n += r)
+		;
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	cprintf("    cold [%08x]: %d KB in %u ms\n", thisenv->env_id,
+		n / 1024, sys_time_msec() - start);
+}
+
+// Run 'nhot' hot and 'ncold' cold clients concurrently, starting with
+// an empty cache except for the hot file.
+static void
+run(int nhot, int ncold)
+{
+	envid_t envs[MAXCLIENTS];
+	int f, i, n, r;
+
+	if ((r = dropcache()) < 0)
+		panic("dropcache: %e", r);
+	if ((f = open("/benchhot", O_RDONLY)) < 0 || read(f, buf, PGSIZE) != PGSIZE)
+		panic("warming /benchhot failed");
+	close(f);
+
+	cprintf("  %d hot, %d cold:\n", nhot, ncold);
+	for (n = 0; n < nhot + ncold; n++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			if (n < nhot)
+				hot_client();
+			else
+				cold_client(n - nhot);
+			exit();
+		}
+		envs[n] = r;
+	}
+	for (i = 0; i < n; i++)
+		wait(envs[i]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXNAMELEN];
+	int nhot = 2, ncold = 2, i;
+
+	binaryname = "benchconc";
+	if (argc > 1)
+		nhot = strtol(argv[1], 0, 0);
+	if (argc > 2)
+		ncold = strtol(argv[2], 0, 0);
+	if (nhot < 0 || ncold < 0 || nhot + ncold > MAXCLIENTS)
+		panic("usage: benchconc [nhot [ncold]], at most %d clients",
+		      MAXCLIENTS);
+
+	make_file("/benchhot", PGSIZE);
+	for (i = 0; i < ncold; i++) {
+		snprintf(path, sizeof(path), "/benchcold%d", i);
+		make_file(path, COLDSIZE);
+	}
+	if ((i = sync()) < 0)
+		panic("sync: %e", i);
+
+	cprintf("benchconc:\n");
+	run(nhot, 0);
+	run(nhot, ncold);
+}
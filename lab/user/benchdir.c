@@ -0,0 +1,55 @@
+// Create, look up and remove many files in one directory, timing each
+// phase.  The file server indexes large directories by name, so each
+// operation should take about the same time however many files the
+// directory holds.
+//
+// Usage: benchdir [nfiles]
+
+#include <inc/lib.h>
+
+static void
+report(const char *what, int n, unsigned ms)
+{
+	cprintf("  %-8s %d files in %u ms (%u us/file)\n", what, n, ms,
+		n ? ms * 1000 / n : 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXPATHLEN];
+	struct Stat st;
+	unsigned start;
+	int n = 10000, i, f, r;
+
+	binaryname = "benchdir";
+	if (argc > 1)
+		n = strtol(argv[1], 0, 0);
+
+	cprintf("benchdir, %d files in /:\n", n);
+	start = sys_time_msec();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "/bd%05d", i);
+		if ((f = open(path, O_WRONLY|O_CREAT|O_EXCL)) < 0)
+			panic("open %s: %e", path, f);
+		close(f);
+	}
+	report("create", n, sys_time_msec() - start);
+
+	start = sys_time_msec();
+	for (i = 0; i < n; i++) {
+		// Look the files up in a different order from creation
+		snprintf(path, sizeof(path), "/bd%05d", (i * 7919) % n);
+		if ((r = stat(path, &st)) < 0)
+			panic("stat %s: %e", path, r);
+	}
+	report("lookup", n, sys_time_msec() - start);
+
+	start = sys_time_msec();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "/bd%05d", i);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %e", path, r);
+	}
+	report("remove", n, sys_time_msec() - start);
+}
@@ -0,0 +1,109 @@
+// Time a sequential 1 MB read from a cold block cache and estimate how
+// much CPU it takes.  A spinner environment counts while the read
+// runs; comparing its rate with its rate when it has the CPU to itself
+// gives the share of the CPU that went to the read (the client and the
+// file server).  A PIO disk driver spins through every transfer,
+// while with DMA the CPU is left to the spinner.
+//
+// Usage: benchdisk [path]
+// Utilisation figures are only meaningful with one CPU (make CPUS=1).
+
+#include <inc/lib.h>
+
+#define FILESIZE	(1024 * 1024)
+#define CHUNK		(16 * PGSIZE)
+
+struct Spin {
+	volatile uint32_t count;
+	volatile unsigned wake;		// ipc_send to the parent at this time
+	volatile bool exit;
+};
+
+struct Spin *spin = (struct Spin *) 0x0f000000;
+char buf[CHUNK];
+
+static void
+spinner(envid_t parent)
+{
+	while (!spin->exit) {
+		spin->count++;
+		if ((spin->count & 0xfff) == 0 && spin->wake
+		    && sys_time_msec() >= spin->wake) {
+			spin->wake = 0;
+			ipc_send(parent, 0, 0, 0);
+		}
+	}
+	exit();
+}
+
+static void
+make_file(const char *path)
+{
+	struct Stat st;
+	int f, i, r;
+
+	if (stat(path, &st) == 0 && st.st_size == FILESIZE)
+		return;
+
+	if ((f = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, f);
+	for (i = 0; i < CHUNK; i++)
+		buf[i] = i;
+	for (i = 0; i < FILESIZE; i += r)
+		if ((r = write(f, buf, CHUNK)) <= 0)
+			panic("write %s: %e", path, r);
+	close(f);
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *path = "/benchdisk";
+	uint32_t idle_rate, busy_rate, count;
+	unsigned start, ms;
+	envid_t env;
+	int f, n, r;
+
+	binaryname = "benchdisk";
+	if (argc > 1)
+		path = argv[1];
+
+	make_file(path);
+	if ((r = sys_page_alloc(0, spin, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((env = fork()) < 0)
+		panic("fork: %e", env);
+	if (env == 0)
+		spinner(thisenv->env_parent_id);
+
+	// Spinner rate with an idle CPU: sleep in ipc_recv for a second
+	count = spin->count;
+	start = sys_time_msec();
+	spin->wake = start + 1000;
+	ipc_recv(0, 0, 0);
+	ms = sys_time_msec() - start;
+	idle_rate = (spin->count - count) / (ms ? ms : 1);
+
+	if ((r = dropcache()) < 0)
+		panic("dropcache: %e", r);
+	if ((f = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, f);
+	count = spin->count;
+	start = sys_time_msec();
+	for (n = 0; (r = read(f, buf, CHUNK)) > 0; n += r)
+		;
+	ms = sys_time_msec() - start;
+	busy_rate = (spin->count - count) / (ms ? ms : 1);
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	close(f);
+	spin->exit = 1;
+	wait(env);
+
+	cprintf("benchdisk %s: %d KB in %u ms (%u KB/s), CPU %u%% busy\n",
+		path, n / 1024, ms, ms ? (n / 1024) * 1000 / ms : 0,
+		idle_rate && busy_rate < idle_rate
+		? 100 - 100 * busy_rate / idle_rate : 0);
+}
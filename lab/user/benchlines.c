@@ -0,0 +1,80 @@
+// Time small writes and byte-at-a-time reads of a text file, the way
+// line-oriented programs use files, with and without a client-side
+// buffer (setbuf).
+//
+// Usage: benchlines [path]
+
+#include <inc/lib.h>
+
+#define FILESIZE	(64 * 1024)
+#define LINELEN		40
+
+char data[FILESIZE];
+
+static void
+report(const char *what, int n, unsigned ms)
+{
+	cprintf("  %-26s %d KB in %u ms (%u KB/s)\n", what, n / 1024, ms,
+		ms ? (n / 1024) * 1000 / ms : 0);
+}
+
+static void
+bench_write(const char *path, const char *what, size_t bufsize)
+{
+	unsigned start;
+	int f, n, r;
+
+	if ((f = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, f);
+	if (bufsize && (r = setbuf(f, bufsize)) < 0)
+		panic("setbuf: %e", r);
+	start = sys_time_msec();
+	for (n = 0; n < FILESIZE; n += r)
+		if ((r = write(f, data + n, MIN(LINELEN, FILESIZE - n))) <= 0)
+			panic("write %s: %e", path, r);
+	close(f);
+	report(what, n, sys_time_msec() - start);
+}
+
+static void
+bench_read(const char *path, const char *what, size_t bufsize)
+{
+	unsigned start;
+	int f, n, r;
+	char c;
+
+	if ((f = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, f);
+	if (bufsize && (r = setbuf(f, bufsize)) < 0)
+		panic("setbuf: %e", r);
+	start = sys_time_msec();
+	for (n = 0; (r = read(f, &c, 1)) == 1; n++)
+		if (n >= FILESIZE || c != data[n])
+			panic("%s: wrong byte at offset %d", what, n);
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	report(what, n, sys_time_msec() - start);
+	if (n != FILESIZE)
+		panic("%s: read %d bytes, expected %d", what, n, FILESIZE);
+	close(f);
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *path = "/benchlines";
+	int i;
+
+	binaryname = "benchlines";
+	if (argc > 1)
+		path = argv[1];
+
+	for (i = 0; i < FILESIZE; i++)
+		data[i] = (i % LINELEN == LINELEN - 1) ? '\n' : 'a' + i % 26;
+
+	cprintf("benchlines %s:\n", path);
+	bench_write(path, "write lines, unbuffered", 0);
+	bench_write(path, "write lines, buffered", FDBUFMAX);
+	bench_read(path, "read bytes, unbuffered", 0);
+	bench_read(path, "read bytes, buffered", FDBUFMAX);
+}
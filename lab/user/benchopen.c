@@ -0,0 +1,63 @@
+// Time open() and close() of the same paths over and over, as httpd
+// and the shell do, once the file server has seen them: a file eight
+// directories deep, a file in the root, and a deep path that does not
+// exist.
+//
+// Usage: benchopen [count]
+
+#include <inc/lib.h>
+
+#define DEPTH	8
+
+static void
+bench_open(const char *path, int count, bool exists)
+{
+	unsigned start, ms;
+	int i, f;
+
+	// Once to warm the caches
+	if ((f = open(path, O_RDONLY)) >= 0)
+		close(f);
+	start = sys_time_msec();
+	for (i = 0; i < count; i++) {
+		if ((f = open(path, O_RDONLY)) < 0) {
+			if (exists || f != -E_NOT_FOUND)
+				panic("open %s: %e", path, f);
+		} else {
+			if (!exists)
+				panic("open %s: succeeded", path);
+			close(f);
+		}
+	}
+	ms = sys_time_msec() - start;
+	cprintf("  %-40s %u us/open\n", path, count ? ms * 1000 / count : 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXPATHLEN];
+	int count = 1000, i, f;
+
+	binaryname = "benchopen";
+	if (argc > 1)
+		count = strtol(argv[1], 0, 0);
+
+	strcpy(path, "");
+	for (i = 0; i < DEPTH; i++) {
+		snprintf(path + strlen(path), sizeof(path) - strlen(path),
+			 "/bo%d", i);
+		if ((f = open(path, O_RDONLY|O_CREAT|O_MKDIR)) < 0)
+			panic("mkdir %s: %e", path, f);
+		close(f);
+	}
+	strcat(path, "/file");
+	if ((f = open(path, O_WRONLY|O_CREAT)) < 0)
+		panic("create %s: %e", path, f);
+	close(f);
+
+	cprintf("benchopen, %d opens each, warm cache:\n", count);
+	bench_open(path, count, 1);
+	bench_open("/motd", count, 1);
+	bench_open("/bo0/bo1/bo2/bo3/bo4/bo5/bo6/bo7/missing", count, 0);
+}
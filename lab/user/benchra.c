@@ -0,0 +1,80 @@
+// Time sequential reads of a file from a cold block cache, in small
+// (one page per request) and large (vectored) reads.  The file server
+// reads ahead while a file is read in order, so both should approach
+// the throughput of the disk rather than one block per round trip.
+//
+// Usage: benchra [path [kbytes]]
+
+#include <inc/lib.h>
+
+#define CHUNK		(16 * PGSIZE)
+
+// One extra page so that buf + 1 stays in bounds
+char buf[CHUNK + PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+make_file(const char *path, int size)
+{
+	struct Stat st;
+	int f, i, r;
+
+	if (stat(path, &st) == 0 && st.st_size == size)
+		return;
+
+	cprintf("creating %s (%d KB)\n", path, size / 1024);
+	if ((f = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, f);
+	for (i = 0; i < CHUNK; i++)
+		buf[i] = i;
+	for (i = 0; i < size; i += r)
+		if ((r = write(f, buf, MIN(CHUNK, size - i))) <= 0)
+			panic("write %s: %e", path, r);
+	close(f);
+}
+
+static void
+bench_read(const char *path, const char *what, char *b, int chunk, int size)
+{
+	struct Fsstats st0, st1;
+	unsigned start, ms;
+	int f, n, r;
+
+	if ((r = dropcache()) < 0 || (r = fsstats(&st0)) < 0)
+		panic("dropcache: %e", r);
+	if ((f = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, f);
+	start = sys_time_msec();
+	for (n = 0; (r = read(f, b, chunk)) > 0; n += r)
+		;
+	ms = sys_time_msec() - start;
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	close(f);
+	if (n != size)
+		panic("read %d bytes from %s, expected %d", n, path, size);
+	if ((r = fsstats(&st1)) < 0)
+		panic("fsstats: %e", r);
+	cprintf("  %-24s %d KB in %u ms (%u KB/s), %u disk commands\n",
+		what, n / 1024, ms, ms ? (n / 1024) * 1000 / ms : 0,
+		st1.st_diskcmds - st0.st_diskcmds);
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *path = "/benchra";
+	int size = 2048 * 1024;
+
+	binaryname = "benchra";
+	if (argc > 1)
+		path = argv[1];
+	if (argc > 2)
+		size = strtol(argv[2], 0, 0) * 1024;
+
+	make_file(path, size);
+
+	cprintf("benchra %s, cold cache:\n", path);
+	// An unaligned buffer keeps one-page reads on the copying path
+	bench_read(path, "read, 1 page/request", buf + 1, PGSIZE, size);
+	bench_read(path, "read, vectored", buf, CHUNK, size);
+}
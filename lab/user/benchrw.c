@@ -0,0 +1,91 @@
+// Compare 1 MB file reads and writes made one page per request
+// (FSREQ_READ/FSREQ_WRITE) with the same transfers made as vectored
+// requests (FSREQ_READV/FSREQ_WRITEV).
+//
+// Usage: benchrw [path]
+
+#include <inc/lib.h>
+
+#define FILESIZE	(1024 * 1024)
+
+// One extra page so that buf + 1 stays in bounds
+char buf[FILESIZE + PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+report(const char *what, int n, unsigned ms)
+{
+	cprintf("  %-24s %d KB in %u ms (%u KB/s)\n", what, n / 1024, ms,
+		ms ? (n / 1024) * 1000 / ms : 0);
+}
+
+static void
+bench_write(const char *path, const char *what, char *b, int chunk)
+{
+	unsigned start;
+	int f, n, r;
+
+	if ((f = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, f);
+	start = sys_time_msec();
+	for (n = 0; n < FILESIZE; n += r)
+		if ((r = write(f, b + n, MIN(chunk, FILESIZE - n))) <= 0)
+			panic("write %s: %e", path, r);
+	report(what, n, sys_time_msec() - start);
+	close(f);
+}
+
+static void
+bench_read(const char *path, const char *what, char *b, int chunk)
+{
+	unsigned start;
+	int f, n, r;
+
+	if ((f = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, f);
+	start = sys_time_msec();
+	for (n = 0; n < FILESIZE; n += r)
+		if ((r = read(f, b + n, MIN(chunk, FILESIZE - n))) <= 0)
+			panic("read %s: %e", path, r);
+	report(what, n, sys_time_msec() - start);
+	close(f);
+}
+
+static void
+check(const char *what)
+{
+	int i;
+
+	for (i = 0; i < FILESIZE; i++)
+		if (buf[i] != (char) (i * 7))
+			panic("%s: wrong byte at offset %d", what, i);
+}
+
+void
+umain(int argc, char **argv)
+{
+	extern union Fsipc fsipcbuf;
+	const char *path = "/benchrw";
+	int i;
+
+	binaryname = "benchrw";
+	if (argc > 1)
+		path = argv[1];
+
+	for (i = 0; i < FILESIZE; i++)
+		buf[i] = i * 7;
+
+	cprintf("benchrw %s:\n", path);
+	// Chunks that fit in one request page use the one-page protocol
+	bench_write(path, "write, 1 page/request", buf,
+		    sizeof(fsipcbuf.write.req_buf));
+	bench_write(path, "write, vectored", buf, FILESIZE);
+
+	// An unaligned buffer keeps one-page reads on the copying path
+	memset(buf, 0, sizeof(buf));
+	bench_read(path, "read, 1 page/request", buf + 1, PGSIZE);
+	memmove(buf, buf + 1, FILESIZE);
+	check("one-page read");
+	memset(buf, 0, sizeof(buf));
+	bench_read(path, "read, vectored", buf, FILESIZE);
+	check("vectored read");
+}
@@ -0,0 +1,41 @@
+// Time writing back a file with many dirty blocks: close() flushes the
+// file, sync() the rest of the file system.  The block I/O queue merges
+// the writes to adjacent blocks, so a file written in one go goes out
+// in a few large disk commands.
+//
+// Usage: benchsync [path [kbytes]]
+
+#include <inc/lib.h>
+
+char buf[16 * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+umain(int argc, char **argv)
+{
+	const char *path = "/benchsync";
+	int size = 1024 * 1024;
+	unsigned start, ms;
+	int f, i, r;
+
+	binaryname = "benchsync";
+	if (argc > 1)
+		path = argv[1];
+	if (argc > 2)
+		size = strtol(argv[2], 0, 0) * 1024;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = 'a' + i % 26;
+	if ((f = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, f);
+	for (i = 0; i < size; i += r)
+		if ((r = write(f, buf, MIN(sizeof(buf), size - i))) <= 0)
+			panic("write %s: %e", path, r);
+
+	start = sys_time_msec();
+	close(f);
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+	ms = sys_time_msec() - start;
+	cprintf("benchsync %s: synced %d KB in %u ms (%u KB/s)\n", path,
+		size / 1024, ms, ms ? (size / 1024) * 1000 / ms : 0);
+}
@@ -0,0 +1,149 @@
+// Count UDP datagrams arriving on port 7 as fast as the network stack
+// delivers them, and report packets per second and CPU cycles per
+// packet for each burst, how many system calls the network server and
+// its helpers made per packet, and how many packets the network driver
+// moved per call and per interrupt and what it lost.  A burst begins with its
+// first datagram and ends with a datagram that starts with "end".
+// Meanwhile, echo TCP connections to port 7, to measure latency.
+//
+// Run with 'make run-benchudp-nox' and flood it from the host with
+// 'make udp-flood', or with 'make net-bench', which also times round
+// trips to the echo server during the flood.  Interrupt throttling
+// trades latency for throughput; compare settings by booting with each,
+// for example
+//	make run-benchudp-nox INIT_CFLAGS='-DNET_ITR=0 -DNET_POLL_BUDGET=1'
+//	make run-benchudp-nox INIT_CFLAGS='-DNET_ITR=20000'
+//	make run-benchudp-nox INIT_CFLAGS='-DNET_ITR=4000 -DNET_RDTR=100 -DNET_RADV=400'
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <lwip/sockets.h>
+#include <lwip/inet.h>
+
+#define PORT 7
+
+// Print packets per call, to two decimal places
+static void
+per_call(const char *what, uint32_t npkts, uint32_t ncalls)
+{
+	uint32_t x = ncalls ? npkts * 100 / ncalls : 0;
+
+	cprintf("  %s: %u packets in %u calls (%u.%02u packets/call)\n",
+		what, npkts, ncalls, x / 100, x % 100);
+}
+
+// System calls made so far by the network server and the environments
+// it forked: its input, output and timer environments
+static uint32_t
+ns_syscalls(void)
+{
+	envid_t ns = ipc_find_env(ENV_TYPE_NS);
+	uint32_t n = 0;
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE
+		    && (envs[i].env_id == ns || envs[i].env_parent_id == ns))
+			n += envs[i].env_syscalls;
+	return n;
+}
+
+// Echo each TCP connection to port PORT until it closes
+static void
+echo_server(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len;
+	char buf[256];
+	int sock, c, n;
+
+	if ((sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		panic("socket: %e", sock);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(PORT);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+	    || listen(sock, 5) < 0)
+		panic("echo server: bind or listen failed");
+	while (1) {
+		len = sizeof(addr);
+		if ((c = accept(sock, (struct sockaddr *) &addr, &len)) < 0)
+			panic("accept: %e", c);
+		while ((n = read(c, buf, sizeof(buf))) > 0)
+			if (write(c, buf, n) != n)
+				break;
+		close(c);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	char buf[2048];
+	struct PacketStats st0, st1;
+	uint64_t tsc;
+	uint32_t nsys;
+	unsigned start, ms;
+	int sock, n, npkts;
+
+	binaryname = "benchudp";
+	if ((n = fork()) < 0)
+		panic("fork: %e", n);
+	if (n == 0)
+		echo_server();
+
+	if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+		panic("socket: %e", sock);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(PORT);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		panic("bind failed");
+	cprintf("benchudp: waiting for datagrams on port %d\n", PORT);
+
+	while (1) {
+		npkts = 0;
+		start = 0;
+		tsc = 0;
+		while ((n = read(sock, buf, sizeof(buf))) > 0) {
+			if (n >= 3 && memcmp(buf, "end", 3) == 0)
+				break;
+			if (npkts++ == 0) {
+				sys_packet_stats(&st0);
+				nsys = ns_syscalls();
+				start = sys_time_msec();
+				tsc = read_tsc();
+			}
+		}
+		if (n < 0)
+			panic("read: %e", n);
+		if (npkts < 2)
+			continue;
+		// The first datagram only starts the clock
+		ms = sys_time_msec() - start;
+		tsc = read_tsc() - tsc;
+		sys_packet_stats(&st1);
+		nsys = (ns_syscalls() - nsys) * 100 / (npkts - 1);
+		cprintf("benchudp: %d packets in %u ms (%u packets/s), "
+			"%u cycles/packet\n", npkts, ms,
+			ms ? (uint32_t) ((uint64_t) (npkts - 1) * 1000 / ms) : 0,
+			(uint32_t) (tsc / (npkts - 1)));
+		cprintf("  network server: %u.%02u system calls/packet\n",
+			nsys / 100, nsys % 100);
+		per_call("driver receive", st1.ps_rx_packets - st0.ps_rx_packets,
+			 st1.ps_rx_calls - st0.ps_rx_calls);
+		per_call("driver transmit", st1.ps_tx_packets - st0.ps_tx_packets,
+			 st1.ps_tx_calls - st0.ps_tx_calls);
+		n = st1.ps_rx_intrs - st0.ps_rx_intrs;
+		cprintf("  %u receive interrupts (%u packets/interrupt)\n", n,
+			n ? (st1.ps_rx_packets - st0.ps_rx_packets) / n : 0);
+		cprintf("  missed by the card %u, dropped on transmit %u, "
+			"transmit ring full %u times\n",
+			st1.ps_rx_missed - st0.ps_rx_missed,
+			st1.ps_tx_dropped - st0.ps_tx_dropped,
+			st1.ps_tx_full - st0.ps_tx_full);
+	}
+}
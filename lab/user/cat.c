@@ -1,6 +1,7 @@
 #include <inc/lib.h>
 
-char buf[8192];
+// Page-aligned so that whole-page reads can be mapped instead of copied
+char buf[8192] __attribute__((aligned(PGSIZE)));
 
 void
 cat(int f, char *s)
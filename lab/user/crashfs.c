@@ -0,0 +1,50 @@
+// A metadata-heavy workload to crash the machine in the middle of:
+// creates, grows, truncates and removes files in a directory big
+// enough to be indexed, forever, reporting each round.  The grading
+// script kills QEMU partway through and runs fsck on the result.
+
+#include <inc/lib.h>
+
+#define NFILES		64
+
+char buf[4 * PGSIZE];
+
+static void
+name(char *path, int i)
+{
+	snprintf(path, MAXPATHLEN, "/crash/f%d", i);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXPATHLEN];
+	int round, i, f, r;
+
+	binaryname = "crashfs";
+	memset(buf, 'c', sizeof(buf));
+	if ((f = open("/crash", O_RDONLY|O_CREAT|O_MKDIR)) < 0)
+		panic("mkdir /crash: %e", f);
+	close(f);
+
+	for (round = 0; ; round++) {
+		for (i = round % 4; i < NFILES; i += 4) {
+			name(path, i);
+			if ((f = open(path, O_WRONLY|O_CREAT)) < 0)
+				panic("open %s: %e", path, f);
+			// Sizes that cross into the indirect block and back
+			seek(f, (round * 7 + i) % 16 * PGSIZE);
+			if ((r = write(f, buf, sizeof(buf))) != sizeof(buf))
+				panic("write %s: %e", path, r);
+			if ((round + i) % 3 == 0 && (r = ftruncate(f, PGSIZE)) < 0)
+				panic("ftruncate %s: %e", path, r);
+			close(f);
+		}
+		for (i = (round + 2) % 4; i < NFILES; i += 8) {
+			name(path, i);
+			if ((r = remove(path)) < 0 && r != -E_NOT_FOUND)
+				panic("remove %s: %e", path, r);
+		}
+		cprintf("crashfs: round %d\n", round);
+	}
+}
@@ -0,0 +1,17 @@
+// Check the file system for inconsistencies.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	binaryname = "fsck";
+	if ((r = fscheck()) < 0)
+		panic("fscheck: %e", r);
+	if (r == 0)
+		printf("fsck: file system is clean\n");
+	else
+		printf("fsck: %d problems\n", r);
+}
@@ -0,0 +1,24 @@
+// Print the file server's block cache and disk statistics.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	struct Fsstats st;
+	int r;
+
+	binaryname = "fsstat";
+	if ((r = fsstats(&st)) < 0)
+		panic("fsstats: %e", r);
+	printf("cache    %u/%u blocks\n", st.st_cached, st.st_capacity);
+	printf("hits     %u\n", st.st_hits);
+	printf("misses   %u\n", st.st_misses);
+	printf("evicted  %u (%u written back)\n", st.st_evictions,
+	       st.st_writebacks);
+	printf("disk     %u commands, %u blocks\n", st.st_diskcmds,
+	       st.st_diskblocks);
+	printf("free     %u/%u blocks\n", st.st_freeblocks, st.st_nblocks);
+	printf("journal  %u commits, %u blocks\n", st.st_commits,
+	       st.st_journaled);
+}
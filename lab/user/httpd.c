@@ -10,6 +10,11 @@
 
 #define BUFFSIZE 512
 #define MAXPENDING 5	// Max connection requests
+// Max connections served at once, by socket fd.  A connection that is
+// sending holds two of the 1024 fds a program may have open, its
+// socket and the file, so in practice about half as many are served.
+#define MAXCONNS 1024
+#define NEVENTS 64	// Max events taken per epoll_wait
 
 struct http_request {
 	int sock;
@@ -73,28 +78,25 @@ send_header(struct http_request *req, int code)
 	return 0;
 }
 
+// Send the next piece of the file open on 'fd'.
+// Returns 1 if there is more to send, 0 at the end of the file.
 static int
 send_data(struct http_request *req, int fd)
 {
 	// LAB 6: Your code here.
     int r;
-    struct Stat statbuf;
-    char buf[2048];
-    if ((r = fstat(fd, &statbuf)) < 0)
+    // Each write to a socket carries less than 1600 bytes
+    char buf[1024];
+    if ((r = read(fd, (void *)buf, sizeof(buf))) > 0)
     {
-        panic("send_data: can't open fd");    
+        if (write(req->sock, buf, r) != r)
+        {
+            panic("send_data: write fail"); 
+        }
     }
-	r = snprintf(buf, 4096, "Content-Length: %ld\r\n", statbuf.st_size);
-	if (r > 4095)
-		panic("buffer too small!");
-    r = readn(fd, (void *)buf, statbuf.st_size); 
-    if (r != statbuf.st_size)
+    if (r < 0)
         panic("send_data: reading wrong");
-    if (write(req->sock, buf, r) != r)
-    {
-        panic("send_data: write fail"); 
-    }
-    return 0;
+    return r > 0;
 
 }
 
@@ -228,8 +230,10 @@ send_error(struct http_request *req, int code)
 	return 0;
 }
 
+// Answer the request, and leave the file it asks for open in
+// *fd_store for send_data to send, or set *fd_store to -1.
 static int
-send_file(struct http_request *req)
+send_file(struct http_request *req, int *fd_store)
 {
 	int r;
 	off_t file_size = -1;
@@ -272,47 +276,131 @@ send_file(struct http_request *req)
 	if ((r = send_header_fin(req)) < 0)
 		goto end;
 
-	r = send_data(req, fd);
+	*fd_store = fd;
+	return 0;
 
 end:
 	close(fd);
+	*fd_store = -1;
 	return r;
 }
 
+// The state of a connection: first its request arrives, then the file
+// it asks for goes out.  Connections are known by their socket's fd.
+struct conn {
+	uint16_t serial;	// tells it from earlier users of the fd
+	int fd;			// file being sent, or -1
+	int len;		// bytes of the request received
+	char buffer[BUFFSIZE];
+};
+
+// The data of a connection's epoll events: its socket's fd, and its
+// serial number, so that an event still to be handled for a closed
+// connection does not reach one accepted on the same fd since
+#define EV_DATA(sock, serial)	((uint32_t) (serial) << 16 | (sock))
+
+static struct conn *conns[MAXCONNS];
+static uint16_t conn_serial;
+static int epfd;
+
 static void
-handle_client(int sock)
+conn_close(int sock)
 {
-	struct http_request con_d;
-	int r;
-	char buffer[BUFFSIZE];
-	int received = -1;
-	struct http_request *req = &con_d;
+	struct conn *c = conns[sock];
 
-	while (1)
-	{
-		// Receive message
-		if ((received = read(sock, buffer, BUFFSIZE)) < 0)
-			panic("failed to read");
+	epoll_ctl(epfd, EPOLL_CTL_DEL, sock, NULL);
+	if (c->fd >= 0)
+		close(c->fd);
+	close(sock);
+	free(c);
+	conns[sock] = NULL;
+}
 
-		memset(req, 0, sizeof(req));
+static void
+conn_new(int sock)
+{
+	struct epoll_event ev;
+	struct conn *c;
 
-		req->sock = sock;
+	if (sock >= MAXCONNS || !(c = malloc(sizeof(*c)))) {
+		close(sock);
+		return;
+	}
+	// Serial 0 is the server socket's
+	if (++conn_serial == 0)
+		conn_serial = 1;
+	c->serial = conn_serial;
+	c->fd = -1;
+	c->len = 0;
+	conns[sock] = c;
+	ev.events = POLLIN;
+	ev.data = EV_DATA(sock, c->serial);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+		conn_close(sock);
+}
 
-		r = http_request_parse(req, buffer);
-		if (r == -E_BAD_REQ)
-			send_error(req, 400);
-		else if (r < 0)
-			panic("parse failed");
-		else
-			send_file(req);
+// Has the blank line that ends the request's headers arrived?
+static bool
+request_done(const char *p)
+{
+	for (; *p; p++)
+		if (p[0] == '\n' && (p[1] == '\n' || (p[1] == '\r' && p[2] == '\n')))
+			return 1;
+	return 0;
+}
 
-		req_free(req);
+// Take in what has arrived of the request on 'sock', and once it is
+// all there, answer it.
+static void
+handle_request(int sock)
+{
+	struct conn *c = conns[sock];
+	struct http_request con_d;
+	struct http_request *req = &con_d;
+	struct epoll_event ev;
+	int r;
 
-		// no keep alive
-		break;
+	if ((r = read(sock, c->buffer + c->len, BUFFSIZE - 1 - c->len)) <= 0) {
+		conn_close(sock);
+		return;
+	}
+	c->len += r;
+	c->buffer[c->len] = '\0';
+	// Wait for the end of the headers, unless there is no more room
+	if (!request_done(c->buffer) && c->len < BUFFSIZE - 1)
+		return;
+
+	memset(req, 0, sizeof(*req));
+	req->sock = sock;
+
+	r = http_request_parse(req, c->buffer);
+	if (r == -E_BAD_REQ)
+		send_error(req, 400);
+	else if (r < 0)
+		panic("parse failed");
+	else
+		send_file(req, &c->fd);
+
+	req_free(req);
+
+	// no keep alive
+	if (c->fd < 0) {
+		conn_close(sock);
+		return;
 	}
+	ev.events = POLLOUT;
+	ev.data = EV_DATA(sock, c->serial);
+	epoll_ctl(epfd, EPOLL_CTL_MOD, sock, &ev);
+}
 
-	close(sock);
+static void
+handle_send(int sock)
+{
+	struct http_request req;
+
+	req.sock = sock;
+	if (!send_data(&req, conns[sock]->fd))
+		conn_close(sock);
 }
 
 void
@@ -320,6 +408,9 @@ umain(int argc, char **argv)
 {
 	int serversock, clientsock;
 	struct sockaddr_in server, client;
+	struct epoll_event ev, events[NEVENTS];
+	int i, n, sock;
+	struct conn *c;
 
 	binaryname = "jhttpd";
 
@@ -344,18 +435,43 @@ umain(int argc, char **argv)
 	if (listen(serversock, MAXPENDING) < 0)
 		die("Failed to listen on server socket");
 
+	// Serve every connection at once, each as far as it can go
+	// without waiting
+	if ((epfd = epoll_create()) < 0)
+		die("Failed to create epoll instance");
+	ev.events = POLLIN;
+	ev.data = EV_DATA(serversock, 0);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, serversock, &ev) < 0)
+		die("Failed to watch server socket");
+
 	cprintf("Waiting for http connections...\n");
 
 	while (1) {
-		unsigned int clientlen = sizeof(client);
-		// Wait for client connection
-		if ((clientsock = accept(serversock,
-					 (struct sockaddr *) &client,
-					 &clientlen)) < 0)
-		{
-			die("Failed to accept client connection");
+		if ((n = epoll_wait(epfd, events, NEVENTS, -1)) < 0)
+			die("Failed to wait for connections");
+		for (i = 0; i < n; i++) {
+			sock = events[i].data & 0xffff;
+			c = conns[sock];
+			if (events[i].data == EV_DATA(serversock, 0)) {
+				unsigned int clientlen = sizeof(client);
+				// A client connection is waiting
+				if ((clientsock = accept(serversock,
+							 (struct sockaddr *) &client,
+							 &clientlen)) < 0)
+				{
+					cprintf("Failed to accept client connection: %e\n",
+						clientsock);
+					continue;
+				}
+				conn_new(clientsock);
+			} else if (!c || c->serial != events[i].data >> 16)
+				// Closed earlier in this batch
+				continue;
+			else if (c->fd < 0)
+				handle_request(sock);
+			else
+				handle_send(sock);
 		}
-		handle_client(clientsock);
 	}
 
 	close(serversock);
@@ -297,6 +297,9 @@ umain(int argc, char **argv)
 		if ((r = open(argv[1], O_RDONLY)) < 0)
 			panic("open %s: %e", argv[1], r);
 		assert(r == 0);
+		// readline reads a byte at a time; buffer the script.
+		// Commands we spawn share fd 0 and its buffer.
+		setbuf(0, PGSIZE);
 	}
 	if (interactive == '?')
 		interactive = iscons(0);